@@ -0,0 +1,73 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include "compressed_cache.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+CompressedCache::CompressedCache(std::size_t capacity) :
+	capacity_(capacity), size_(0)
+{
+}
+
+CompressedCache::~CompressedCache() {
+}
+
+bool
+CompressedCache::find(const std::string &key, std::string &out) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = index_.find(key);
+	if (index_.end() == it) {
+		return false;
+	}
+	entries_.splice(entries_.begin(), entries_, it->second);
+	out.append(it->second->second);
+	return true;
+}
+
+void
+CompressedCache::insert(const std::string &key, const std::string &value) {
+	if (value.size() > capacity_) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (index_.end() != index_.find(key)) {
+		return;
+	}
+	entries_.emplace_front(key, value);
+	index_[key] = entries_.begin();
+	size_ += value.size();
+	while (size_ > capacity_) {
+		const auto &last = entries_.back();
+		size_ -= last.second.size();
+		index_.erase(last.first);
+		entries_.pop_back();
+	}
+}
+
+std::size_t
+CompressedCache::capacity() const {
+	return capacity_;
+}
+
+} // namespace fastcgi
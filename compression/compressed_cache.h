@@ -0,0 +1,60 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_COMPRESSION_COMPRESSED_CACHE_H_
+#define _FASTCGI_COMPRESSION_COMPRESSED_CACHE_H_
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+namespace fastcgi
+{
+
+/**
+ * Compressed variants of the responses keyed by the digest of the uncompressed
+ * body and the encoding. The least recently used entries are evicted
+ * when the total size of the compressed data exceeds the capacity.
+ */
+class CompressedCache {
+public:
+	CompressedCache(std::size_t capacity);
+	~CompressedCache();
+
+	CompressedCache(const CompressedCache&) = delete;
+	CompressedCache& operator=(const CompressedCache&) = delete;
+
+	bool find(const std::string &key, std::string &out);
+	void insert(const std::string &key, const std::string &value);
+
+	std::size_t capacity() const;
+
+private:
+	using EntryList = std::list<std::pair<std::string, std::string>>;
+
+	std::mutex mutex_;
+	std::size_t capacity_;
+	std::size_t size_;
+	EntryList entries_;
+	std::unordered_map<std::string, EntryList::iterator> index_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_COMPRESSION_COMPRESSED_CACHE_H_
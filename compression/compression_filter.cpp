@@ -0,0 +1,201 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "fastcgi3/component_factory.h"
+#include "fastcgi3/config.h"
+#include "fastcgi3/request.h"
+#include "fastcgi3/util.h"
+
+#include "compressed_cache.h"
+#include "compression_filter.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+const std::string CompressionFilter::COMPONENT_NAME {"compression-filter"};
+
+// Content types which are compressed already: the prefixes end with '/'
+static const std::string DEFAULT_EXCLUDED_TYPES {
+	"image/ audio/ video/ font/woff font/woff2 application/zip application/gzip application/x-gzip "
+	"application/x-bzip2 application/x-xz application/x-7z-compressed application/x-rar-compressed "
+	"application/pdf application/octet-stream"
+};
+
+// Static assets: the same body is sent to many clients
+static const std::string DEFAULT_CACHED_TYPES {
+	"text/css text/javascript application/javascript image/svg+xml"
+};
+
+static std::string
+lowerCase(const std::string &value) {
+	std::string res(value);
+	std::transform(res.begin(), res.end(), res.begin(), ::tolower);
+	return res;
+}
+
+CompressionFilter::CompressionFilter(std::shared_ptr<ComponentContext> context) :
+	Component(context), level_(Z_DEFAULT_COMPRESSION), cache_max_body_(0)
+{
+}
+
+CompressionFilter::~CompressionFilter() {
+}
+
+void
+CompressionFilter::onLoad() {
+	const Config *config = context()->getConfig();
+	const std::string componentXPath = context()->getComponentXPath();
+
+	level_ = config->asInt(componentXPath + "/level", 6);
+	if (level_ < Z_NO_COMPRESSION || level_ > Z_BEST_COMPRESSION) {
+		throw std::runtime_error("Compression level must be in range 0..9");
+	}
+
+	parseTypes(config->asString(componentXPath + "/excluded-types", DEFAULT_EXCLUDED_TYPES), excluded_types_);
+
+	// Cache of the compressed responses: total size in bytes, 0 - disabled
+	const int cacheSize = config->asInt(componentXPath + "/cache-size", 0);
+	cache_max_body_ = static_cast<std::size_t>(std::max(0, config->asInt(componentXPath + "/cache-max-body", 1024 * 1024)));
+	parseTypes(config->asString(componentXPath + "/cache-types", DEFAULT_CACHED_TYPES), cached_types_);
+	if (cacheSize > 0 && cache_max_body_ > 0 && !cached_types_.empty()) {
+		cache_ = std::make_unique<CompressedCache>(cacheSize);
+	}
+}
+
+void
+CompressionFilter::onUnload() {
+	cache_.reset();
+}
+
+void
+CompressionFilter::doFilter(Request *req, HandlerContext *context, std::function<void(Request *req, HandlerContext *context)> next) {
+	if (!req->headersSent()) {
+		req->setEncoder(std::make_unique<ZlibEncoder>(this, negotiate(req->getHeader("Accept-Encoding"))));
+	}
+	next(req, context);
+}
+
+int
+CompressionFilter::level() const {
+	return level_;
+}
+
+bool
+CompressionFilter::compressible(const std::string &contentType) const {
+	return !matches(excluded_types_, contentType);
+}
+
+bool
+CompressionFilter::cacheable(const std::string &contentType) const {
+	return cache_ && matches(cached_types_, contentType);
+}
+
+CompressedCache*
+CompressionFilter::cache() const {
+	return cache_.get();
+}
+
+std::size_t
+CompressionFilter::cacheMaxBody() const {
+	return cache_max_body_;
+}
+
+ZlibEncoder::Encoding
+CompressionFilter::negotiate(const std::string &acceptEncoding) {
+	double gzip = 0.0, deflate = 0.0, any = 0.0;
+	bool hasGzip = false, hasDeflate = false;
+
+	std::vector<std::string> codings;
+	StringUtils::split(acceptEncoding, ',', codings);
+	for (auto &c : codings) {
+		std::vector<std::string> params;
+		StringUtils::split(c, ';', params);
+		if (params.empty()) {
+			continue;
+		}
+		const std::string name = lowerCase(StringUtils::trim(params[0]));
+		double q = 1.0;
+		for (std::size_t i = 1; i < params.size(); ++i) {
+			const std::string param = StringUtils::trim(params[i]);
+			if (StringUtils::beginsWith(param, "q=")) {
+				q = atof(param.c_str() + 2);
+			}
+		}
+		if ("gzip" == name || "x-gzip" == name) {
+			gzip = q;
+			hasGzip = true;
+		} else if ("deflate" == name) {
+			deflate = q;
+			hasDeflate = true;
+		} else if ("*" == name) {
+			any = q;
+		}
+	}
+	if (!hasGzip) {
+		gzip = any;
+	}
+	if (!hasDeflate) {
+		deflate = any;
+	}
+
+	if (gzip > 0.0 && gzip >= deflate) {
+		return ZlibEncoder::Encoding::GZIP;
+	}
+	if (deflate > 0.0) {
+		return ZlibEncoder::Encoding::DEFLATE;
+	}
+	return ZlibEncoder::Encoding::IDENTITY;
+}
+
+void
+CompressionFilter::parseTypes(const std::string &value, std::vector<std::string> &types) {
+	std::vector<std::string> values;
+	StringUtils::split(value, ' ', values);
+	for (auto &v : values) {
+		const std::string type = lowerCase(StringUtils::trim(v));
+		if (!type.empty()) {
+			types.push_back(type);
+		}
+	}
+}
+
+bool
+CompressionFilter::matches(const std::vector<std::string> &types, const std::string &contentType) {
+	const std::string type = lowerCase(StringUtils::trim(contentType.substr(0, contentType.find(';'))));
+	for (auto &t : types) {
+		if ('/' == t.back() ? StringUtils::beginsWith(type, t) : type == t) {
+			return true;
+		}
+	}
+	return false;
+}
+
+FCGIDAEMON_REGISTER_FACTORIES_BEGIN()
+FCGIDAEMON_ADD_DEFAULT_FACTORY(fastcgi::CompressionFilter::COMPONENT_NAME, fastcgi::CompressionFilter)
+FCGIDAEMON_REGISTER_FACTORIES_END()
+
+} // namespace fastcgi
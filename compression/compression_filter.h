@@ -0,0 +1,84 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_COMPRESSION_COMPRESSION_FILTER_H_
+#define _FASTCGI_COMPRESSION_COMPRESSION_FILTER_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "fastcgi3/component.h"
+#include "fastcgi3/handler.h"
+
+#include "zlib_encoder.h"
+
+namespace fastcgi
+{
+
+class CompressedCache;
+
+/**
+ * Compresses the response body with gzip or deflate negotiated by Accept-Encoding.
+ * The responses with already compressed content types are sent as is.
+ */
+class CompressionFilter : virtual public Filter, virtual public Component {
+public:
+	static const std::string COMPONENT_NAME;
+
+public:
+	CompressionFilter(std::shared_ptr<ComponentContext> context);
+	virtual ~CompressionFilter();
+
+	virtual void onLoad() override;
+	virtual void onUnload() override;
+
+	virtual void doFilter(Request *req, HandlerContext *context, std::function<void(Request *req, HandlerContext *context)> next) override;
+
+	int level() const;
+	bool compressible(const std::string &contentType) const;
+
+	/**
+	 * Only the responses of the cached types are retained for the cache,
+	 * the others are compressed as they are written
+	 */
+	bool cacheable(const std::string &contentType) const;
+
+	/**
+	 * Returns nullptr if the cache is disabled
+	 */
+	CompressedCache* cache() const;
+	std::size_t cacheMaxBody() const;
+
+	static ZlibEncoder::Encoding negotiate(const std::string &acceptEncoding);
+
+private:
+	static void parseTypes(const std::string &value, std::vector<std::string> &types);
+	static bool matches(const std::vector<std::string> &types, const std::string &contentType);
+
+private:
+	int level_;
+	std::vector<std::string> excluded_types_;
+	std::vector<std::string> cached_types_;
+	std::size_t cache_max_body_;
+	std::unique_ptr<CompressedCache> cache_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_COMPRESSION_COMPRESSION_FILTER_H_
@@ -0,0 +1,163 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstring>
+#include <stdexcept>
+
+#include "fastcgi3/request.h"
+#include "fastcgi3/util.h"
+
+#include "compressed_cache.h"
+#include "compression_filter.h"
+#include "zlib_encoder.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const std::size_t OUTPUT_CHUNK_SIZE = 16 * 1024;
+
+ZlibEncoder::ZlibEncoder(const CompressionFilter *filter, Encoding encoding) :
+	filter_(filter), encoding_(encoding), initialized_(false), buffering_(false)
+{
+	memset(&stream_, 0, sizeof(stream_));
+}
+
+ZlibEncoder::~ZlibEncoder() {
+	if (initialized_) {
+		deflateEnd(&stream_);
+	}
+}
+
+const char*
+ZlibEncoder::name(Encoding encoding) {
+	switch (encoding) {
+	case Encoding::GZIP:
+		return "gzip";
+	case Encoding::DEFLATE:
+		return "deflate";
+	default:
+		return "identity";
+	}
+}
+
+bool
+ZlibEncoder::start(Request *request) {
+	const unsigned short status = request->status();
+	if (status < 200 || 204 == status || 206 == status || 304 == status) {
+		return false;
+	}
+	if (!request->outputHeader("Content-Encoding").empty() ||
+		!filter_->compressible(request->outputHeader("Content-Type"))) {
+		return false;
+	}
+
+	// The response differs by Accept-Encoding even if it is not compressed for this client
+	const std::string vary = request->outputHeader("Vary");
+	if (vary.empty()) {
+		request->setHeader("Vary", "Accept-Encoding");
+	} else if (std::string::npos == vary.find("Accept-Encoding") && "*" != vary) {
+		request->setHeader("Vary", vary + ", Accept-Encoding");
+	}
+
+	if (Encoding::IDENTITY == encoding_) {
+		return false;
+	}
+	request->setHeader("Content-Encoding", name(encoding_));
+	buffering_ = filter_->cacheable(request->outputHeader("Content-Type"));
+	return true;
+}
+
+void
+ZlibEncoder::encode(const char *data, std::size_t size, Mode mode, std::string &out) {
+	if (buffering_) {
+		if (size > 0) {
+			pending_.append(data, size);
+		}
+		if (Mode::FINISH == mode) {
+			const std::string key = std::string(name(encoding_)) + ":" +
+				HashUtils::hexMD5(pending_.data(), pending_.size());
+			if (!filter_->cache()->find(key, out)) {
+				std::string compressed;
+				compressPending(Z_FINISH, compressed);
+				filter_->cache()->insert(key, compressed);
+				out.append(compressed);
+			}
+			return;
+		}
+		if (Mode::WRITE == mode && pending_.size() <= filter_->cacheMaxBody()) {
+			return;
+		}
+		// Too large to be cached or the client is waiting for the data
+		buffering_ = false;
+		compressPending(Mode::FLUSH == mode ? Z_SYNC_FLUSH : Z_NO_FLUSH, out);
+		return;
+	}
+
+	switch (mode) {
+	case Mode::WRITE:
+		compress(data, size, Z_NO_FLUSH, out);
+		break;
+	case Mode::FLUSH:
+		compress(data, size, Z_SYNC_FLUSH, out);
+		break;
+	case Mode::FINISH:
+		compress(data, size, Z_FINISH, out);
+		break;
+	}
+}
+
+void
+ZlibEncoder::compressPending(int flush, std::string &out) {
+	compress(pending_.data(), pending_.size(), flush, out);
+	std::string().swap(pending_);
+}
+
+void
+ZlibEncoder::compress(const char *data, std::size_t size, int flush, std::string &out) {
+	if (!initialized_) {
+		// 16 is added to the window bits for the gzip header and trailer
+		const int windowBits = Encoding::GZIP == encoding_ ? 15 + 16 : 15;
+		if (Z_OK != deflateInit2(&stream_, filter_->level(), Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY)) {
+			throw std::runtime_error("Cannot initialize zlib stream");
+		}
+		initialized_ = true;
+	}
+	if (0 == size && Z_NO_FLUSH == flush) {
+		return;
+	}
+
+	stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	stream_.avail_in = static_cast<uInt>(size);
+	do {
+		const std::size_t pos = out.size();
+		out.resize(pos + OUTPUT_CHUNK_SIZE);
+		stream_.next_out = reinterpret_cast<Bytef*>(&out[pos]);
+		stream_.avail_out = OUTPUT_CHUNK_SIZE;
+		const int res = deflate(&stream_, flush);
+		if (Z_STREAM_ERROR == res) {
+			throw std::runtime_error("Cannot compress the response body");
+		}
+		out.resize(pos + OUTPUT_CHUNK_SIZE - stream_.avail_out);
+	} while (0 == stream_.avail_out || stream_.avail_in > 0);
+}
+
+} // namespace fastcgi
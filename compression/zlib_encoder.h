@@ -0,0 +1,73 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_COMPRESSION_ZLIB_ENCODER_H_
+#define _FASTCGI_COMPRESSION_ZLIB_ENCODER_H_
+
+#include <string>
+
+#include <zlib.h>
+
+#include "fastcgi3/response_encoder.h"
+
+namespace fastcgi
+{
+
+class CompressionFilter;
+
+/**
+ * Incremental gzip/deflate compression of the response body.
+ *
+ * The body of a cached content type is retained until the response is
+ * finished, so the compressed variant of the same body is taken from
+ * the cache. The other bodies, those larger than the cache-max-body
+ * and the flushed responses are compressed as they are written.
+ */
+class ZlibEncoder : public ResponseEncoder {
+public:
+	/**
+	 * IDENTITY - the client does not accept compression,
+	 * only Vary is added to the compressible responses
+	 */
+	enum class Encoding {IDENTITY, GZIP, DEFLATE};
+
+public:
+	ZlibEncoder(const CompressionFilter *filter, Encoding encoding);
+	virtual ~ZlibEncoder();
+
+	virtual bool start(Request *request) override;
+	virtual void encode(const char *data, std::size_t size, Mode mode, std::string &out) override;
+
+	static const char* name(Encoding encoding);
+
+private:
+	void compress(const char *data, std::size_t size, int flush, std::string &out);
+	void compressPending(int flush, std::string &out);
+
+private:
+	const CompressionFilter *filter_;
+	Encoding encoding_;
+	bool initialized_;
+	bool buffering_;
+	std::string pending_;
+	z_stream stream_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_COMPRESSION_ZLIB_ENCODER_H_
@@ -0,0 +1,92 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_DETAILS_ASYNC_REACTOR_H_
+#define _FASTCGI_DETAILS_ASYNC_REACTOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace fastcgi
+{
+
+class Logger;
+
+/**
+ * Waits for the sockets and the timers of the suspended asynchronous handlers.
+ * The callbacks are invoked on the reactor thread and are expected only
+ * to schedule the continuations on the pool.
+ */
+class AsyncReactor {
+public:
+	using CallbackType = std::function<void(bool ready)>;
+	using TimePoint = std::chrono::steady_clock::time_point;
+
+public:
+	explicit AsyncReactor(std::shared_ptr<Logger> logger);
+	~AsyncReactor();
+
+	AsyncReactor(const AsyncReactor&) = delete;
+	AsyncReactor& operator=(const AsyncReactor&) = delete;
+
+	/**
+	 * Invokes the callback once the descriptor is ready for the events (ready is true)
+	 * or the deadline passes (ready is false), TimePoint::max() - no deadline
+	 */
+	void wait(int fd, std::uint32_t events, TimePoint deadline, CallbackType callback);
+
+	/**
+	 * Invokes the callback with ready = false at the deadline
+	 */
+	void wait(TimePoint deadline, CallbackType callback);
+
+	void stop();
+
+private:
+	struct Waiter {
+		int fd;
+		CallbackType callback;
+		std::multimap<TimePoint, std::uint64_t>::iterator timer;
+	};
+
+	void run();
+	void wakeup();
+	void add(int fd, std::uint32_t events, TimePoint deadline, CallbackType callback);
+
+private:
+	std::shared_ptr<Logger> logger_;
+	int epoll_;
+	int wakeup_;
+	std::atomic<bool> stopped_;
+	std::mutex mutex_;
+	std::uint64_t next_id_;
+	std::unordered_map<std::uint64_t, Waiter> waiters_;
+	std::multimap<TimePoint, std::uint64_t> timers_;
+	std::unique_ptr<std::thread> thread_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_ASYNC_REACTOR_H_
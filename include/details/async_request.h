@@ -0,0 +1,105 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_DETAILS_ASYNC_REQUEST_H_
+#define _FASTCGI_DETAILS_ASYNC_REQUEST_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "fastcgi3/async_handler.h"
+
+#include "details/request_thread_pool.h"
+
+namespace fastcgi
+{
+
+/**
+ * Request suspended by an asynchronous handler.
+ *
+ * The steps of the request (the continuations of the handler) are executed
+ * on the pool one at a time: a step scheduled while another one is running
+ * is posted to the pool when the running step returns.
+ */
+class AsyncRequest : public AsyncContext, public std::enable_shared_from_this<AsyncRequest> {
+public:
+	using StepType = std::function<void()>;
+
+public:
+	AsyncRequest(RequestsThreadPool *pool, const RequestTask &task, std::shared_ptr<HandlerContext> context);
+	virtual ~AsyncRequest();
+
+	virtual void waitReadable(int fd, std::chrono::milliseconds timeout, WaitType next) override;
+	virtual void waitWritable(int fd, std::chrono::milliseconds timeout, WaitType next) override;
+	virtual void sleep(std::chrono::milliseconds delay, ResumeType next) override;
+	virtual void invoke(std::shared_ptr<Handler> handler, ResumeType next) override;
+	virtual void complete() override;
+	virtual void fail(std::exception_ptr error) override;
+
+	RequestTask& task();
+	std::shared_ptr<HandlerContext> context() const;
+
+	/**
+	 * The handler is suspended, the request continues from the handler number next
+	 */
+	void suspend(std::size_t next);
+	std::size_t next() const;
+	bool completed() const;
+
+	void schedule(StepType step);
+
+	/**
+	 * The running step has returned
+	 */
+	void release();
+
+	/**
+	 * The response is sent, the steps scheduled later are dropped
+	 */
+	void finish();
+	bool finished() const;
+
+private:
+	void post(StepType step);
+	void wait(int fd, std::uint32_t events, std::chrono::milliseconds timeout, WaitType next);
+	std::chrono::steady_clock::time_point deadline(std::chrono::milliseconds timeout) const;
+	void watchCancellation();
+
+private:
+	RequestsThreadPool *pool_;
+	RequestTask task_;
+	std::shared_ptr<HandlerContext> context_;
+	std::shared_ptr<CancellationToken> cancellation_;
+	unsigned priority_;
+	std::size_t next_;
+	bool completed_;
+	bool watched_;
+
+	mutable std::mutex mutex_;
+	bool running_;
+	bool finished_;
+	std::deque<StepType> steps_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_ASYNC_REQUEST_H_
@@ -0,0 +1,106 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_DETAILS_BACKGROUND_EXECUTOR_H_
+#define _FASTCGI_DETAILS_BACKGROUND_EXECUTOR_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fastcgi3/executor.h"
+
+namespace fastcgi
+{
+
+class Logger;
+
+struct ExecutorInfo
+{
+	uint64_t threadsNumber;
+	uint64_t queueLength;
+	uint64_t currentQueue;
+	uint64_t busyThreadsCounter;
+	uint64_t completedTasksCounter;
+	uint64_t failedTasksCounter;
+	uint64_t droppedTasksCounter;
+};
+
+/**
+ * Executor with a fixed number of threads and the queue of at most queueLength tasks.
+ * REJECT: the task which does not fit is dropped;
+ * DROP_OLDEST: the oldest queued task of the lowest priority not higher than the priority
+ * of the new one is dropped instead, the new task is dropped if there is none.
+ * The stopped executor accepts no tasks, the queued ones are still run.
+ */
+class BackgroundExecutor : public Executor {
+public:
+	enum class DropPolicy {REJECT, DROP_OLDEST};
+
+public:
+	BackgroundExecutor(unsigned threadsNumber, unsigned queueLength, DropPolicy dropPolicy);
+	virtual ~BackgroundExecutor();
+
+	BackgroundExecutor(const BackgroundExecutor&) = delete;
+	BackgroundExecutor& operator=(const BackgroundExecutor&) = delete;
+
+	virtual bool submit(std::function<void()> task, Priority priority = Priority::NORMAL) override;
+
+	/**
+	 * The tasks submitted before the executor is started wait in the queue
+	 */
+	void start(std::shared_ptr<Logger> logger);
+	void stop();
+	void join();
+
+	DropPolicy dropPolicy() const;
+	ExecutorInfo getInfo() const;
+
+private:
+	void workMethod();
+	bool take(std::function<void()> &task);
+
+private:
+	static const unsigned PRIORITIES = 3;
+
+	const unsigned threads_number_;
+	const std::size_t queue_length_;
+	const DropPolicy drop_policy_;
+	std::shared_ptr<Logger> logger_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable condition_;
+	std::deque<std::function<void()>> queues_[PRIORITIES];
+	std::size_t size_;
+	bool started_;
+	bool stopped_;
+	std::vector<std::unique_ptr<std::thread>> threads_;
+
+	std::uint64_t busy_;
+	std::uint64_t completed_;
+	std::uint64_t failed_;
+	std::uint64_t dropped_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_BACKGROUND_EXECUTOR_H_
@@ -0,0 +1,94 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+#ifndef _FASTCGI_DETAILS_BULKHEAD_H_
+#define _FASTCGI_DETAILS_BULKHEAD_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace fastcgi
+{
+
+class RequestsThreadPool;
+struct RequestTask;
+
+/**
+ * Limits the number of requests of a handler executed at once, so a slow handler
+ * cannot occupy all the threads of its pool. A request without a permit waits
+ * in the bulkhead (not holding a thread) until a permit is released, the request
+ * is rejected if the bulkhead already has queueLength requests waiting.
+ */
+class Bulkhead : public std::enable_shared_from_this<Bulkhead> {
+public:
+	/**
+	 * Held by the request while it is executed, the permit is released
+	 * when the last copy of the request task is dropped
+	 */
+	class Permit {
+	public:
+		explicit Permit(std::shared_ptr<Bulkhead> bulkhead);
+		~Permit();
+
+		Permit(const Permit&) = delete;
+		Permit& operator=(const Permit&) = delete;
+
+	private:
+		std::shared_ptr<Bulkhead> bulkhead_;
+	};
+
+public:
+	Bulkhead(unsigned maxConcurrency, unsigned queueLength);
+	~Bulkhead();
+
+	Bulkhead(const Bulkhead&) = delete;
+	Bulkhead& operator=(const Bulkhead&) = delete;
+
+	/**
+	 * Gives the permit to the task or puts the task aside until a permit
+	 * is released, then the task is added to the pool again.
+	 * Returns false if the task is rejected.
+	 */
+	bool acquire(RequestTask &task, RequestsThreadPool *pool);
+
+	unsigned maxConcurrency() const;
+	unsigned queueLength() const;
+	unsigned running() const;
+	std::uint64_t rejectedCounter() const;
+
+private:
+	struct Waiting;
+
+	bool tryAcquire();
+	void release();
+
+private:
+	const unsigned max_concurrency_;
+	const unsigned queue_length_;
+	std::atomic<unsigned> running_;
+	std::atomic<std::uint64_t> rejected_;
+
+	std::mutex mutex_;
+	std::deque<std::unique_ptr<Waiting>> waiting_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_BULKHEAD_H_
@@ -37,6 +37,7 @@ public:
 
     virtual const Config* getConfig() const;
     virtual std::string getComponentXPath() const;
+    virtual std::shared_ptr<Executor> getExecutor(const std::string &name = std::string()) const;
 
     const Globals* globals() const;
 
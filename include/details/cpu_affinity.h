@@ -0,0 +1,77 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_DETAILS_CPU_AFFINITY_H_
+#define _FASTCGI_DETAILS_CPU_AFFINITY_H_
+
+#include <string>
+#include <vector>
+
+namespace fastcgi
+{
+
+/**
+ * CPUs a thread is pinned to. The thread bound to a NUMA node runs on the CPUs
+ * of the node and prefers the memory of the node, so the data it touches
+ * (the stack, the requests, the buffers) stays node-local.
+ * The topology is read from /sys/devices/system/node, libnuma is not needed.
+ */
+class CpuAffinity {
+public:
+	/**
+	 * The thread is not pinned
+	 */
+	CpuAffinity();
+
+	/**
+	 * Affinity configured either by the list of CPUs or by the NUMA node (-1 - none)
+	 */
+	static CpuAffinity create(const std::string &cpus, int node);
+
+	/**
+	 * Parses the list like "0-7,16-23"
+	 */
+	static std::vector<unsigned> parseList(const std::string &list);
+
+	static std::vector<unsigned> onlineNodes();
+
+	/**
+	 * NUMA node of the CPU the calling thread runs on, -1 if unknown
+	 */
+	static int currentNode();
+
+	bool empty() const;
+	int numaNode() const;
+	std::string toString() const;
+
+	/**
+	 * Pins the calling thread, returns false if the system refuses
+	 */
+	bool apply() const;
+
+private:
+	static std::string readTopology(const std::string &path);
+
+private:
+	std::vector<unsigned> cpus_;
+	int node_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_CPU_AFFINITY_H_
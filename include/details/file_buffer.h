@@ -52,6 +52,7 @@ public:
 	virtual std::uint64_t size() const;
 	virtual void resize(std::uint64_t size);
 	virtual const std::string& filename() const;
+	int fd() const;
 	virtual DataBufferImpl* getCopy() const;
 private:
 	FileBuffer();
@@ -27,7 +27,9 @@
 namespace fastcgi
 {
 
+class BackgroundExecutor;
 class ComponentSet;
+class Executor;
 class Config;
 class HandlerSet;
 class Loader;
@@ -49,19 +51,46 @@ public:
 	ComponentSet* components() const;
 	HandlerSet* handlers() const;
 	const ThreadPoolMap& pools() const;
+
+	/**
+	 * Pool by the name, the replica of the NUMA node for the pool replicated per node
+	 * (node -1 - the node the calling thread runs on). Returns nullptr if not found.
+	 */
+	RequestsThreadPool* pool(const std::string &name, int node = -1) const;
 	Loader* loader() const;
 	std::shared_ptr<Logger> logger() const;
 
 	void stopThreadPools();
 	void joinThreadPools();
 
+	using ExecutorMap = std::map<std::string, std::shared_ptr<BackgroundExecutor>>;
+
+	const ExecutorMap& executors() const;
+
+	/**
+	 * Executor by the name, the default one for the empty name; nullptr if not found
+	 */
+	std::shared_ptr<Executor> executor(const std::string &name) const;
+
+	/**
+	 * The stopped executors run the queued tasks and accept no more
+	 */
+	void stopExecutors();
+	void joinExecutors();
+
 private:
 	void initPools();
+	void initExecutors();
+	void startExecutors();
 	void initLogger();
 	void startThreadPools();
+	std::shared_ptr<RequestsThreadPool> createPool(const std::string &p, const std::string &poolName, int threadsNumber, int queueLength) const;
 
 private:
 	ThreadPoolMap pools_;
+	ExecutorMap executors_;
+	std::string default_executor_;
+	std::map<std::string, std::map<int, std::shared_ptr<RequestsThreadPool>>> node_pools_;
 	const Config* config_;
 	std::unique_ptr<Loader> loader_;
 	std::unique_ptr<HandlerSet> handlerSet_;
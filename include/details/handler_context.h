@@ -28,8 +28,15 @@ namespace fastcgi
 
 class HandlerContextImpl : public HandlerContext, virtual public AttributesHolder {
 public:
+	HandlerContextImpl();
+	explicit HandlerContextImpl(std::shared_ptr<CancellationToken> cancellation);
+
 	virtual core::any getParam(const std::string &name) const;
 	virtual void setParam(const std::string &name, const core::any &value);
+	virtual std::shared_ptr<CancellationToken> cancellation() const;
+
+private:
+	std::shared_ptr<CancellationToken> cancellation_;
 };
 
 } // namespace fastcgi
@@ -22,6 +22,8 @@
 
 #include <string>
 #include <vector>
+#include <chrono>
+#include <cstdint>
 #include <map>
 #include <set>
 #include <memory>
@@ -29,6 +31,7 @@
 namespace fastcgi
 {
 
+class Bulkhead;
 class Config;
 class ComponentSet;
 class Filter;
@@ -45,6 +48,11 @@ public:
 		std::vector<std::shared_ptr<Handler>> handlers;
 		std::string poolName;
 		std::string id;
+		bool streamBody = false;
+		std::size_t flushThreshold = 0;
+		std::chrono::milliseconds deadline{0};
+		std::string priorityClass;
+		std::shared_ptr<Bulkhead> bulkhead;
 	};
 	using HandlerArray = std::vector<HandlerDescription>;
 
@@ -55,6 +63,19 @@ public:
 	};
 	using FilterArray = std::vector<FilterDescription>;
 
+	/**
+	 * Filters of all the <filter> entries in the order of the configuration,
+	 * compiled once when the handlers are loaded. A request runs the filters
+	 * of the entries it matches: the entry has its bit in the FilterMask.
+	 */
+	struct ChainLink {
+		unsigned entry;
+		std::shared_ptr<Filter> filter;
+	};
+	using FilterChain = std::vector<ChainLink>;
+	using FilterMask = std::uint64_t;
+	static const unsigned MAX_FILTERS = 64;
+
 public:
 	HandlerSet();
 	virtual ~HandlerSet();
@@ -66,20 +87,31 @@ public:
 
 	const HandlerSet::HandlerDescription* findURIHandler(const Request *request) const;
 	const HandlerSet::HandlerDescription* findURIHandler(const std::string &uri) const;
+
+	/**
+	 * The handlers are selected by their urls only, so the handler found
+	 * by the url is the one the whole request selects
+	 */
+	bool urlSelectorsOnly() const;
 	void findPoolHandlers(const std::string &poolName, std::set<std::shared_ptr<Handler>> &handlers) const;
 	std::set<std::string> getPoolsNeeded() const;
 
 	void findURIFilters(const Request *request, std::vector<std::shared_ptr<Filter>> &v) const;
+	FilterMask matchURIFilters(const Request *request) const;
+	const FilterChain& filterChain() const;
 	
 	const std::string& getDefaultPool() const;
 
 private:
 	void initInternal(const Config *config, const ComponentSet *componentSet, const std::string &url_prefix, std::vector<std::string> &v);
+	static bool matches(const SelectorArray &selectors, const Request *request);
 
 private:
 	FilterArray filters_;
+	FilterChain chain_;
 	HandlerArray handlers_;
 	std::string defaultPoolName_;
+	bool urlSelectorsOnly_ = true;
 };
 
 } // namespace fastcgi
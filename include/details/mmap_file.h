@@ -47,6 +47,10 @@ private:
 class MMapFile {
 public:
 	MMapFile(const char *name, std::uint64_t window, bool is_read_only = false);
+	/**
+	 * Maps the already opened file read only, the descriptor is duplicated
+	 */
+	MMapFile(int fd, std::uint64_t window);
 	virtual ~MMapFile();
 
 	std::uint64_t size() const;
@@ -58,6 +62,7 @@ public:
 	std::pair<char*, std::uint64_t> atSegment(std::uint64_t index);
 
 	std::uint64_t window() const;
+	int fd() const;
 
 	MMapFile* clone() const;
 
@@ -0,0 +1,140 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_DETAILS_MPMC_QUEUE_H_
+#define _FASTCGI_DETAILS_MPMC_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace fastcgi {
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue (D. Vyukov's ring).
+ *
+ * Each slot carries a sequence number telling whether it is free for the producer
+ * of the current lap or holds the data for the consumer of the current lap,
+ * so producers and consumers only contend on their own position counters.
+ * The capacity is rounded up to a power of two.
+ */
+template<typename T>
+class MpmcQueue {
+public:
+	explicit MpmcQueue(std::size_t capacity) :
+		mask_(roundUp(capacity) - 1), cells_(new Cell[mask_ + 1])
+	{
+		for (std::size_t i = 0; i <= mask_; ++i) {
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueue_pos_.store(0, std::memory_order_relaxed);
+		dequeue_pos_.store(0, std::memory_order_relaxed);
+	}
+
+	MpmcQueue(const MpmcQueue&) = delete;
+	MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+	/**
+	 * Returns false if the queue is full
+	 */
+	bool push(T &&data) {
+		Cell *cell;
+		std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells_[pos & mask_];
+			const std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+			const std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+			if (0 == dif) {
+				if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = enqueue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = std::move(data);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Returns false if the queue is empty
+	 */
+	bool pop(T &data) {
+		Cell *cell;
+		std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells_[pos & mask_];
+			const std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+			const std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+			if (0 == dif) {
+				if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = dequeue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+		data = std::move(cell->data);
+		// The slot must not keep the references held by the task
+		cell->data = T();
+		cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::size_t capacity() const {
+		return mask_ + 1;
+	}
+
+private:
+	static std::size_t roundUp(std::size_t capacity) {
+		std::size_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		return size;
+	}
+
+private:
+	static const std::size_t CACHE_LINE_SIZE = 64;
+
+	struct Cell {
+		std::atomic<std::size_t> sequence;
+		T data;
+	};
+
+	const std::size_t mask_;
+	std::unique_ptr<Cell[]> cells_;
+
+	// The positions are padded to separate cache lines: producers and consumers
+	// do not invalidate each other's line
+	char pad0_[CACHE_LINE_SIZE];
+	std::atomic<std::size_t> enqueue_pos_;
+	char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+	std::atomic<std::size_t> dequeue_pos_;
+	char pad2_[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_MPMC_QUEUE_H_
@@ -0,0 +1,63 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+#ifndef _FASTCGI_DETAILS_MULTIPART_READER_H_
+#define _FASTCGI_DETAILS_MULTIPART_READER_H_
+
+#include <cstdint>
+#include <string>
+
+#include "fastcgi3/stream.h"
+
+namespace fastcgi
+{
+
+/**
+ * Parts of the multipart/form-data body read from the RequestBodyStream as they arrive.
+ * Only the headers of the current part and a chunk of its data are held, the data
+ * of the part is read up to the next boundary.
+ */
+class MultipartReader : public FormPartStream {
+public:
+	MultipartReader(RequestBodyStream *body, const std::string &boundary);
+	virtual ~MultipartReader();
+
+	/**
+	 * Skips the rest of the current part and reads the headers of the next one,
+	 * returns false after the last part
+	 */
+	bool next(std::string &name, std::string &filename, std::string &type);
+
+	virtual std::size_t read(char *buf, std::size_t size) override;
+
+private:
+	bool fill();
+	void readLine(std::string &line);
+	void parseHeader(const std::string &header, std::string &name, std::string &filename, std::string &type);
+
+private:
+	RequestBodyStream *body_;
+	const std::string delimiter_;
+	std::string buffer_;
+	std::size_t pos_;
+	bool in_part_;
+	bool finished_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_MULTIPART_READER_H_
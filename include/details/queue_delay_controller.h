@@ -0,0 +1,78 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+#ifndef _FASTCGI_DETAILS_QUEUE_DELAY_CONTROLLER_H_
+#define _FASTCGI_DETAILS_QUEUE_DELAY_CONTROLLER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace fastcgi
+{
+
+/**
+ * Controlled delay (CoDel) for the queue of a pool. The queue is overloaded once the
+ * time the tasks have waited stays above the target for a whole interval. Then the
+ * dequeued tasks are shed at the rate of the control law: the next one is shed after
+ * interval / sqrt(count), count being the number of tasks shed since the overload began,
+ * so the rate grows until the wait drops below the target. The pool queue is FIFO,
+ * the shed tasks are the oldest ones.
+ */
+class QueueDelayController {
+public:
+	using Duration = std::chrono::steady_clock::duration;
+
+public:
+	QueueDelayController(std::chrono::milliseconds target, std::chrono::milliseconds interval);
+
+	QueueDelayController(const QueueDelayController&) = delete;
+	QueueDelayController& operator=(const QueueDelayController&) = delete;
+
+	/**
+	 * Records the time the task has waited in the queue,
+	 * returns true if the task is to be shed
+	 */
+	bool shed(Duration delay);
+
+	bool overloaded() const;
+	std::uint64_t shedCounter() const;
+
+	std::chrono::milliseconds target() const;
+	std::chrono::milliseconds interval() const;
+
+private:
+	static std::int64_t now();
+	std::int64_t controlLaw(std::int64_t time) const;
+
+private:
+	const std::int64_t target_;
+	const std::int64_t interval_;
+	std::mutex mutex_;
+	std::int64_t first_above_;
+	std::int64_t drop_next_;
+	std::uint32_t count_;
+	std::uint32_t last_count_;
+	bool dropping_;
+	std::atomic<bool> overloaded_;
+	std::atomic<std::uint64_t> shed_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_QUEUE_DELAY_CONTROLLER_H_
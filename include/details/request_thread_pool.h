@@ -22,27 +22,82 @@
 
 #include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
 
+#include "fastcgi3/cancellation_token.h"
 #include "fastcgi3/request.h"
 #include "fastcgi3/request_io_stream.h"
 
+#include "details/bulkhead.h"
+#include "details/handlerset.h"
 #include "details/response_time_statistics.h"
 #include "details/thread_pool.h"
 
 namespace fastcgi {
 
+class AsyncReactor;
+class AsyncRequest;
+class QueueDelayController;
 class Filter;
 class Handler;
+class HandlerContext;
 class Logger;
 
+/**
+ * The task is moved from the endpoint thread to the pool, the copies are made explicitly
+ */
 struct RequestTask {
+	RequestTask() = default;
+	RequestTask(RequestTask&&) = default;
+	RequestTask& operator=(RequestTask&&) = default;
+
+	RequestTask(const RequestTask&) = delete;
+	RequestTask& operator=(const RequestTask&) = delete;
+
+	RequestTask clone() const;
+
 	std::shared_ptr<Request> request;
-	std::vector<std::shared_ptr<Filter>> filters;
-	std::vector<std::shared_ptr<Handler>> handlers;
-	std::function<std::vector<std::shared_ptr<Handler>>(RequestTask)> futureHandlers;
-	std::function<void(RequestTask)> dispatch;
+
+	/**
+	 * Compiled filter chain with the entries matching the request, and the handler;
+	 * without the handler it is found by futureHandler after the filters
+	 */
+	const HandlerSet::FilterChain *chain = nullptr;
+	HandlerSet::FilterMask filters = 0;
+	const HandlerSet::HandlerDescription *handler = nullptr;
+	std::function<const HandlerSet::HandlerDescription*(const RequestTask&)> futureHandler;
+	std::function<void(RequestTask&&)> dispatch;
 	std::shared_ptr<RequestIOStream> request_stream;
+	std::shared_ptr<CancellationToken> cancellation;
 	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point queued;
+
+	/**
+	 * Continuation of the request suspended by an asynchronous handler
+	 */
+	std::function<void()> resume;
+
+	/**
+	 * The thread dispatching the request may execute it itself when the pool is idle
+	 */
+	bool runInline = false;
+
+	/**
+	 * Index of the priority class of the pool the request is queued in
+	 */
+	unsigned priority = 0;
+
+	/**
+	 * NUMA node of the endpoint which has accepted the request, -1 - not bound
+	 */
+	int node = -1;
+
+	/**
+	 * Concurrency limit of the handler and the permit held while the request is executed
+	 */
+	Bulkhead *bulkhead = nullptr;
+	std::shared_ptr<Bulkhead::Permit> permit;
 };
 
 class RequestsThreadPool : public ThreadPool<RequestTask> {
@@ -52,9 +107,75 @@ public:
 	virtual ~RequestsThreadPool();
 	virtual void handleTask(RequestTask task);
 	std::chrono::milliseconds delay() const;
+
+	/**
+	 * Size of the response output after which it is flushed to the web server,
+	 * 0 - the response is sent when the handler completes
+	 */
+	std::size_t flushThreshold() const;
+	void setFlushThreshold(std::size_t threshold);
+
+	/**
+	 * Seconds sent in the Retry-After header when the pool rejects a request
+	 */
+	unsigned int retryAfter() const;
+	void setRetryAfter(unsigned int seconds);
+
+	/**
+	 * Time given to a request to complete, the request is cancelled after it,
+	 * 0 - no deadline
+	 */
+	std::chrono::milliseconds deadline() const;
+	void setDeadline(std::chrono::milliseconds deadline);
+
+	/**
+	 * The request is executed by the thread which has accepted it
+	 * if the pool has an idle thread, saving the handoff to the pool
+	 */
+	bool inlineDispatch() const;
+	void setInlineDispatch(bool enabled);
+
+	/**
+	 * Sheds the queued requests with 503 while the queue delay stays above the target
+	 * during the interval, a zero target disables the shedding
+	 */
+	void setTargetDelay(std::chrono::milliseconds target, std::chrono::milliseconds interval);
+	bool overloaded() const;
+	std::uint64_t shedTasksCounter() const;
+
+	/**
+	 * Executes the step of the suspended request
+	 */
+	void resume(std::shared_ptr<AsyncRequest> async, const std::function<void()> &step);
+
+	/**
+	 * Waits for the sockets and timers of the suspended requests,
+	 * started when it is used for the first time
+	 */
+	AsyncReactor* reactor();
+
+protected:
+	virtual void threadFailed(const std::exception &e);
+
+private:
+	bool execute(RequestTask &task, std::shared_ptr<AsyncRequest> &async);
+	bool process(RequestTask &task, const std::function<bool()> &step);
+	bool invokeHandlers(std::shared_ptr<AsyncRequest> &async, RequestTask &task, std::size_t first,
+		const std::shared_ptr<HandlerContext> &context);
+	void finish(RequestTask &task);
+	void setRequestId(RequestTask &task);
+	void cancelled(RequestTask &task, CancellationToken::Reason reason);
+
 private:
 	std::shared_ptr<fastcgi::Logger> logger_;
 	std::chrono::milliseconds delay_;
+	std::size_t flush_threshold_;
+	unsigned int retry_after_;
+	std::chrono::milliseconds deadline_;
+	bool inline_dispatch_;
+	std::unique_ptr<QueueDelayController> delay_controller_;
+	std::mutex reactor_mutex_;
+	std::unique_ptr<AsyncReactor> reactor_;
 };
 
 } // namespace fastcgi
@@ -20,6 +20,7 @@
 #ifndef _FASTCGI_DETAILS_SERVER_H_
 #define _FASTCGI_DETAILS_SERVER_H_
 
+#include <chrono>
 #include <functional>
 
 #include "details/handlerset.h"
@@ -39,15 +40,26 @@ public:
 	Server& operator=(const Server&) = delete;
 
 protected:
-	virtual void handleRequest(RequestTask task);
+	virtual void handleRequest(RequestTask &&task);
 	virtual const Globals* globals() const = 0;
 	virtual std::shared_ptr<Logger> logger() const = 0;
 
-	void handleRequestInternal(std::vector<std::shared_ptr<Filter>> &filters, RequestTask task);
-	void handleRequestInternal(std::vector<std::shared_ptr<Filter>> &filters, const HandlerSet::HandlerDescription* handler, RequestTask task);
+	void handleRequestInternal(HandlerSet::FilterMask filters, RequestTask &&task);
+	void handleRequestInternal(HandlerSet::FilterMask filters, const HandlerSet::HandlerDescription* handler, RequestTask &&task);
 
-	void getFilters(RequestTask task, std::vector<std::shared_ptr<Filter>> &v) const;
-	const HandlerSet::HandlerDescription* getHandler(RequestTask task) const;
+	/**
+	 * Entries of the compiled filter chain matching the request
+	 */
+	HandlerSet::FilterMask getFilters(const RequestTask &task) const;
+	const HandlerSet::HandlerDescription* getHandler(const RequestTask &task) const;
+
+	/**
+	 * Pool serving the handler, the default pool if the handler is not known yet;
+	 * the replica of the node for the pool replicated per NUMA node
+	 */
+	RequestsThreadPool* getPool(const HandlerSet::HandlerDescription* handler, int node = -1) const;
+	void sendUnavailable(Request *request, const RequestsThreadPool *pool) const;
+	void setDeadline(RequestTask &task, std::chrono::milliseconds deadline) const;
 };
 
 } // namespace fastcgi
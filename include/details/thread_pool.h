@@ -20,12 +20,27 @@
 #ifndef _FASTCGI_DETAILS_THREAD_POOL_H_
 #define _FASTCGI_DETAILS_THREAD_POOL_H_
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <deque>
 #include <queue>
 #include <functional>
 #include <mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
-#include <condition_variable>
+#include <vector>
+
+#include "details/cpu_affinity.h"
+#include "details/mpmc_queue.h"
 
 namespace fastcgi {
 
@@ -33,13 +48,47 @@ struct ThreadPoolInfo
 {
 	bool started;
 	uint64_t threadsNumber;
+	uint64_t liveThreads;
+	uint64_t minThreadsNumber;
+	uint64_t maxThreadsNumber;
 	uint64_t queueLength;
 	uint64_t busyThreadsCounter;
 	uint64_t currentQueue;
 	uint64_t goodTasksCounter;
 	uint64_t badTasksCounter;
+	uint64_t stolenTasksCounter;
+	uint64_t inlineTasksCounter;
+};
+
+/**
+ * Class of the tasks sharing the pool: the classes get the threads in proportion
+ * to their weights, and a class may hold at most queueLength tasks (0 - limited
+ * only by the queue of the pool)
+ */
+struct PriorityClass
+{
+	std::string name;
+	unsigned weight;
+	uint64_t queueLength;
+};
+
+struct PriorityClassInfo
+{
+	std::string name;
+	unsigned weight;
+	uint64_t queueLength;
+	uint64_t currentQueue;
+	uint64_t tasksCounter;
 };
 
+/**
+ * SHARED_QUEUE - all workers take the tasks from one queue;
+ * WORK_STEALING - each worker has its own queue, a thread adding the tasks always
+ * feeds the same worker (the worker itself - its own queue), and an idle worker
+ * steals the tasks from a randomly chosen one
+ */
+enum class Scheduler {SHARED_QUEUE, WORK_STEALING};
+
 template<typename T>
 class ThreadPool {
 public:
@@ -47,14 +96,25 @@ public:
 	using InitFuncType = std::function<void()>;
 
 public:
-	ThreadPool(const unsigned threadsNumber, const unsigned queueLength) {
-		info_.started = false;
-		info_.threadsNumber = threadsNumber;
-		info_.queueLength = queueLength;
-		info_.busyThreadsCounter = 0;
-		info_.currentQueue = 0;
-		info_.goodTasksCounter = 0;
-		info_.badTasksCounter = 0;
+	ThreadPool(const unsigned threadsNumber, const unsigned queueLength) :
+		threads_number_(threadsNumber), queue_length_(queueLength), scheduler_(Scheduler::SHARED_QUEUE),
+		batch_size_(1), min_threads_(threadsNumber), grow_delay_(0), idle_timeout_(0), queue_(queueLength)
+	{
+		started_.store(false);
+		live_.store(0);
+		last_take_.store(0);
+		busy_.store(0);
+		good_.store(0);
+		bad_.store(0);
+		size_.store(0);
+		overflow_size_.store(0);
+		epoch_.store(0);
+		sleepers_.store(0);
+		spinning_.store(0);
+		stolen_.store(0);
+		inline_.store(0);
+		classes_size_.store(0);
+		virtual_time_ = 0;
 	}
 
 	virtual ~ThreadPool() {
@@ -67,66 +127,294 @@ public:
 
 	void start(InitFuncType func) {
 		std::unique_lock<std::mutex> lock(mutex_);
-		if (info_.started) {
+		if (started_.load()) {
 			return;
 		}
 //		if (threads_.size() != 0) {
 //			throw std::runtime_error("Invalid thread pool state.");
 //		}
 
-		std::function<void()> f = std::bind(&ThreadPool<T>::workMethod, this, func);
-		for (unsigned i = 0; i < info_.threadsNumber; ++i) {
-			threads_.push_back(std::unique_ptr<std::thread>(new std::thread(f)));
+		init_ = func;
+		started_.store(true);
+		last_take_.store(now());
+		threads_.resize(threads_number_);
+		alive_.assign(threads_number_, false);
+		for (unsigned i = 0; i < min_threads_; ++i) {
+			alive_[i] = true;
+			live_.fetch_add(1);
+			threads_[i].reset(new std::thread(&ThreadPool<T>::workMethod, this, func, i));
 		}
+	}
 
-		info_.started = true;
+	/**
+	 * Elastic pool starts minThreads threads and grows up to the threads number
+	 * when a task waits in the queue for growDelay while no thread is idle;
+	 * a thread idle for idleTimeout exits unless there are only minThreads left.
+	 * The pool is made elastic before it is started.
+	 */
+	void setElastic(unsigned minThreads, std::chrono::milliseconds growDelay, std::chrono::milliseconds idleTimeout) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (started_.load()) {
+			throw std::runtime_error("Cannot make the started thread pool elastic");
+		}
+		if (0 == minThreads || minThreads > threads_number_) {
+			throw std::runtime_error("Minimum number of threads must be between 1 and " + std::to_string(threads_number_));
+		}
+		if (idleTimeout <= std::chrono::milliseconds(0)) {
+			throw std::runtime_error("Idle timeout of the elastic thread pool must be positive");
+		}
+		min_threads_ = minThreads;
+		grow_delay_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(growDelay).count();
+		idle_timeout_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(idleTimeout).count();
 	}
 
-	void stop() {
+	bool elastic() const {
+		return min_threads_ < threads_number_;
+	}
+
+	/**
+	 * Adds a thread to the elastic pool if the task has waited in the queue
+	 * for the grow delay
+	 */
+	void grow(std::chrono::steady_clock::duration wait) {
+		if (elastic() && wait.count() >= grow_delay_) {
+			addThread();
+		}
+	}
+
+	/**
+	 * The scheduler is selected before the pool is started
+	 */
+	void setScheduler(Scheduler scheduler) {
 		std::unique_lock<std::mutex> lock(mutex_);
-		info_.started = false;
-		condition_.notify_all();
+		if (started_.load()) {
+			throw std::runtime_error("Cannot change the scheduler of the started thread pool");
+		}
+		scheduler_ = scheduler;
+		local_.clear();
+		if (Scheduler::WORK_STEALING == scheduler_) {
+			for (unsigned i = 0; i < std::max(threads_number_, 1u); ++i) {
+				local_.push_back(std::unique_ptr<LocalQueue>(new LocalQueue()));
+			}
+		}
 	}
 
-	void join() {
-		// join_all
-		std::for_each(threads_.begin(), threads_.end(), [](std::unique_ptr<std::thread>& t){t->join();});
+	Scheduler scheduler() const {
+		return scheduler_;
 	}
 
-	void addTask(T task) {
-		try {
-			std::unique_lock<std::mutex> lock(mutex_);
+	/**
+	 * Batched pool: a worker claims up to batchSize tasks at once, at most its share
+	 * of the queue, so the queues under a lock are locked once per batch and
+	 * the counters are updated once per batch. The producer does not wake
+	 * a sleeping worker while another one is looking for the tasks, the worker
+	 * finding more tasks queued wakes the next one instead.
+	 * The batch size is set before the pool is started, 1 - no batching.
+	 */
+	void setBatchSize(unsigned batchSize) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (started_.load()) {
+			throw std::runtime_error("Cannot change the batch size of the started thread pool");
+		}
+		batch_size_ = std::max(1u, batchSize);
+	}
+
+	unsigned batchSize() const {
+		return batch_size_;
+	}
+
+	/**
+	 * CPUs the threads of the pool are pinned to, set before the pool is started
+	 */
+	void setAffinity(const CpuAffinity &affinity) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (started_.load()) {
+			throw std::runtime_error("Cannot change the affinity of the started thread pool");
+		}
+		affinity_ = affinity;
+	}
+
+	const CpuAffinity& affinity() const {
+		return affinity_;
+	}
+
+	/**
+	 * The classes are set before the pool is started, the first one is the default.
+	 * The tasks are taken from the classes by the weighted fair queuing
+	 * instead of the scheduler.
+	 */
+	void setPriorityClasses(const std::vector<PriorityClass> &classes) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (started_.load()) {
+			throw std::runtime_error("Cannot change the priority classes of the started thread pool");
+		}
+		classes_.clear();
+		for (auto &c : classes) {
+			if (0 == c.weight) {
+				throw std::runtime_error("Weight of the priority class " + c.name + " must be positive");
+			}
+			classes_.push_back(std::unique_ptr<ClassQueue>(new ClassQueue(c)));
+		}
+	}
 
-			if (!info_.started) {
-				throw std::runtime_error("Thread pool is not started yet");
+	/**
+	 * Index of the class with the name, the default class if there is no such class
+	 */
+	unsigned priorityClass(const std::string &name) const {
+		for (unsigned i = 0; i < classes_.size(); ++i) {
+			if (classes_[i]->info.name == name) {
+				return i;
 			}
+		}
+		return 0;
+	}
+
+	std::vector<PriorityClassInfo> getPriorityClassInfo() const {
+		std::vector<PriorityClassInfo> info;
+		std::unique_lock<std::mutex> lock(classes_mutex_);
+		for (auto &c : classes_) {
+			info.push_back({c->info.name, c->info.weight, c->info.queueLength, c->tasks.size(), c->counter});
+		}
+		return info;
+	}
+
+	void stop() {
+		started_.store(false);
+		epoch_.fetch_add(1);
+		futexWake(&epoch_, INT_MAX);
+	}
 
-			if (tasksQueue_.size() >= info_.queueLength) {
-				throw std::runtime_error("Pool::handle: the queue has already reached its maximum size of " + std::to_string(info_.queueLength) + " elements");
+	void join() {
+		// The stopped pool does not start the threads any more
+		std::vector<std::thread*> threads;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			for (auto &t : threads_) {
+				if (t) {
+					threads.push_back(t.get());
+				}
+			}
+		}
+		// join_all
+		std::for_each(threads.begin(), threads.end(), [](std::thread *t){
+			if (t->joinable()) {
+				t->join();
 			}
-			tasksQueue_.push(task);
+		});
+	}
+
+	/**
+	 * The task is moved into the pool only if it is accepted
+	 */
+	void addTask(T &&task, unsigned priority = 0) {
+		if (!started_.load()) {
+			throw std::runtime_error("Thread pool is not started yet");
+		}
+
+		// The slot is reserved before the task is published,
+		// so the queue never holds more than queueLength tasks
+		if (size_.fetch_add(1) >= queue_length_) {
+			size_.fetch_sub(1);
+			throw std::runtime_error("Pool::handle: the queue has already reached its maximum size of " + std::to_string(queue_length_) + " elements");
+		}
+		if (classes_.empty()) {
+			publish(std::move(task));
+		} else if (!pushClass(std::move(task), priority, true)) {
+			size_.fetch_sub(1);
+			const PriorityClass &c = classes_[priority < classes_.size() ? priority : 0]->info;
+			throw std::runtime_error("Pool::handle: the queue of the priority class " + c.name +
+				" has already reached its maximum size of " + std::to_string(c.queueLength) + " elements");
+		}
+		wakeup();
+		growStalled();
+	}
+
+	/**
+	 * Adds the continuation of a task which has been admitted to the pool already,
+	 * so the length of the queue is not checked.
+	 * Throws only for the stopped pool, before the task is moved.
+	 */
+	void addContinuation(T &&task, unsigned priority = 0) {
+		if (!started_.load()) {
+			throw std::runtime_error("Thread pool is not started yet");
+		}
+		size_.fetch_add(1);
+		if (classes_.empty()) {
+			publish(std::move(task));
+		} else {
+			pushClass(std::move(task), priority, false);
+		}
+		wakeup();
+		growStalled();
+	}
+
+	/**
+	 * Executes the task on the calling thread when the pool has an idle thread
+	 * and nothing is queued, the caller occupies the idle thread's slot meanwhile.
+	 * Returns false, leaving the task untouched, if the task has to be added instead.
+	 */
+	bool tryRunInline(T &task) {
+		if (!started_.load() || size_.load() > 0 || !claimSlot()) {
+			return false;
+		}
+		if (size_.load() > 0) {
+			// The task queued meanwhile goes first
+			busy_.fetch_sub(1);
+			return false;
+		}
+
+		initCaller();
+		try {
+			handleTask(std::move(task));
+			good_.fetch_add(1);
 		} catch (...) {
-			condition_.notify_one();
-			throw;
+			bad_.fetch_add(1);
 		}
-		condition_.notify_one();
+		inline_.fetch_add(1);
+		busy_.fetch_sub(1);
+		return true;
+	}
+
+	/**
+	 * Returns true if a task added now would be rejected
+	 */
+	bool saturated() const {
+		return !started_.load() || size_.load() >= queue_length_;
 	}
 
 	ThreadPoolInfo getInfo() const {
-		std::unique_lock<std::mutex> lock(mutex_);
-		info_.currentQueue = tasksQueue_.size();
-		return info_;
+		ThreadPoolInfo info;
+		info.started = started_.load();
+		info.threadsNumber = threads_number_;
+		info.liveThreads = live_.load();
+		info.minThreadsNumber = min_threads_;
+		info.maxThreadsNumber = threads_number_;
+		info.queueLength = queue_length_;
+		info.busyThreadsCounter = busy_.load();
+		info.currentQueue = size_.load();
+		info.goodTasksCounter = good_.load();
+		info.badTasksCounter = bad_.load();
+		info.stolenTasksCounter = stolen_.load();
+		info.inlineTasksCounter = inline_.load();
+		return info;
 	}
 
 protected:
 	virtual void handleTask(T) = 0;
 
+	/**
+	 * Called when the elastic pool cannot start one more thread
+	 */
+	virtual void threadFailed(const std::exception&) {
+	}
+
 private:
-	void workMethod(InitFuncType func) {
-		const int none = 0;
-		const int good = 1;
-		const int bad = 2;
-		int state = none;
+	void workMethod(InitFuncType func, unsigned index) {
+		currentWorker().pool = this;
+		currentWorker().index = index;
+
+		// The pool works unpinned if the system refuses the affinity
+		affinity_.apply();
 
 		try {
 			func();
@@ -134,43 +422,35 @@ private:
 		catch (...) {
 		}
 
+		std::vector<T> batch;
+		batch.reserve(batch_size_);
 		while (true) {
 			try {
-				T task;
-				{
-					std::unique_lock<std::mutex> lock(mutex_);
-					switch (state) {
-					case none:
-						break;
-					case good:
-						++info_.goodTasksCounter;
-						--info_.busyThreadsCounter;
-						break;
-					case bad:
-						++info_.badTasksCounter;
-						--info_.busyThreadsCounter;
-						break;
-					}
-					state = none;
-					while (true) {
-						if (!info_.started) {
-							return;
-						} else if (!tasksQueue_.empty()) {
-							break;
-						}
-						condition_.wait(lock);
-					}
-					task = tasksQueue_.front();
-					tasksQueue_.pop();
-					++info_.busyThreadsCounter;
+				batch.clear();
+				if (!wait(batch, index)) {
+					return;
+				}
+				// The slot of the idle thread may be held by a request run inline
+				while (!claimSlot()) {
+					std::this_thread::yield();
 				}
 
-				try {
-					handleTask(task);
-					state = good;
-				} catch (...) {
-					state = bad;
+				std::uint64_t good = 0, bad = 0;
+				for (auto &task : batch) {
+					try {
+						handleTask(std::move(task));
+						++good;
+					} catch (...) {
+						++bad;
+					}
+				}
+				if (good > 0) {
+					good_.fetch_add(good);
+				}
+				if (bad > 0) {
+					bad_.fetch_add(bad);
 				}
+				busy_.fetch_sub(1);
 			}
 			catch (...)
 			{
@@ -178,12 +458,472 @@ private:
 		}
 	}
 
+	/**
+	 * The workers and the requests run inline share the slots of the live threads,
+	 * so together they never exceed the concurrency of the pool
+	 */
+	bool claimSlot() {
+		std::uint64_t busy = busy_.load();
+		do {
+			if (busy >= live_.load()) {
+				return false;
+			}
+		} while (!busy_.compare_exchange_weak(busy, busy + 1));
+		return true;
+	}
+
+	/**
+	 * The thread running the tasks inline is initialized like the threads of the pool,
+	 * once per pool
+	 */
+	void initCaller() {
+		static thread_local std::vector<const ThreadPool<T>*> initialized;
+		if (this == currentWorker().pool ||
+			std::find(initialized.begin(), initialized.end(), this) != initialized.end()) {
+			return;
+		}
+		initialized.push_back(this);
+		try {
+			init_();
+		}
+		catch (...) {
+		}
+	}
+
+	/**
+	 * Takes the next tasks: the idle worker spins for a while and then sleeps on the futex.
+	 * Returns false when the pool is stopped.
+	 */
+	bool wait(std::vector<T> &batch, unsigned index) {
+		// Spinning is pointless when the producer cannot run on another CPU meanwhile
+		static const unsigned spins = std::thread::hardware_concurrency() > 1 ? SPIN_COUNT : 1;
+		const std::int64_t idle = elastic() ? now() : 0;
+		spinning_.fetch_add(1);
+		while (true) {
+			for (unsigned i = 0; i < spins; ++i) {
+				if (!started_.load(std::memory_order_acquire)) {
+					spinning_.fetch_sub(1);
+					return false;
+				}
+				if (take(batch, index)) {
+					spinning_.fetch_sub(1);
+					wakeupNext();
+					return true;
+				}
+				cpuRelax();
+			}
+
+			// The producer checks the sleepers (and the spinning workers) after publishing
+			// the task, the worker checks the queue after announcing itself as a sleeper
+			// (and no longer spinning): one of them sees the other
+			const std::uint32_t epoch = epoch_.load();
+			sleepers_.fetch_add(1);
+			spinning_.fetch_sub(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (take(batch, index)) {
+				sleepers_.fetch_sub(1);
+				wakeupNext();
+				return true;
+			}
+			if (!started_.load()) {
+				sleepers_.fetch_sub(1);
+				return false;
+			}
+			futexWait(&epoch_, epoch, elastic() ? idle_timeout_ : 0);
+			sleepers_.fetch_sub(1);
+
+			if (elastic() && now() - idle >= idle_timeout_) {
+				if (retire(batch, index)) {
+					return false;
+				}
+				if (!batch.empty()) {
+					// The thread stays for the tasks published meanwhile
+					wakeupNext();
+					return true;
+				}
+			}
+			spinning_.fetch_add(1);
+		}
+	}
+
+	/**
+	 * The idle thread leaves the elastic pool unless the pool has only minimum threads.
+	 * Returns false if the thread stays, possibly with the tasks published meanwhile.
+	 */
+	bool retire(std::vector<T> &batch, unsigned index) {
+		unsigned live = live_.load();
+		do {
+			if (live <= min_threads_) {
+				return false;
+			}
+		} while (!live_.compare_exchange_weak(live, live - 1));
+
+		if (take(batch, index)) {
+			live_.fetch_add(1);
+			return false;
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		alive_[index] = false;
+		return true;
+	}
+
+	/**
+	 * All the threads are busy and none of them has taken a task for the grow delay
+	 */
+	void growStalled() {
+		if (elastic() && 0 == sleepers_.load(std::memory_order_relaxed) &&
+			now() - last_take_.load(std::memory_order_relaxed) >= grow_delay_) {
+			addThread();
+		}
+	}
+
+	void addThread() {
+		if (sleepers_.load() > 0) {
+			// An idle thread takes the task
+			return;
+		}
+		unsigned live = live_.load();
+		do {
+			if (live >= threads_number_) {
+				return;
+			}
+		} while (!live_.compare_exchange_weak(live, live + 1));
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (started_.load()) {
+			for (unsigned i = 0; i < threads_number_; ++i) {
+				if (alive_[i]) {
+					continue;
+				}
+				// The retired thread has left already or is about to
+				if (threads_[i] && threads_[i]->joinable()) {
+					threads_[i]->join();
+				}
+				alive_[i] = true;
+				try {
+					threads_[i].reset(new std::thread(&ThreadPool<T>::workMethod, this, init_, i));
+				}
+				catch (const std::exception &e) {
+					// The task is queued already, the running threads take it
+					alive_[i] = false;
+					live_.fetch_sub(1);
+					lock.unlock();
+					threadFailed(e);
+				}
+				return;
+			}
+		}
+		live_.fetch_sub(1);
+	}
+
+	/**
+	 * Appends the taken tasks to the batch
+	 */
+	bool take(std::vector<T> &batch, unsigned index) {
+		const std::size_t limit = batchLimit();
+		std::size_t taken = 0;
+		if (!classes_.empty()) {
+			taken = popClass(batch, limit);
+		} else if (Scheduler::WORK_STEALING == scheduler_) {
+			taken = popLocal(batch, index, limit);
+			if (0 == taken) {
+				taken = steal(batch, index, limit);
+			}
+		} else {
+			taken = popShared(batch, limit);
+		}
+		if (taken > 0) {
+			size_.fetch_sub(taken);
+			if (elastic()) {
+				last_take_.store(now(), std::memory_order_relaxed);
+			}
+		}
+		return taken > 0;
+	}
+
+	/**
+	 * The worker takes no more than its share of the queue,
+	 * the tasks it holds are not available to the idle workers
+	 */
+	std::size_t batchLimit() const {
+		if (batch_size_ <= 1) {
+			return 1;
+		}
+		const std::uint64_t share = size_.load(std::memory_order_relaxed) / std::max(1u, live_.load(std::memory_order_relaxed));
+		return std::max<std::uint64_t>(1, std::min<std::uint64_t>(batch_size_, share));
+	}
+
+	std::size_t popShared(std::vector<T> &batch, std::size_t limit) {
+		std::size_t taken = 0;
+		T task;
+		while (taken < limit && queue_.pop(task)) {
+			batch.push_back(std::move(task));
+			++taken;
+		}
+		if (taken < limit) {
+			taken += popOverflow(batch, limit - taken);
+		}
+		return taken;
+	}
+
+	void publish(T &&task) {
+		if (Scheduler::WORK_STEALING == scheduler_) {
+			const WorkerId &worker = currentWorker();
+			const unsigned index = this == worker.pool ? worker.index : producerId() % local_.size();
+			LocalQueue &queue = *local_[index];
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(std::move(task));
+			queue.size.fetch_add(1);
+		} else if (!queue_.push(std::move(task))) {
+			// The consumer of the slot has not released it yet
+			pushOverflow(std::move(task));
+		}
+	}
+
+	std::size_t popLocal(std::vector<T> &batch, unsigned index, std::size_t limit) {
+		LocalQueue &queue = *local_[index];
+		if (0 == queue.size.load(std::memory_order_acquire)) {
+			return 0;
+		}
+		std::unique_lock<std::mutex> lock(queue.mutex);
+		std::size_t taken = 0;
+		for (; taken < limit && !queue.tasks.empty(); ++taken) {
+			batch.push_back(std::move(queue.tasks.front()));
+			queue.tasks.pop_front();
+		}
+		queue.size.fetch_sub(taken);
+		return taken;
+	}
+
+	std::size_t steal(std::vector<T> &batch, unsigned index, std::size_t limit) {
+		// Victims are visited from a random one, so the idle workers
+		// do not all go after the same queue
+		const unsigned count = local_.size();
+		const unsigned first = nextRandom() % count;
+		for (unsigned i = 0; i < count; ++i) {
+			const unsigned victim = (first + i) % count;
+			if (victim == index) {
+				continue;
+			}
+			const std::size_t taken = popLocal(batch, victim, limit);
+			if (taken > 0) {
+				stolen_.fetch_add(taken);
+				return taken;
+			}
+		}
+		return 0;
+	}
+
+	void wakeup() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers_.load(std::memory_order_relaxed) > 0 &&
+			(batch_size_ <= 1 || 0 == spinning_.load(std::memory_order_relaxed))) {
+			epoch_.fetch_add(1);
+			futexWake(&epoch_, 1);
+		}
+	}
+
+	/**
+	 * The wake-ups skipped by the producers of the batched pool are passed on
+	 * by the worker which has found the tasks
+	 */
+	void wakeupNext() {
+		if (batch_size_ > 1 && size_.load(std::memory_order_relaxed) > 0) {
+			wakeup();
+		}
+	}
+
+	bool pushClass(T &&task, unsigned priority, bool limited) {
+		ClassQueue &queue = *classes_[priority < classes_.size() ? priority : 0];
+		std::unique_lock<std::mutex> lock(classes_mutex_);
+		if (limited && queue.info.queueLength > 0 && queue.tasks.size() >= queue.info.queueLength) {
+			return false;
+		}
+		if (queue.tasks.empty()) {
+			// The class which has been idle does not get the credit for that time
+			queue.pass = std::max(queue.pass, virtual_time_);
+		}
+		queue.tasks.push_back(std::move(task));
+		classes_size_.fetch_add(1);
+		return true;
+	}
+
+	/**
+	 * Stride scheduling: the class with the smallest pass goes next,
+	 * and its pass advances inversely to its weight
+	 */
+	std::size_t popClass(std::vector<T> &batch, std::size_t limit) {
+		if (0 == classes_size_.load(std::memory_order_acquire)) {
+			return 0;
+		}
+		std::unique_lock<std::mutex> lock(classes_mutex_);
+		std::size_t taken = 0;
+		for (; taken < limit; ++taken) {
+			ClassQueue *next = nullptr;
+			for (auto &c : classes_) {
+				if (!c->tasks.empty() && (nullptr == next || c->pass < next->pass)) {
+					next = c.get();
+				}
+			}
+			if (nullptr == next) {
+				break;
+			}
+			batch.push_back(std::move(next->tasks.front()));
+			next->tasks.pop_front();
+			next->counter++;
+			virtual_time_ = next->pass;
+			next->pass += STRIDE / next->info.weight;
+		}
+		classes_size_.fetch_sub(taken);
+		return taken;
+	}
+
+	void pushOverflow(T &&task) {
+		std::unique_lock<std::mutex> lock(overflow_mutex_);
+		overflow_.push(std::move(task));
+		overflow_size_.fetch_add(1);
+	}
+
+	std::size_t popOverflow(std::vector<T> &batch, std::size_t limit) {
+		if (0 == overflow_size_.load(std::memory_order_acquire)) {
+			return 0;
+		}
+		std::unique_lock<std::mutex> lock(overflow_mutex_);
+		std::size_t taken = 0;
+		for (; taken < limit && !overflow_.empty(); ++taken) {
+			batch.push_back(std::move(overflow_.front()));
+			overflow_.pop();
+		}
+		overflow_size_.fetch_sub(taken);
+		return taken;
+	}
+
+	struct WorkerId {
+		const ThreadPool<T> *pool;
+		unsigned index;
+	};
+
+	static WorkerId& currentWorker() {
+		static thread_local WorkerId worker = {nullptr, 0};
+		return worker;
+	}
+
+	/**
+	 * Number of the thread adding the tasks: it selects the worker the thread feeds
+	 */
+	static unsigned producerId() {
+		static std::atomic<unsigned> next(0);
+		static thread_local unsigned id = next.fetch_add(1);
+		return id;
+	}
+
+	static unsigned nextRandom() {
+		static thread_local std::uint32_t state = static_cast<std::uint32_t>(
+			std::chrono::steady_clock::now().time_since_epoch().count()) | 1;
+		// xorshift32
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	static std::int64_t now() {
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	/**
+	 * Timeout is in the steady clock ticks, 0 - no timeout
+	 */
+	static void futexWait(std::atomic<std::uint32_t> *addr, std::uint32_t value, std::int64_t timeout) {
+		struct timespec ts;
+		if (timeout > 0) {
+			const std::chrono::nanoseconds ns = std::chrono::steady_clock::duration(timeout);
+			ts.tv_sec = ns.count() / 1000000000;
+			ts.tv_nsec = ns.count() % 1000000000;
+		}
+		syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(addr), FUTEX_WAIT_PRIVATE, value,
+			timeout > 0 ? &ts : nullptr, nullptr, 0);
+	}
+
+	static void futexWake(std::atomic<std::uint32_t> *addr, int count) {
+		syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+	}
+
 private:
-	mutable std::mutex mutex_;
-	std::condition_variable condition_;
+	static const unsigned SPIN_COUNT = 64;
+	static const std::size_t CACHE_LINE_SIZE = 64;
+	static const std::uint64_t STRIDE = 1 << 20;
+
+	struct LocalQueue {
+		LocalQueue() {
+			size.store(0);
+		}
+		std::mutex mutex;
+		std::deque<T> tasks;
+		std::atomic<std::size_t> size;
+		// Queues of the neighbouring workers are not sharing the cache line
+		char pad[CACHE_LINE_SIZE];
+	};
+
+	struct ClassQueue {
+		explicit ClassQueue(const PriorityClass &c) :
+			info(c), pass(0), counter(0)
+		{}
+		PriorityClass info;
+		std::deque<T> tasks;
+		std::uint64_t pass;
+		std::uint64_t counter;
+	};
+
+	const unsigned threads_number_;
+	const std::uint64_t queue_length_;
+	Scheduler scheduler_;
+	CpuAffinity affinity_;
+	unsigned batch_size_;
+	unsigned min_threads_;
+	std::int64_t grow_delay_;
+	std::int64_t idle_timeout_;
+
+	std::mutex mutex_;
 	std::vector<std::unique_ptr<std::thread>> threads_;
-	std::queue<T> tasksQueue_;
-	mutable ThreadPoolInfo info_;
+	std::vector<bool> alive_;
+	InitFuncType init_;
+	std::atomic<unsigned> live_;
+	std::atomic<std::int64_t> last_take_;
+
+	MpmcQueue<T> queue_;
+	std::atomic<bool> started_;
+	std::atomic<std::uint64_t> busy_;
+	std::atomic<std::uint64_t> good_;
+	std::atomic<std::uint64_t> bad_;
+	std::atomic<std::uint64_t> size_;
+
+	// The continuations which do not fit into the ring and the tasks whose
+	// slot is still being released by a slow consumer
+	std::mutex overflow_mutex_;
+	std::queue<T> overflow_;
+	std::atomic<std::uint64_t> overflow_size_;
+
+	std::atomic<std::uint32_t> epoch_;
+	std::atomic<int> sleepers_;
+	std::atomic<int> spinning_;
+
+	std::vector<std::unique_ptr<LocalQueue>> local_;
+	std::atomic<std::uint64_t> stolen_;
+	std::atomic<std::uint64_t> inline_;
+
+	mutable std::mutex classes_mutex_;
+	std::vector<std::unique_ptr<ClassQueue>> classes_;
+	std::atomic<std::uint64_t> classes_size_;
+	std::uint64_t virtual_time_;
 };
 
 } // namespace fastcgi
@@ -0,0 +1,99 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_DETAILS_URING_FILE_WRITER_H_
+#define _FASTCGI_DETAILS_URING_FILE_WRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace fastcgi
+{
+
+/**
+ * Writes the data to files with io_uring from a set of registered buffers.
+ *
+ * The caller fills a free buffer while the previous ones are being written
+ * by the kernel, so reading of the request body overlaps with its spooling
+ * to the request cache and no page of the cache file is faulted in.
+ * A writer is used by a single thread, the descriptors are passed per write.
+ */
+class UringFileWriter {
+public:
+	/**
+	 * Throws std::system_error if io_uring is not available
+	 */
+	UringFileWriter(std::size_t bufferSize, unsigned int buffers);
+	virtual ~UringFileWriter();
+
+	UringFileWriter(const UringFileWriter&) = delete;
+	UringFileWriter& operator=(const UringFileWriter&) = delete;
+
+	/**
+	 * Returns false if the kernel (or the build) has no io_uring support,
+	 * checked once per process
+	 */
+	static bool supported();
+
+	/**
+	 * Returns the free buffer, waiting for a write in flight if there is none
+	 */
+	std::pair<char*, std::size_t> acquire();
+
+	/**
+	 * Writes the first len bytes of the buffer returned by acquire()
+	 */
+	void submit(int fd, std::uint64_t offset, std::size_t len);
+
+	/**
+	 * Waits for all the writes, throws std::system_error if any of them failed
+	 */
+	void complete();
+
+private:
+	struct Write {
+		int fd;
+		std::uint64_t offset;
+		std::size_t len;
+	};
+
+	void enter(unsigned int submit, unsigned int wait);
+	void reap(bool wait);
+	void release();
+
+private:
+	int ring_;
+	std::size_t buffer_size_;
+	std::vector<char*> buffers_;
+	std::vector<Write> writes_;
+	std::vector<unsigned int> free_;
+	unsigned int in_flight_;
+	int error_;
+
+	void *sq_ptr_, *cq_ptr_, *sqes_ptr_;
+	std::size_t sq_size_, cq_size_, sqes_size_;
+	unsigned int *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+	unsigned int *cq_head_, *cq_tail_, *cq_mask_;
+	void *cqes_, *sqes_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_DETAILS_URING_FILE_WRITER_H_
@@ -0,0 +1,109 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_ASYNC_HANDLER_H_
+#define _FASTCGI_ASYNC_HANDLER_H_
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+
+#include "fastcgi3/handler.h"
+
+namespace fastcgi
+{
+
+/**
+ * Suspension points of the asynchronous handler.
+ *
+ * Each wait registers the continuation and returns immediately: the handler
+ * returns from its current step and the pool thread is released. The continuation
+ * is executed later on a thread of the same pool. The continuations of one request
+ * never run concurrently.
+ */
+class AsyncContext {
+public:
+	using ResumeType = std::function<void()>;
+	/**
+	 * ready is false if the timeout has expired or the request is cancelled
+	 */
+	using WaitType = std::function<void(bool ready)>;
+
+public:
+	AsyncContext();
+	virtual ~AsyncContext();
+
+	AsyncContext(const AsyncContext&) = delete;
+	AsyncContext& operator=(const AsyncContext&) = delete;
+
+	/**
+	 * Waits for the socket to become readable (writable),
+	 * timeout 0 - until the deadline of the request
+	 */
+	virtual void waitReadable(int fd, std::chrono::milliseconds timeout, WaitType next) = 0;
+	virtual void waitWritable(int fd, std::chrono::milliseconds timeout, WaitType next) = 0;
+
+	virtual void sleep(std::chrono::milliseconds delay, ResumeType next) = 0;
+
+	/**
+	 * Invokes another handler for the same request and continues when it completes
+	 */
+	virtual void invoke(std::shared_ptr<Handler> handler, ResumeType next) = 0;
+
+	/**
+	 * The handler has prepared the response: the remaining handlers are invoked
+	 * and the response is sent. May be called from any thread.
+	 */
+	virtual void complete() = 0;
+
+	/**
+	 * The handler has failed: the error is handled as if it was thrown by a synchronous handler
+	 */
+	virtual void fail(std::exception_ptr error) = 0;
+};
+
+/**
+ * Handler which does not hold the pool thread while it is waiting for
+ * a downstream socket, a timer or another handler.
+ *
+ * The filters are executed before the handler as usual. When the handler is suspended,
+ * next() returns to the filters before the response is completed: a filter which
+ * transforms the output should install a ResponseEncoder instead of post-processing
+ * the response stream.
+ *
+ * Invoked synchronously through handleRequest, the handler is executed
+ * to completion on the calling thread.
+ */
+class AsyncHandler : virtual public Handler {
+public:
+	AsyncHandler();
+	virtual ~AsyncHandler();
+
+	virtual void handleRequest(Request *req, HandlerContext *context) override;
+
+	/**
+	 * Starts the processing on a pool thread. The request is completed
+	 * when the handler calls async->complete() or async->fail()
+	 */
+	virtual void handleRequestAsync(Request *req, HandlerContext *context, std::shared_ptr<AsyncContext> async) = 0;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_ASYNC_HANDLER_H_
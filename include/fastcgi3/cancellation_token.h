@@ -0,0 +1,99 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_CANCELLATION_TOKEN_H_
+#define _FASTCGI_CANCELLATION_TOKEN_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace fastcgi
+{
+
+/**
+ * Cancellation state of the request, shared by the transport and the handlers.
+ *
+ * The token is tripped when the web server aborts the request, the connection
+ * to the web server is lost or the deadline of the request passes.
+ * Long running handlers poll cancelled() or register a callback to stop
+ * rendering the response which nobody is going to read.
+ */
+class CancellationToken {
+public:
+	enum class Reason {NONE, ABORTED, DISCONNECTED, DEADLINE};
+
+	using CallbackType = std::function<void(Reason)>;
+	using ProbeType = std::function<Reason()>;
+
+public:
+	CancellationToken();
+	virtual ~CancellationToken();
+
+	CancellationToken(const CancellationToken&) = delete;
+	CancellationToken& operator=(const CancellationToken&) = delete;
+
+	/**
+	 * Returns true if the request is cancelled.
+	 * The deadline and the connection are checked by the call itself,
+	 * so the token is tripped by them when it is polled
+	 */
+	bool cancelled();
+	Reason reason() const;
+
+	/**
+	 * The callback is invoked once by the thread tripping the token,
+	 * immediately if the token is already tripped
+	 */
+	void onCancel(CallbackType callback);
+
+	void cancel(Reason reason);
+
+	/**
+	 * Drops the callbacks when the request is completed:
+	 * they may refer to the handler state which is gone
+	 */
+	void release();
+
+	/**
+	 * Brings the token of the completed request back to the initial state,
+	 * so it is reused by the next request of the transport
+	 */
+	void reset();
+
+	void setDeadline(std::chrono::steady_clock::time_point deadline);
+	std::chrono::steady_clock::time_point deadline() const;
+
+	/**
+	 * Non-blocking check of the transport invoked by cancelled()
+	 */
+	void setProbe(ProbeType probe);
+
+private:
+	std::atomic<int> reason_;
+	std::atomic<std::chrono::steady_clock::rep> deadline_;
+	std::mutex mutex_;
+	std::vector<CallbackType> callbacks_;
+	ProbeType probe_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_CANCELLATION_TOKEN_H_
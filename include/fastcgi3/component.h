@@ -28,6 +28,7 @@ namespace fastcgi
 
 class Config;
 class Component;
+class Executor;
 
 class ComponentContext {
 public:
@@ -39,6 +40,12 @@ public:
 	virtual const Config* getConfig() const = 0;
 	virtual std::string getComponentXPath() const = 0;
 
+	/**
+	 * Executor for the background work by the name, the default one for the empty name;
+	 * nullptr if there is no such executor
+	 */
+	virtual std::shared_ptr<Executor> getExecutor(const std::string &name = std::string()) const = 0;
+
 	template<typename T>
 	std::shared_ptr<T> findComponent(const std::string &name) {
 		return std::dynamic_pointer_cast<T>(findComponentInternal(name));
@@ -0,0 +1,52 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_EXECUTOR_H_
+#define _FASTCGI_EXECUTOR_H_
+
+#include <functional>
+
+namespace fastcgi
+{
+
+/**
+ * Runs the work which must not delay the response (audit records, cache warming,
+ * metrics pushes) on threads of its own. The queue of the executor is bounded:
+ * the task which does not fit is dropped by the drop policy of the executor.
+ * The executors are configured in /fastcgi/executors and found by the components
+ * with ComponentContext::getExecutor.
+ */
+class Executor {
+public:
+	/**
+	 * The queued tasks of the higher priority run first
+	 */
+	enum class Priority {HIGH, NORMAL, LOW};
+
+public:
+	virtual ~Executor();
+
+	/**
+	 * Returns false if the task is dropped
+	 */
+	virtual bool submit(std::function<void()> task, Priority priority = Priority::NORMAL) = 0;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_EXECUTOR_H_
@@ -21,8 +21,10 @@
 #define _FASTCGI_HANDLER_H_
 
 #include <functional>
+#include <memory>
 
 #include "core/any.hpp"
+#include "fastcgi3/cancellation_token.h"
 
 #include <string>
 #include <vector>
@@ -39,6 +41,12 @@ public:
 
 	virtual core::any getParam(const std::string &name) const = 0;
 	virtual void setParam(const std::string &name, const core::any &value) = 0;
+
+	/**
+	 * Cancellation of the request: the remaining filters and handlers
+	 * are not invoked after the token is tripped
+	 */
+	virtual std::shared_ptr<CancellationToken> cancellation() const;
 };
 
 /*!
@@ -55,6 +63,8 @@ public:
  *
  *  The pointer to the object HandlerContext can be used to store the request-specific data,
  *  and to share it between different filters and handlers.
+ *  Long running handlers should poll HandlerContext::cancellation() to stop
+ *  working on the request aborted by the web server.
  */
 class Handler {
 public:
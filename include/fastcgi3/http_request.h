@@ -94,6 +94,8 @@ public:
 
     bool isSecure() const;
     DataBuffer requestBody() const;
+    RequestBodyStream* requestBodyStream() const;
+    bool readForm(const Request::FilePartHandler &handler = nullptr);
 
     std::shared_ptr<Session> createSession();
     std::shared_ptr<Session> getSession();
@@ -26,6 +26,7 @@
 #include <functional>
 #include <sstream>
 #include <chrono>
+#include <memory>
 
 #include "fastcgi3/util.h"
 #include "fastcgi3/cookie.h"
@@ -36,6 +37,7 @@
 #include "fastcgi3/config.h"
 #include "fastcgi3/range.h"
 #include "fastcgi3/functors.h"
+#include "fastcgi3/response_encoder.h"
 
 namespace fastcgi
 {
@@ -56,8 +58,10 @@ private:
 	DataBuffer data_;
 };
 
+class FormPartStream;
 class Logger;
 class Request;
+class RequestBodyStream;
 class RequestCache;
 class RequestIOStream;
 class RequestsThreadPool;
@@ -66,6 +70,14 @@ using VarMap = std::map<std::string, std::string>;
 using HeaderMap = std::map<std::string, std::string, StringCILess>;
 
 class Request {
+public:
+	/**
+	 * How the body is taken from the web server when the request is attached:
+	 * read in advance, left to the handler or not read at all
+	 * (the request is answered without dispatching it to the handler)
+	 */
+	enum class BodyMode {READ, STREAM, SKIP};
+
 public:
 	Request(std::shared_ptr<Logger> logger, std::shared_ptr<RequestCache> cache, std::shared_ptr<SessionManager> sessionManager);
 	~Request();
@@ -131,6 +143,31 @@ public:
 	bool isSecure() const;
 	DataBuffer requestBody() const;
 
+	/**
+	 * Body of the request served by the handler with body="stream":
+	 * it is not read in advance and the POST arguments are not parsed
+	 * unless the handler calls readForm().
+	 * Returns nullptr if the body has been read into requestBody().
+	 */
+	RequestBodyStream* requestBodyStream() const;
+	bool isBodyStreamed() const;
+
+	/**
+	 * File part of the streamed form: the field name, the remote file name,
+	 * the content type and the data of the part
+	 */
+	using FilePartHandler = std::function<void(const std::string &name, const std::string &remoteName,
+		const std::string &type, FormPartStream &data)>;
+
+	/**
+	 * Parses the streamed body as it is read, the body is consumed.
+	 * The urlencoded and multipart fields are added to the arguments. Each file part
+	 * is passed to the handler while it is being received, its data left unread
+	 * is skipped; without the handler the files are kept as remote files.
+	 * Returns false if the body is not streamed or is not a form.
+	 */
+	bool readForm(const FilePartHandler &handler = nullptr);
+
 	bool isBot() const;
 
 	void setCookie(const Cookie &cookie);
@@ -138,6 +175,7 @@ public:
 	bool headersSent() const;
 	void setStatus(unsigned short status);
 	void sendError(unsigned short status);
+	void sendError(unsigned short status, const HeaderMap &headers);
 	void setHeader(const std::string &name, const std::string &value);
 
 	std::shared_ptr<Session> createSession();
@@ -158,8 +196,60 @@ public:
 
 	void write(std::streambuf *buf);
 	std::streamsize write(const char *buf, std::streamsize size);
+
+	/**
+	 * Sends the file (or its range) as the response body.
+	 * The data is passed to the web server connection by the kernel when
+	 * the request stream supports it, otherwise the file is memory mapped.
+	 * Content-Length is set unless the response has been started already.
+	 */
+	void sendFile(const std::string &path);
+	void sendFile(const std::string &path, std::uint64_t offset, std::uint64_t length);
+	void sendFile(int fd, std::uint64_t offset, std::uint64_t length);
+
+	/**
+	 * Sends the output written so far to the web server right away
+	 */
+	void flush();
+
+	/**
+	 * Size of the buffered output of RequestStream which is flushed
+	 * to the web server as soon as it is reached (0 - never).
+	 * Configured with the flush-threshold attribute of the handler or pool.
+	 */
+	std::size_t flushThreshold() const;
+	void setFlushThreshold(std::size_t threshold);
 	std::string outputHeader(const std::string &name) const;
 
+	/**
+	 * Encoder of the response body (e.g. compression), installed by a filter
+	 * before the response is started. It is dropped if it declines
+	 * the response and for the error pages.
+	 */
+	void setEncoder(std::unique_ptr<ResponseEncoder> encoder);
+	ResponseEncoder* encoder() const;
+
+	/**
+	 * Priority class of the request within its pool, set from the priority-class
+	 * attribute of the handler. A filter may reclassify the request: the handlers
+	 * are then queued again in the new class.
+	 */
+	const std::string& getPriorityClass() const;
+	void setPriorityClass(const std::string &name);
+
+	/**
+	 * Registers the callback run once the response has been finished to the client,
+	 * on the thread finishing it. The long work is better submitted to an Executor.
+	 * The callbacks of the request which is not answered to a client
+	 * are run when the request is reset or destroyed.
+	 */
+	void afterResponse(std::function<void()> callback);
+
+	/**
+	 * Runs the afterResponse callbacks, called by the stream which has finished the response
+	 */
+	void runAfterResponse();
+
 	bool isProcessed() const;
 	void markAsProcessed();
 	void tryAgain(std::chrono::milliseconds delay);
@@ -189,6 +279,13 @@ public:
 	void reset();
 	void sendHeaders();
 	void attach(RequestIOStream *stream, char *env[]);
+	void attach(RequestIOStream *stream, char *env[], const std::function<BodyMode(const Request*)> &bodyMode);
+
+	/**
+	 * Attaches the request already parsed from its environment to the stream
+	 * its body is taken from
+	 */
+	void attach(RequestIOStream *stream, BodyMode mode);
 
 	unsigned short status() const;
 
@@ -196,6 +293,11 @@ private:
 	friend class Parser;
 	friend RequestsThreadPool;
 	void sendHeadersInternal();
+	void buildHeaders(std::string &out);
+	void writeOutput(const char *buf, std::size_t size);
+	void startEncoder();
+	void finishOutput();
+	void attachBody(BodyMode mode);
 	bool disablePostParams() const;
 
 	std::uint64_t serializeEnv(DataBuffer &buffer, std::uint64_t add_size);
@@ -223,10 +325,14 @@ private:
 	unsigned short status_;
 	bool processed_;
 	std::chrono::milliseconds delay_;
+	std::size_t flush_threshold_;
+	std::string priority_class_;
+	std::vector<std::function<void()>> after_response_;
 
 	RequestIOStream* stream_;
 	VarMap vars_, cookies_;
 	DataBuffer body_;
+	std::unique_ptr<RequestBodyStream> body_stream_;
 	HeaderMap headers_, out_headers_;
 
 	std::set<Cookie> out_cookies_;
@@ -244,6 +350,7 @@ private:
 	std::shared_ptr<security::Subject> subject_;
 
 	std::stringstream response_stream_;
+	std::unique_ptr<ResponseEncoder> encoder_;
 };
 
 } // namespace fastcgi
@@ -20,6 +20,10 @@
 #ifndef _FASTCGI_REQUEST_IO_STREAM_H_
 #define _FASTCGI_REQUEST_IO_STREAM_H_
 
+#include <sys/uio.h>
+
+#include <cstdint>
+
 namespace fastcgi
 {
 
@@ -28,6 +32,31 @@ public:
 	virtual int read(char *buf, int size) = 0;
 	virtual int write(const char *buf, int size) = 0;
 	virtual void write(std::streambuf *buf) = 0;
+
+	/**
+	 * Gathered write of the response segments.
+	 * Streams which can emit the segments without copying override it,
+	 * by default the segments are written one by one
+	 */
+	virtual void writev(const struct iovec *iov, int count) {
+		for (int i = 0; i < count; ++i) {
+			write(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+		}
+	}
+
+	/**
+	 * Sends the file range as the response data without reading it into
+	 * the userspace. Returns false if the stream can not do that.
+	 */
+	virtual bool sendFile(int /*fd*/, std::uint64_t /*offset*/, std::uint64_t /*length*/) {
+		return false;
+	}
+
+	/**
+	 * Passes the data buffered by the stream to the web server
+	 */
+	virtual void flush() {
+	}
 };
 
 } // namespace fastcgi
@@ -0,0 +1,68 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_RESPONSE_ENCODER_H_
+#define _FASTCGI_RESPONSE_ENCODER_H_
+
+#include <cstddef>
+#include <string>
+
+namespace fastcgi
+{
+
+class Request;
+
+/**
+ * Transformation of the response body (e.g. compression) installed
+ * by a filter with Request::setEncoder.
+ *
+ * The encoder is started right before the headers are sent, when the status
+ * and the content type of the response are known: it may adjust the headers
+ * and decline to transform the body. Then all the body written by the handler
+ * is passed through encode(). The encoded body has no Content-Length.
+ */
+class ResponseEncoder {
+public:
+	/**
+	 * WRITE - the output may be retained by the encoder,
+	 * FLUSH - all the output written so far must be decodable by the client,
+	 * FINISH - the last call for the response
+	 */
+	enum class Mode {WRITE, FLUSH, FINISH};
+
+public:
+	ResponseEncoder();
+	virtual ~ResponseEncoder();
+
+	ResponseEncoder(const ResponseEncoder&) = delete;
+	ResponseEncoder& operator=(const ResponseEncoder&) = delete;
+
+	/**
+	 * Returns false if the body of the response should be sent as is
+	 */
+	virtual bool start(Request *request) = 0;
+
+	/**
+	 * Appends the encoded data to out
+	 */
+	virtual void encode(const char *data, std::size_t size, Mode mode, std::string &out) = 0;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_RESPONSE_ENCODER_H_
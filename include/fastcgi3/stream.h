@@ -20,6 +20,7 @@
 #ifndef _FASTCGI_STREAM_H_
 #define _FASTCGI_STREAM_H_
 
+#include <cstdint>
 #include <string>
 #include <sstream>
 
@@ -27,6 +28,7 @@ namespace fastcgi
 {
 
 class Request;
+class RequestIOStream;
 
 class RequestStream {
 public:
@@ -40,6 +42,9 @@ public:
 	
 	template<typename T> RequestStream& operator << (const T &value) {
 		(*stream_) << value;
+		if (threshold_ > 0) {
+			checkThreshold();
+		}
 		return *this;
 	}
 
@@ -50,9 +55,60 @@ public:
 	void reset();
 	void flush();
 
+	/**
+	 * Sends the buffered output to the web server and releases it.
+	 * Headers are committed by the first flush and can not be changed after.
+	 */
+	void flushNow();
+
+protected:
+	void checkThreshold();
+
 protected:
 	Request *request_;
 	std::stringstream* stream_;
+	std::size_t threshold_;
+};
+
+/**
+ * Request body which is read incrementally, as it comes from the web server.
+ * Available to the handlers configured with body="stream".
+ */
+class RequestBodyStream {
+public:
+	RequestBodyStream(RequestIOStream *stream, std::uint64_t size);
+	virtual ~RequestBodyStream();
+
+	RequestBodyStream(const RequestBodyStream&) = delete;
+	RequestBodyStream& operator=(const RequestBodyStream&) = delete;
+
+	/**
+	 * Reads up to size bytes of the body, waiting for them to arrive.
+	 * Returns 0 when the whole body is read.
+	 */
+	std::size_t read(char *buf, std::size_t size);
+
+	std::uint64_t size() const;
+	std::uint64_t remaining() const;
+	bool eof() const;
+
+private:
+	RequestIOStream *stream_;
+	std::uint64_t size_;
+	std::uint64_t read_;
+};
+
+/**
+ * Data of a file part of the streamed form body, see Request::readForm
+ */
+class FormPartStream {
+public:
+	virtual ~FormPartStream();
+
+	/**
+	 * Reads up to size bytes of the part, returns 0 at its end
+	 */
+	virtual std::size_t read(char *buf, std::size_t size) = 0;
 };
 
 } // namespace fastcgi
@@ -0,0 +1,165 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <poll.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "fastcgi3/async_handler.h"
+#include "fastcgi3/cancellation_token.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+/**
+ * Executes the continuations on the thread which invoked the handler synchronously
+ */
+class BlockingAsyncContext : public AsyncContext {
+public:
+	BlockingAsyncContext(Request *req, HandlerContext *context) :
+		req_(req), context_(context), done_(false)
+	{}
+
+	virtual void waitReadable(int fd, std::chrono::milliseconds timeout, WaitType next) override {
+		wait(fd, POLLIN, timeout, std::move(next));
+	}
+
+	virtual void waitWritable(int fd, std::chrono::milliseconds timeout, WaitType next) override {
+		wait(fd, POLLOUT, timeout, std::move(next));
+	}
+
+	virtual void sleep(std::chrono::milliseconds delay, ResumeType next) override {
+		schedule([delay, next]() {
+			std::this_thread::sleep_for(delay);
+			next();
+		});
+	}
+
+	virtual void invoke(std::shared_ptr<Handler> handler, ResumeType next) override {
+		Request *req = req_;
+		HandlerContext *context = context_;
+		schedule([req, context, handler, next]() {
+			handler->handleRequest(req, context);
+			next();
+		});
+	}
+
+	virtual void complete() override {
+		std::lock_guard<std::mutex> lock(mutex_);
+		done_ = true;
+		condition_.notify_one();
+	}
+
+	virtual void fail(std::exception_ptr error) override {
+		std::lock_guard<std::mutex> lock(mutex_);
+		error_ = error;
+		done_ = true;
+		condition_.notify_one();
+	}
+
+	void run() {
+		while (true) {
+			ResumeType step;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				condition_.wait(lock, [this] { return done_ || !steps_.empty(); });
+				if (done_) {
+					break;
+				}
+				step = std::move(steps_.front());
+				steps_.pop_front();
+			}
+			step();
+		}
+		if (error_) {
+			std::rethrow_exception(error_);
+		}
+	}
+
+private:
+	void schedule(ResumeType step) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		steps_.push_back(std::move(step));
+		condition_.notify_one();
+	}
+
+	void wait(int fd, short events, std::chrono::milliseconds timeout, WaitType next) {
+		std::chrono::steady_clock::time_point deadline = context_->cancellation()->deadline();
+		if (timeout > std::chrono::milliseconds(0)) {
+			const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + timeout;
+			if (std::chrono::steady_clock::time_point() == deadline || end < deadline) {
+				deadline = end;
+			}
+		}
+		schedule([fd, events, deadline, next]() {
+			int res = 0;
+			do {
+				int ms = -1;
+				if (std::chrono::steady_clock::time_point() != deadline) {
+					ms = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+						deadline - std::chrono::steady_clock::now()).count());
+				}
+				struct pollfd p;
+				p.fd = fd;
+				p.events = events;
+				p.revents = 0;
+				res = poll(&p, 1, ms);
+			} while (res < 0 && EINTR == errno);
+			next(res > 0);
+		});
+	}
+
+private:
+	Request *req_;
+	HandlerContext *context_;
+	std::mutex mutex_;
+	std::condition_variable condition_;
+	std::deque<ResumeType> steps_;
+	std::exception_ptr error_;
+	bool done_;
+};
+
+AsyncContext::AsyncContext() {
+}
+
+AsyncContext::~AsyncContext() {
+}
+
+AsyncHandler::AsyncHandler() {
+}
+
+AsyncHandler::~AsyncHandler() {
+}
+
+void
+AsyncHandler::handleRequest(Request *req, HandlerContext *context) {
+	std::shared_ptr<BlockingAsyncContext> async = std::make_shared<BlockingAsyncContext>(req, context);
+	handleRequestAsync(req, context, async);
+	async->run();
+}
+
+} // namespace fastcgi
@@ -0,0 +1,201 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
+
+#include "fastcgi3/logger.h"
+#include "fastcgi3/util.h"
+
+#include "details/async_reactor.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const int MAX_EVENTS = 64;
+
+// Identifier of the wakeup descriptor in the epoll events, the waiters are numbered from 1
+static const std::uint64_t WAKEUP_ID = 0;
+
+AsyncReactor::AsyncReactor(std::shared_ptr<Logger> logger) :
+	logger_(std::move(logger)), epoll_(-1), wakeup_(-1), next_id_(WAKEUP_ID + 1)
+{
+	stopped_.store(false);
+
+	epoll_ = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epoll_) {
+		throw std::runtime_error("Cannot create epoll instance: " + StringUtils::error(errno));
+	}
+
+	wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == wakeup_) {
+		close(epoll_);
+		throw std::runtime_error("Cannot create reactor wakeup descriptor: " + StringUtils::error(errno));
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = WAKEUP_ID;
+	epoll_ctl(epoll_, EPOLL_CTL_ADD, wakeup_, &ev);
+
+	thread_.reset(new std::thread(&AsyncReactor::run, this));
+}
+
+AsyncReactor::~AsyncReactor() {
+	stop();
+	close(wakeup_);
+	close(epoll_);
+}
+
+void
+AsyncReactor::stop() {
+	stopped_.store(true);
+	wakeup();
+	if (thread_ && thread_->joinable()) {
+		thread_->join();
+	}
+}
+
+void
+AsyncReactor::wakeup() {
+	std::uint64_t one = 1;
+	if (sizeof(one) != write(wakeup_, &one, sizeof(one))) {
+		// The counter is already signalled
+	}
+}
+
+void
+AsyncReactor::wait(int fd, std::uint32_t events, TimePoint deadline, CallbackType callback) {
+	add(fd, events, deadline, std::move(callback));
+}
+
+void
+AsyncReactor::wait(TimePoint deadline, CallbackType callback) {
+	add(-1, 0, deadline, std::move(callback));
+}
+
+void
+AsyncReactor::add(int fd, std::uint32_t events, TimePoint deadline, CallbackType callback) {
+	bool earliest = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		const std::uint64_t id = next_id_++;
+		if (-1 != fd) {
+			struct epoll_event ev;
+			ev.events = events | EPOLLONESHOT;
+			ev.data.u64 = id;
+			if (-1 == epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev)) {
+				throw std::runtime_error("Cannot wait for descriptor " + std::to_string(fd) + ": " + StringUtils::error(errno));
+			}
+		}
+		Waiter &waiter = waiters_[id];
+		waiter.fd = fd;
+		waiter.callback = std::move(callback);
+		waiter.timer = timers_.end();
+		if (TimePoint::max() != deadline) {
+			waiter.timer = timers_.insert(std::make_pair(deadline, id));
+			earliest = timers_.begin() == waiter.timer;
+		}
+	}
+	// The reactor thread recalculates its timeout
+	if (earliest) {
+		wakeup();
+	}
+}
+
+void
+AsyncReactor::run() {
+	struct epoll_event events[MAX_EVENTS];
+	std::vector<std::pair<CallbackType, bool>> fired;
+	while (!stopped_.load()) {
+		int timeout = -1;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!timers_.empty()) {
+				const TimePoint now = std::chrono::steady_clock::now();
+				const TimePoint first = timers_.begin()->first;
+				timeout = first <= now ? 0 :
+					static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(first - now).count()) + 1;
+			}
+		}
+
+		int num = epoll_wait(epoll_, events, MAX_EVENTS, timeout);
+		if (num < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			logger_->error("AsyncReactor: epoll_wait failed: %s", StringUtils::error(errno).c_str());
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (int i = 0; i < num; ++i) {
+				const std::uint64_t id = events[i].data.u64;
+				if (WAKEUP_ID == id) {
+					std::uint64_t value;
+					while (read(wakeup_, &value, sizeof(value)) > 0) {
+					}
+					continue;
+				}
+				auto it = waiters_.find(id);
+				if (waiters_.end() == it) {
+					continue;
+				}
+				epoll_ctl(epoll_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+				if (timers_.end() != it->second.timer) {
+					timers_.erase(it->second.timer);
+				}
+				fired.emplace_back(std::move(it->second.callback), true);
+				waiters_.erase(it);
+			}
+
+			const TimePoint now = std::chrono::steady_clock::now();
+			while (!timers_.empty() && timers_.begin()->first <= now) {
+				auto it = waiters_.find(timers_.begin()->second);
+				timers_.erase(timers_.begin());
+				if (-1 != it->second.fd) {
+					epoll_ctl(epoll_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+				}
+				fired.emplace_back(std::move(it->second.callback), false);
+				waiters_.erase(it);
+			}
+		}
+
+		// The callbacks may register new waiters
+		for (auto &f : fired) {
+			try {
+				f.first(f.second);
+			} catch (const std::exception &e) {
+				logger_->error("AsyncReactor: callback failed: %s", e.what());
+			}
+		}
+		fired.clear();
+	}
+}
+
+} // namespace fastcgi
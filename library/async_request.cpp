@@ -0,0 +1,283 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <sys/epoll.h>
+
+#include "fastcgi3/cancellation_token.h"
+#include "fastcgi3/logger.h"
+
+#include "details/async_reactor.h"
+#include "details/async_request.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+/**
+ * Context of the asynchronous handler invoked by another one:
+ * its completion resumes the invoking handler
+ */
+class NestedAsyncContext : public AsyncContext {
+public:
+	NestedAsyncContext(std::shared_ptr<AsyncRequest> request, ResumeType next) :
+		request_(std::move(request)), next_(std::move(next))
+	{}
+
+	virtual void waitReadable(int fd, std::chrono::milliseconds timeout, WaitType next) override {
+		request_->waitReadable(fd, timeout, std::move(next));
+	}
+
+	virtual void waitWritable(int fd, std::chrono::milliseconds timeout, WaitType next) override {
+		request_->waitWritable(fd, timeout, std::move(next));
+	}
+
+	virtual void sleep(std::chrono::milliseconds delay, ResumeType next) override {
+		request_->sleep(delay, std::move(next));
+	}
+
+	virtual void invoke(std::shared_ptr<Handler> handler, ResumeType next) override {
+		request_->invoke(std::move(handler), std::move(next));
+	}
+
+	virtual void complete() override {
+		request_->schedule(next_);
+	}
+
+	virtual void fail(std::exception_ptr error) override {
+		request_->fail(error);
+	}
+
+private:
+	std::shared_ptr<AsyncRequest> request_;
+	ResumeType next_;
+};
+
+AsyncRequest::AsyncRequest(RequestsThreadPool *pool, const RequestTask &task, std::shared_ptr<HandlerContext> context) :
+	pool_(pool), task_(task.clone()), context_(std::move(context)), cancellation_(task.cancellation), priority_(task.priority), next_(0), completed_(false), watched_(false),
+	running_(true), finished_(false)
+{
+	// Created by the step which suspends the request for the first time
+}
+
+AsyncRequest::~AsyncRequest() {
+}
+
+void
+AsyncRequest::waitReadable(int fd, std::chrono::milliseconds timeout, WaitType next) {
+	wait(fd, EPOLLIN, timeout, std::move(next));
+}
+
+void
+AsyncRequest::waitWritable(int fd, std::chrono::milliseconds timeout, WaitType next) {
+	wait(fd, EPOLLOUT, timeout, std::move(next));
+}
+
+void
+AsyncRequest::sleep(std::chrono::milliseconds delay, ResumeType next) {
+	if (finished()) {
+		return;
+	}
+	std::shared_ptr<AsyncRequest> self = shared_from_this();
+	pool_->reactor()->wait(std::chrono::steady_clock::now() + delay, [self, next](bool) {
+		self->schedule(next);
+	});
+}
+
+void
+AsyncRequest::invoke(std::shared_ptr<Handler> handler, ResumeType next) {
+	std::shared_ptr<AsyncRequest> self = shared_from_this();
+	schedule([self, handler, next]() {
+		Request *req = self->task_.request.get();
+		if (AsyncHandler *async = dynamic_cast<AsyncHandler*>(handler.get())) {
+			async->handleRequestAsync(req, self->context_.get(), std::make_shared<NestedAsyncContext>(self, next));
+		} else {
+			handler->handleRequest(req, self->context_.get());
+			next();
+		}
+	});
+}
+
+void
+AsyncRequest::complete() {
+	std::shared_ptr<AsyncRequest> self = shared_from_this();
+	schedule([self]() {
+		self->completed_ = true;
+	});
+}
+
+void
+AsyncRequest::fail(std::exception_ptr error) {
+	schedule([error]() {
+		std::rethrow_exception(error);
+	});
+}
+
+RequestTask&
+AsyncRequest::task() {
+	return task_;
+}
+
+std::shared_ptr<HandlerContext>
+AsyncRequest::context() const {
+	return context_;
+}
+
+void
+AsyncRequest::suspend(std::size_t next) {
+	next_ = next;
+	completed_ = false;
+	if (!watched_) {
+		watched_ = true;
+		watchCancellation();
+	}
+}
+
+std::size_t
+AsyncRequest::next() const {
+	return next_;
+}
+
+bool
+AsyncRequest::completed() const {
+	return completed_;
+}
+
+void
+AsyncRequest::schedule(StepType step) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (finished_) {
+			return;
+		}
+		if (running_) {
+			steps_.push_back(std::move(step));
+			return;
+		}
+		running_ = true;
+	}
+	post(std::move(step));
+}
+
+void
+AsyncRequest::release() {
+	StepType step;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (finished_ || steps_.empty()) {
+			running_ = false;
+			return;
+		}
+		step = std::move(steps_.front());
+		steps_.pop_front();
+	}
+	post(std::move(step));
+}
+
+void
+AsyncRequest::finish() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		finished_ = true;
+		steps_.clear();
+	}
+	// The request is completed when the last reference to its stream is dropped
+	task_ = RequestTask();
+	context_.reset();
+}
+
+bool
+AsyncRequest::finished() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return finished_;
+}
+
+void
+AsyncRequest::post(StepType step) {
+	std::shared_ptr<AsyncRequest> self = shared_from_this();
+	RequestTask task;
+	task.resume = [self, step]() {
+		self->pool_->resume(self, step);
+	};
+	try {
+		pool_->addContinuation(std::move(task), priority_);
+	} catch (const std::exception &e) {
+		// The pool is stopped
+		std::lock_guard<std::mutex> lock(mutex_);
+		finished_ = true;
+		steps_.clear();
+	}
+}
+
+void
+AsyncRequest::wait(int fd, std::uint32_t events, std::chrono::milliseconds timeout, WaitType next) {
+	if (finished()) {
+		return;
+	}
+	std::shared_ptr<AsyncRequest> self = shared_from_this();
+	pool_->reactor()->wait(fd, events, deadline(timeout), [self, next](bool ready) {
+		self->schedule([next, ready]() {
+			next(ready);
+		});
+	});
+}
+
+std::chrono::steady_clock::time_point
+AsyncRequest::deadline(std::chrono::milliseconds timeout) const {
+	std::chrono::steady_clock::time_point deadline = cancellation_->deadline();
+	if (std::chrono::steady_clock::time_point() == deadline) {
+		deadline = std::chrono::steady_clock::time_point::max();
+	}
+	if (timeout > std::chrono::milliseconds(0)) {
+		deadline = std::min(deadline, std::chrono::steady_clock::now() + timeout);
+	}
+	return deadline;
+}
+
+void
+AsyncRequest::watchCancellation() {
+	// The cancelled request is completed by the pool without waiting for the handler,
+	// the continuations scheduled after that are dropped
+	std::weak_ptr<AsyncRequest> weak = shared_from_this();
+	auto cancel = [weak]() {
+		if (std::shared_ptr<AsyncRequest> self = weak.lock()) {
+			self->schedule([self]() {
+				if (self->cancellation_->cancelled()) {
+					self->completed_ = true;
+				}
+			});
+		}
+	};
+
+	cancellation_->onCancel([cancel](CancellationToken::Reason) {
+		cancel();
+	});
+
+	// The timer keeps the request until its deadline even if the handler has lost it
+	const std::chrono::steady_clock::time_point deadline = cancellation_->deadline();
+	if (std::chrono::steady_clock::time_point() != deadline) {
+		std::shared_ptr<AsyncRequest> self = shared_from_this();
+		pool_->reactor()->wait(deadline, [self, cancel](bool) {
+			cancel();
+		});
+	}
+}
+
+} // namespace fastcgi
@@ -0,0 +1,179 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdexcept>
+
+#include "fastcgi3/logger.h"
+#include "details/background_executor.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+Executor::~Executor() {
+}
+
+BackgroundExecutor::BackgroundExecutor(unsigned threadsNumber, unsigned queueLength, DropPolicy dropPolicy) :
+	threads_number_(threadsNumber), queue_length_(queueLength), drop_policy_(dropPolicy),
+	size_(0), started_(false), stopped_(false), busy_(0), completed_(0), failed_(0), dropped_(0)
+{
+	if (0 == threadsNumber || 0 == queueLength) {
+		throw std::runtime_error("executor threads and queue must be positive");
+	}
+}
+
+BackgroundExecutor::~BackgroundExecutor() {
+	stop();
+	join();
+}
+
+bool
+BackgroundExecutor::submit(std::function<void()> task, Priority priority) {
+	const unsigned index = static_cast<unsigned>(priority) < PRIORITIES ? static_cast<unsigned>(priority) : PRIORITIES - 1;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stopped_) {
+			++dropped_;
+			return false;
+		}
+		if (size_ >= queue_length_) {
+			++dropped_;
+			if (DropPolicy::REJECT == drop_policy_) {
+				return false;
+			}
+			int victim = PRIORITIES - 1;
+			while (victim >= static_cast<int>(index) && queues_[victim].empty()) {
+				--victim;
+			}
+			if (victim < static_cast<int>(index)) {
+				// The queue is full of the tasks more important than the new one
+				return false;
+			}
+			queues_[victim].pop_front();
+			--size_;
+		}
+		queues_[index].push_back(std::move(task));
+		++size_;
+	}
+	condition_.notify_one();
+	return true;
+}
+
+void
+BackgroundExecutor::start(std::shared_ptr<Logger> logger) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (started_) {
+		return;
+	}
+	started_ = true;
+	logger_ = std::move(logger);
+	for (unsigned i = 0; i < threads_number_; ++i) {
+		threads_.push_back(std::unique_ptr<std::thread>(new std::thread(&BackgroundExecutor::workMethod, this)));
+	}
+}
+
+void
+BackgroundExecutor::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopped_ = true;
+	}
+	condition_.notify_all();
+}
+
+void
+BackgroundExecutor::join() {
+	std::vector<std::unique_ptr<std::thread>> threads;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		threads.swap(threads_);
+	}
+	for (auto &t : threads) {
+		if (t->joinable()) {
+			t->join();
+		}
+	}
+}
+
+BackgroundExecutor::DropPolicy
+BackgroundExecutor::dropPolicy() const {
+	return drop_policy_;
+}
+
+ExecutorInfo
+BackgroundExecutor::getInfo() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	ExecutorInfo info;
+	info.threadsNumber = threads_number_;
+	info.queueLength = queue_length_;
+	info.currentQueue = size_;
+	info.busyThreadsCounter = busy_;
+	info.completedTasksCounter = completed_;
+	info.failedTasksCounter = failed_;
+	info.droppedTasksCounter = dropped_;
+	return info;
+}
+
+void
+BackgroundExecutor::workMethod() {
+	std::function<void()> task;
+	while (take(task)) {
+		bool failed = true;
+		try {
+			task();
+			failed = false;
+		} catch (const std::exception &e) {
+			if (logger_) {
+				logger_->error("background task failed: %s", e.what());
+			}
+		} catch (...) {
+			if (logger_) {
+				logger_->error("background task failed with unknown exception");
+			}
+		}
+		task = nullptr;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		--busy_;
+		++(failed ? failed_ : completed_);
+	}
+}
+
+bool
+BackgroundExecutor::take(std::function<void()> &task) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	condition_.wait(lock, [this] {
+		return stopped_ || size_ > 0;
+	});
+	for (auto &queue : queues_) {
+		if (!queue.empty()) {
+			task = std::move(queue.front());
+			queue.pop_front();
+			--size_;
+			++busy_;
+			return true;
+		}
+	}
+	// Stopped and drained
+	return false;
+}
+
+} // namespace fastcgi
@@ -0,0 +1,141 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+#include <stdexcept>
+
+#include "fastcgi3/request.h"
+
+#include "details/bulkhead.h"
+#include "details/request_thread_pool.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+struct Bulkhead::Waiting {
+	RequestTask task;
+	RequestsThreadPool *pool;
+};
+
+Bulkhead::Permit::Permit(std::shared_ptr<Bulkhead> bulkhead) :
+	bulkhead_(std::move(bulkhead))
+{}
+
+Bulkhead::Permit::~Permit() {
+	bulkhead_->release();
+}
+
+Bulkhead::Bulkhead(unsigned maxConcurrency, unsigned queueLength) :
+	max_concurrency_(maxConcurrency), queue_length_(queueLength)
+{
+	if (0 == maxConcurrency) {
+		throw std::runtime_error("max-concurrency of the handler must be positive");
+	}
+	running_.store(0);
+	rejected_.store(0);
+}
+
+Bulkhead::~Bulkhead() {
+}
+
+bool
+Bulkhead::acquire(RequestTask &task, RequestsThreadPool *pool) {
+	if (tryAcquire()) {
+		task.permit = std::make_shared<Permit>(shared_from_this());
+		return true;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	// A permit released meanwhile is not given to the waiting tasks without the lock
+	if (tryAcquire()) {
+		lock.unlock();
+		task.permit = std::make_shared<Permit>(shared_from_this());
+		return true;
+	}
+	if (waiting_.size() >= queue_length_) {
+		rejected_.fetch_add(1);
+		return false;
+	}
+	waiting_.push_back(std::unique_ptr<Waiting>(new Waiting{std::move(task), pool}));
+	task = RequestTask();
+	return true;
+}
+
+bool
+Bulkhead::tryAcquire() {
+	unsigned running = running_.load();
+	do {
+		if (running >= max_concurrency_) {
+			return false;
+		}
+	} while (!running_.compare_exchange_weak(running, running + 1));
+	return true;
+}
+
+void
+Bulkhead::release() {
+	std::unique_ptr<Waiting> next;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (waiting_.empty()) {
+			running_.fetch_sub(1);
+			return;
+		}
+		// The permit passes to the task waiting longest
+		next = std::move(waiting_.front());
+		waiting_.pop_front();
+	}
+
+	RequestTask &task = next->task;
+	task.permit = std::make_shared<Permit>(shared_from_this());
+	task.queued = std::chrono::steady_clock::now();
+	try {
+		const unsigned priority = task.priority;
+		next->pool->addContinuation(std::move(task), priority);
+	} catch (const std::exception &e) {
+		// The pool is stopped, the task is not moved then
+		if (task.request) {
+			task.permit.reset();
+			task.request->sendError(503);
+		}
+	}
+}
+
+unsigned
+Bulkhead::maxConcurrency() const {
+	return max_concurrency_;
+}
+
+unsigned
+Bulkhead::queueLength() const {
+	return queue_length_;
+}
+
+unsigned
+Bulkhead::running() const {
+	return running_.load();
+}
+
+std::uint64_t
+Bulkhead::rejectedCounter() const {
+	return rejected_.load();
+}
+
+} // namespace fastcgi
@@ -0,0 +1,132 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include "fastcgi3/cancellation_token.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+CancellationToken::CancellationToken() {
+	reason_.store(static_cast<int>(Reason::NONE));
+	deadline_.store(0);
+}
+
+CancellationToken::~CancellationToken() {
+}
+
+bool
+CancellationToken::cancelled() {
+	if (static_cast<int>(Reason::NONE) != reason_.load()) {
+		return true;
+	}
+
+	const std::chrono::steady_clock::rep deadline = deadline_.load();
+	if (0 != deadline && std::chrono::steady_clock::now().time_since_epoch().count() >= deadline) {
+		cancel(Reason::DEADLINE);
+		return true;
+	}
+
+	ProbeType probe;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		probe = probe_;
+	}
+	if (probe) {
+		const Reason reason = probe();
+		if (Reason::NONE != reason) {
+			cancel(reason);
+			return true;
+		}
+	}
+	return false;
+}
+
+CancellationToken::Reason
+CancellationToken::reason() const {
+	return static_cast<Reason>(reason_.load());
+}
+
+void
+CancellationToken::onCancel(CallbackType callback) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (static_cast<int>(Reason::NONE) == reason_.load()) {
+			callbacks_.push_back(std::move(callback));
+			return;
+		}
+	}
+	callback(reason());
+}
+
+void
+CancellationToken::cancel(Reason reason) {
+	if (Reason::NONE == reason) {
+		return;
+	}
+
+	std::vector<CallbackType> callbacks;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		int none = static_cast<int>(Reason::NONE);
+		if (!reason_.compare_exchange_strong(none, static_cast<int>(reason))) {
+			return;
+		}
+		callbacks.swap(callbacks_);
+	}
+	for (auto &callback : callbacks) {
+		callback(reason);
+	}
+}
+
+void
+CancellationToken::release() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	callbacks_.clear();
+	probe_ = nullptr;
+}
+
+void
+CancellationToken::reset() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	callbacks_.clear();
+	probe_ = nullptr;
+	reason_.store(static_cast<int>(Reason::NONE));
+	deadline_.store(0);
+}
+
+void
+CancellationToken::setDeadline(std::chrono::steady_clock::time_point deadline) {
+	deadline_.store(deadline.time_since_epoch().count());
+}
+
+std::chrono::steady_clock::time_point
+CancellationToken::deadline() const {
+	return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(deadline_.load()));
+}
+
+void
+CancellationToken::setProbe(ProbeType probe) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	probe_ = std::move(probe);
+}
+
+} // namespace fastcgi
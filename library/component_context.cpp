@@ -52,6 +52,11 @@ ComponentContextImpl::getComponentXPath() const {
     return componentXPath_;
 }
 
+std::shared_ptr<Executor>
+ComponentContextImpl::getExecutor(const std::string &name) const {
+    return globals_->executor(name);
+}
+
 std::shared_ptr<Component>
 ComponentContextImpl::findComponentInternal(const std::string &name) const {
     return globals_->components()->find(name);
@@ -0,0 +1,188 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "details/cpu_affinity.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const std::string NODE_PATH = "/sys/devices/system/node/";
+
+CpuAffinity::CpuAffinity() : node_(-1)
+{}
+
+CpuAffinity
+CpuAffinity::create(const std::string &cpus, int node) {
+	CpuAffinity affinity;
+	if (!cpus.empty() && node >= 0) {
+		throw std::runtime_error("cpus and numa-node cannot be set together");
+	}
+	if (node >= 0) {
+		if (static_cast<unsigned>(node) >= sizeof(unsigned long) * 8) {
+			throw std::runtime_error("invalid NUMA node " + std::to_string(node));
+		}
+		affinity.cpus_ = parseList(readTopology(NODE_PATH + "node" + std::to_string(node) + "/cpulist"));
+		affinity.node_ = node;
+	} else if (!cpus.empty()) {
+		affinity.cpus_ = parseList(cpus);
+	}
+
+	// The CPUs the process may not run on are rejected now rather than by the threads
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (0 == sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		for (unsigned cpu : affinity.cpus_) {
+			if (!CPU_ISSET(cpu, &allowed)) {
+				throw std::runtime_error("CPU " + std::to_string(cpu) + " is not available");
+			}
+		}
+	}
+	return affinity;
+}
+
+std::vector<unsigned>
+CpuAffinity::parseList(const std::string &list) {
+	std::vector<unsigned> v;
+	std::istringstream stream(list);
+	std::string range;
+	while (std::getline(stream, range, ',')) {
+		const std::string::size_type begin = range.find_first_not_of(" \t\n");
+		if (std::string::npos == begin) {
+			continue;
+		}
+		range = range.substr(begin, range.find_last_not_of(" \t\n") - begin + 1);
+		unsigned long first, last;
+		std::size_t pos = 0;
+		try {
+			first = std::stoul(range, &pos);
+			last = first;
+			if (pos < range.size() && '-' == range[pos]) {
+				const std::string tail = range.substr(pos + 1);
+				last = std::stoul(tail, &pos);
+				pos += range.size() - tail.size();
+			}
+		} catch (const std::exception &e) {
+			throw std::runtime_error("invalid CPU list: " + list);
+		}
+		if (pos != range.size() || first > last || last >= CPU_SETSIZE) {
+			throw std::runtime_error("invalid CPU list: " + list);
+		}
+		for (unsigned long i = first; i <= last; ++i) {
+			v.push_back(static_cast<unsigned>(i));
+		}
+	}
+	if (v.empty()) {
+		throw std::runtime_error("invalid CPU list: " + list);
+	}
+	return v;
+}
+
+std::vector<unsigned>
+CpuAffinity::onlineNodes() {
+	std::ifstream file(NODE_PATH + "online");
+	std::string list;
+	if (!std::getline(file, list)) {
+		// The kernel without NUMA support: the whole host is node 0
+		return std::vector<unsigned>(1, 0);
+	}
+	return parseList(list);
+}
+
+int
+CpuAffinity::currentNode() {
+	unsigned cpu = 0, node = 0;
+	if (0 != syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+		return -1;
+	}
+	return static_cast<int>(node);
+}
+
+bool
+CpuAffinity::empty() const {
+	return cpus_.empty();
+}
+
+int
+CpuAffinity::numaNode() const {
+	return node_;
+}
+
+std::string
+CpuAffinity::toString() const {
+	std::string s;
+	for (std::size_t i = 0; i < cpus_.size(); ) {
+		std::size_t j = i;
+		while (j + 1 < cpus_.size() && cpus_[j + 1] == cpus_[j] + 1) {
+			++j;
+		}
+		if (!s.empty()) {
+			s += ",";
+		}
+		s += std::to_string(cpus_[i]);
+		if (j > i) {
+			s += "-" + std::to_string(cpus_[j]);
+		}
+		i = j + 1;
+	}
+	return s;
+}
+
+bool
+CpuAffinity::apply() const {
+	if (cpus_.empty()) {
+		return true;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned cpu : cpus_) {
+		CPU_SET(cpu, &set);
+	}
+	bool applied = 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (node_ >= 0) {
+		// The memory is taken from the other nodes only when the node runs out of it
+		unsigned long mask = 1UL << node_;
+		applied = 0 == syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) && applied;
+	}
+	return applied;
+}
+
+std::string
+CpuAffinity::readTopology(const std::string &path) {
+	std::ifstream file(path);
+	std::string value;
+	if (!std::getline(file, value)) {
+		throw std::runtime_error("cannot read " + path + ": the NUMA node is not available");
+	}
+	return value;
+}
+
+} // namespace fastcgi
@@ -173,6 +173,11 @@ FileBuffer::filename() const {
 	return holder_.get() ? holder_->filename : StringUtils::EMPTY_STRING;
 }
 
+int
+FileBuffer::fd() const {
+	return file_->fd();
+}
+
 DataBufferImpl*
 FileBuffer::getCopy() const {
 	std::unique_ptr<FileBuffer> buffer(new FileBuffer);
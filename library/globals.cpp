@@ -19,6 +19,7 @@
 
 // #include "settings.h"
 
+#include <algorithm>
 #include <functional>
 #include <chrono>
 
@@ -27,7 +28,9 @@
 #include "fastcgi3/handler.h"
 #include "fastcgi3/logger.h"
 
+#include "details/background_executor.h"
 #include "details/componentset.h"
+#include "details/cpu_affinity.h"
 #include "details/globals.h"
 #include "details/handlerset.h"
 #include "details/loader.h"
@@ -43,15 +46,21 @@ namespace fastcgi
 Globals::Globals(const Config *config)
 : config_(config), loader_(new Loader()), handlerSet_(new HandlerSet()), componentSet_(new ComponentSet()), logger_() {
 	loader_->init(config);
+	// The components may submit the tasks when loaded, they are run once the logger is known
+	initExecutors();
 	componentSet_->init(this);
 	handlerSet_->init(config, componentSet_.get());
 
 	initLogger();
+	startExecutors();
 	initPools();
 	startThreadPools();
 }
 
 Globals::~Globals() {
+	// The tasks may use the components and the code of the modules
+	stopExecutors();
+	joinExecutors();
 }
 
 ComponentSet*
@@ -69,6 +78,21 @@ Globals::pools() const {
 	return pools_;
 }
 
+RequestsThreadPool*
+Globals::pool(const std::string &name, int node) const {
+	auto it = node_pools_.find(name);
+	if (node_pools_.end() == it) {
+		return nullptr;
+	}
+	const std::map<int, std::shared_ptr<RequestsThreadPool>> &replicas = it->second;
+	if (1 == replicas.size()) {
+		return replicas.begin()->second.get();
+	}
+	// The request accepted by the unbound endpoint stays on the node it has been read on
+	auto replica = replicas.find(node >= 0 ? node : CpuAffinity::currentNode());
+	return (replicas.end() != replica ? replica : replicas.begin())->second.get();
+}
+
 Loader*
 Globals::loader() const {
 	return loader_.get();
@@ -93,10 +117,12 @@ startUpFunc(const std::set<std::shared_ptr<Handler>> &handlers) {
 
 void
 Globals::startThreadPools() {
-	for (auto& it : pools_) {
+	for (auto& it : node_pools_) {
 		std::set<std::shared_ptr<Handler>> handlers;
 		handlerSet_->findPoolHandlers(it.first, handlers);
-		it.second->start(std::bind(&startUpFunc, handlers));
+		for (auto& replica : it.second) {
+			replica.second->start(std::bind(&startUpFunc, handlers));
+		}
 	}
 }
 
@@ -123,16 +149,23 @@ Globals::initPools() {
     unsigned maxTasksInProcessCounter = 0;
     for (auto& p : poolSubkeys) {
         const std::string poolName = config_->asString(p + "/@name");
-        const int threadsNumber = config_->asInt(p + "/@threads");
+        const int threadsNumber = config_->asString(p + "/@max-threads", "").empty() ?
+            config_->asInt(p + "/@threads") : config_->asInt(p + "/@max-threads");
         const int queueLength = config_->asInt(p + "/@queue");
-        const std::chrono::milliseconds delay = std::chrono::milliseconds(config_->asInt(p + "/@max-delay", 0));
 
-		maxTasksInProcessCounter += (threadsNumber + queueLength);
+        // The pool is replicated on each of the listed NUMA nodes
+        const std::string numaNodes = config_->asString(p + "/@numa-nodes", "");
+        std::vector<unsigned> nodes;
+        if (!numaNodes.empty()) {
+            nodes = "all" == numaNodes ? CpuAffinity::onlineNodes() : CpuAffinity::parseList(numaNodes);
+        }
+
+		maxTasksInProcessCounter += (threadsNumber + queueLength) * std::max<std::size_t>(1, nodes.size());
 		if (maxTasksInProcessCounter > 65535) {
 			throw std::runtime_error("The sum of all threads and queue attributes must be not more than 65535");
 		}
 
-		if (pools_.find(poolName) != pools_.end()) {
+		if (node_pools_.find(poolName) != node_pools_.end()) {
             throw std::runtime_error(poolName + ": pool names must be unique");
         }
 
@@ -140,20 +173,164 @@ Globals::initPools() {
 			continue;
 		}
 
-		pools_.insert(make_pair(poolName, std::shared_ptr<RequestsThreadPool>(
-			delay > std::chrono::milliseconds(0) ?
-			new RequestsThreadPool(threadsNumber, queueLength, delay, logger_) :
-			new RequestsThreadPool(threadsNumber, queueLength, logger_)))
-		);
+		const std::string cpus = config_->asString(p + "/@cpus", "");
+		const int numaNode = config_->asInt(p + "/@numa-node", -1);
+		if (nodes.empty()) {
+			std::shared_ptr<RequestsThreadPool> pool = createPool(p, poolName, threadsNumber, queueLength);
+			pool->setAffinity(CpuAffinity::create(cpus, numaNode));
+			pools_.insert(make_pair(poolName, pool));
+			node_pools_[poolName].insert(make_pair(numaNode, pool));
+			continue;
+		}
+		if (!cpus.empty() || numaNode >= 0) {
+			throw std::runtime_error(poolName + ": numa-nodes cannot be set together with cpus or numa-node");
+		}
+		for (unsigned node : nodes) {
+			std::shared_ptr<RequestsThreadPool> pool = createPool(p, poolName, threadsNumber, queueLength);
+			pool->setAffinity(CpuAffinity::create(std::string(), node));
+			pools_.insert(make_pair(poolName + "@" + std::to_string(node), pool));
+			node_pools_[poolName].insert(make_pair(static_cast<int>(node), pool));
+		}
     }
 
     for (auto& i : poolsNeeded) {
-        if (pools_.find(i) == pools_.end()) {
+        if (node_pools_.find(i) == node_pools_.end()) {
             throw std::runtime_error("cannot find pool " + i);
         }
     }
 }
 
+std::shared_ptr<RequestsThreadPool>
+Globals::createPool(const std::string &p, const std::string &poolName, int threadsNumber, int queueLength) const {
+	const std::chrono::milliseconds delay = std::chrono::milliseconds(config_->asInt(p + "/@max-delay", 0));
+	std::shared_ptr<RequestsThreadPool> pool(
+		delay > std::chrono::milliseconds(0) ?
+		new RequestsThreadPool(threadsNumber, queueLength, delay, logger_) :
+		new RequestsThreadPool(threadsNumber, queueLength, logger_));
+	const int minThreads = config_->asInt(p + "/@min-threads", threadsNumber);
+	if (minThreads != threadsNumber) {
+		pool->setElastic(minThreads, std::chrono::milliseconds(config_->asInt(p + "/@grow-delay", 10)),
+			std::chrono::milliseconds(config_->asInt(p + "/@idle-timeout", 60000)));
+	}
+	pool->setFlushThreshold(config_->asInt(p + "/@flush-threshold", 0));
+	pool->setRetryAfter(config_->asInt(p + "/@retry-after", 1));
+	pool->setDeadline(std::chrono::milliseconds(config_->asInt(p + "/@deadline", 0)));
+	pool->setTargetDelay(std::chrono::milliseconds(config_->asInt(p + "/@target-delay", 0)),
+		std::chrono::milliseconds(config_->asInt(p + "/@delay-interval", 100)));
+
+	const std::string scheduler = config_->asString(p + "/@scheduler", "shared-queue");
+	if ("work-stealing" == scheduler) {
+		pool->setScheduler(Scheduler::WORK_STEALING);
+	} else if ("shared-queue" != scheduler) {
+		throw std::runtime_error(poolName + ": unknown pool scheduler " + scheduler);
+	}
+
+	std::vector<std::string> classSubkeys;
+	config_->subKeys(p + "/class", classSubkeys);
+	if (!classSubkeys.empty()) {
+		if (Scheduler::SHARED_QUEUE != pool->scheduler()) {
+			throw std::runtime_error(poolName + ": priority classes cannot be used with the scheduler " + scheduler);
+		}
+		std::vector<PriorityClass> classes;
+		for (auto& c : classSubkeys) {
+			const int weight = config_->asInt(c + "/@weight", 1);
+			const int classQueue = config_->asInt(c + "/@queue", 0);
+			if (weight <= 0 || classQueue < 0) {
+				throw std::runtime_error(poolName + ": invalid weight or queue of the priority class");
+			}
+			classes.push_back({config_->asString(c + "/@name"), static_cast<unsigned>(weight), static_cast<uint64_t>(classQueue)});
+		}
+		pool->setPriorityClasses(classes);
+	}
+
+	const int batchSize = config_->asInt(p + "/@batch", 1);
+	if (batchSize <= 0) {
+		throw std::runtime_error(poolName + ": pool batch must be positive");
+	}
+	pool->setBatchSize(batchSize);
+
+	const std::string dispatch = config_->asString(p + "/@dispatch", "queue");
+	if ("inline" == dispatch) {
+		pool->setInlineDispatch(true);
+	} else if ("queue" != dispatch) {
+		throw std::runtime_error(poolName + ": unknown pool dispatch " + dispatch);
+	}
+	return pool;
+}
+
+void
+Globals::initExecutors() {
+	std::vector<std::string> executorSubkeys;
+	config_->subKeys("/fastcgi/executors/executor", executorSubkeys);
+	for (auto& e : executorSubkeys) {
+		const std::string name = config_->asString(e + "/@name");
+		if (executors_.find(name) != executors_.end()) {
+			throw std::runtime_error(name + ": executor names must be unique");
+		}
+		const int threadsNumber = config_->asInt(e + "/@threads", 1);
+		const int queueLength = config_->asInt(e + "/@queue", 1000);
+		if (threadsNumber <= 0 || queueLength <= 0) {
+			throw std::runtime_error(name + ": executor threads and queue must be positive");
+		}
+		const std::string dropPolicy = config_->asString(e + "/@drop-policy", "reject");
+		if ("reject" != dropPolicy && "drop-oldest" != dropPolicy) {
+			throw std::runtime_error(name + ": unknown executor drop policy " + dropPolicy);
+		}
+		executors_.insert(make_pair(name, std::make_shared<BackgroundExecutor>(threadsNumber, queueLength,
+			"drop-oldest" == dropPolicy ? BackgroundExecutor::DropPolicy::DROP_OLDEST : BackgroundExecutor::DropPolicy::REJECT)));
+		if (default_executor_.empty()) {
+			default_executor_ = name;
+		}
+	}
+
+	if (executors_.empty()) {
+		// Handlers and components can always count on the default executor
+		default_executor_ = "default";
+		executors_.insert(make_pair(default_executor_,
+			std::make_shared<BackgroundExecutor>(1, 1000, BackgroundExecutor::DropPolicy::REJECT)));
+		return;
+	}
+	default_executor_ = config_->asString("/fastcgi/executors/@default", default_executor_);
+	if (executors_.find(default_executor_) == executors_.end()) {
+		throw std::runtime_error("cannot find executor " + default_executor_);
+	}
+}
+
+void
+Globals::startExecutors() {
+	for (auto& it : executors_) {
+		it.second->start(logger_);
+	}
+}
+
+void
+Globals::stopExecutors() {
+	for (auto& it : executors_) {
+		it.second->stop();
+	}
+}
+
+void
+Globals::joinExecutors() {
+	for (auto& it : executors_) {
+		it.second->join();
+	}
+}
+
+const Globals::ExecutorMap&
+Globals::executors() const {
+	return executors_;
+}
+
+std::shared_ptr<Executor>
+Globals::executor(const std::string &name) const {
+	auto it = executors_.find(name.empty() ? default_executor_ : name);
+	if (executors_.end() == it) {
+		return nullptr;
+	}
+	return it->second;
+}
+
 void
 Globals::initLogger() {
 	const std::string loggerComponentName = config_->asString("/fastcgi/daemon[count(logger)=1]/logger/@component");
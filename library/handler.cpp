@@ -31,6 +31,20 @@ namespace fastcgi
 
 HandlerContext::~HandlerContext() {
 }
+
+std::shared_ptr<CancellationToken>
+HandlerContext::cancellation() const {
+	// The context which is not bound to a request is never cancelled
+	return std::make_shared<CancellationToken>();
+}
+
+HandlerContextImpl::HandlerContextImpl() :
+	cancellation_(std::make_shared<CancellationToken>()) {
+}
+
+HandlerContextImpl::HandlerContextImpl(std::shared_ptr<CancellationToken> cancellation) :
+	cancellation_(cancellation ? std::move(cancellation) : std::make_shared<CancellationToken>()) {
+}
 	
 core::any HandlerContextImpl::getParam(const std::string &name) const {
 	return getAttribute(name);
@@ -39,6 +53,10 @@ core::any HandlerContextImpl::getParam(const std::string &name) const {
 void HandlerContextImpl::setParam(const std::string &name, const core::any &value) {
 	setAttribute(name, value);
 }
+
+std::shared_ptr<CancellationToken> HandlerContextImpl::cancellation() const {
+	return cancellation_;
+}
 	
 Handler::Handler() {
 }
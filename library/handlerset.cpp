@@ -19,6 +19,7 @@
 
 // #include "settings.h"
 
+#include "details/bulkhead.h"
 #include "details/handlerset.h"
 #include "details/componentset.h"
 #include "details/request_filter.h"
@@ -50,6 +51,14 @@ HandlerSet::initInternal(const Config *config, const ComponentSet *componentSet,
         HandlerDescription handlerDesc;
         handlerDesc.poolName = config->asString(k + "/@pool", defaultPoolName_);
         handlerDesc.id = config->asString(k + "/@id", "");
+        handlerDesc.streamBody = config->asString(k + "/@body", "") == "stream";
+        handlerDesc.flushThreshold = config->asInt(k + "/@flush-threshold", 0);
+        handlerDesc.deadline = std::chrono::milliseconds(config->asInt(k + "/@deadline", 0));
+        handlerDesc.priorityClass = config->asString(k + "/@priority-class", "");
+        const int maxConcurrency = config->asInt(k + "/@max-concurrency", 0);
+        if (maxConcurrency > 0) {
+            handlerDesc.bulkhead = std::make_shared<Bulkhead>(maxConcurrency, std::max(0, config->asInt(k + "/@concurrency-queue", 0)));
+        }
 
         std::string url_filter = config->asString(k + "/@url", "");
         if (!url_filter.empty()) {
@@ -193,6 +202,25 @@ HandlerSet::init(const Config *config, const ComponentSet *componentSet) {
         filters_.push_back(filterDesc);
     }
 
+    if (filters_.size() > MAX_FILTERS) {
+        throw std::runtime_error("At most " + std::to_string(MAX_FILTERS) + " filter entries may be configured");
+    }
+    chain_.clear();
+    for (unsigned entry = 0; entry < filters_.size(); ++entry) {
+        for (auto &filter : filters_[entry].handlers) {
+            chain_.push_back({entry, filter});
+        }
+    }
+
+    urlSelectorsOnly_ = true;
+    for (auto &i : handlers_) {
+        for (auto &f : i.selectors) {
+            if (f.first != "url") {
+                urlSelectorsOnly_ = false;
+            }
+        }
+    }
+
 }
 
 const HandlerSet::HandlerDescription*
@@ -201,35 +229,7 @@ HandlerSet::findURIHandler(const Request *request) const {
 	// Find the single matching handler
 
     for (auto &i : handlers_) {
-        bool matched = true;
-        for (auto &f : i.selectors) {
-            if (f.first == "url" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "host" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "address" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "port" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "referer" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "param" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-        }
-
-        if (matched) {
+        if (matches(i.selectors, request)) {
             return &i;
         }
     }
@@ -242,7 +242,10 @@ HandlerSet::findURIHandler(const std::string &uri) const {
 	// Find the single matching handler
 
     for (auto &i : handlers_) {
-        bool matched = true;
+        if (i.selectors.empty()) {
+            // Handler without selectors matches any request
+            return &i;
+        }
         for (auto &f : i.selectors) {
             if (f.first == "url" && std::dynamic_pointer_cast<UrlFilter>(f.second)->checkUrl(uri)) {
             	return &i;
@@ -252,39 +255,18 @@ HandlerSet::findURIHandler(const std::string &uri) const {
     return nullptr;
 }
 
+bool
+HandlerSet::urlSelectorsOnly() const {
+    return urlSelectorsOnly_;
+}
+
 void
 HandlerSet::findURIFilters(const Request *request, std::vector<std::shared_ptr<Filter>> &v) const {
 
 	// Find all matching filters
 
     for (auto &i : filters_) {
-        bool matched = true;
-        for (auto &f : i.selectors) {
-            if (f.first == "url" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "host" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "address" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "port" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "referer" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-            else if (f.first == "param" && !f.second->check(request)) {
-                matched = false;
-                break;
-            }
-        }
+        const bool matched = matches(i.selectors, request);
 
         if (matched) {
         	for (unsigned int n=0; n<i.handlers.size(); ++n) {
@@ -295,6 +277,32 @@ HandlerSet::findURIFilters(const Request *request, std::vector<std::shared_ptr<F
 
 }
 
+HandlerSet::FilterMask
+HandlerSet::matchURIFilters(const Request *request) const {
+    FilterMask mask = 0;
+    for (unsigned entry = 0; entry < filters_.size(); ++entry) {
+        if (matches(filters_[entry].selectors, request)) {
+            mask |= FilterMask(1) << entry;
+        }
+    }
+    return mask;
+}
+
+const HandlerSet::FilterChain&
+HandlerSet::filterChain() const {
+    return chain_;
+}
+
+bool
+HandlerSet::matches(const SelectorArray &selectors, const Request *request) {
+    for (auto &f : selectors) {
+        if (!f.second->check(request)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void
 HandlerSet::findPoolHandlers(const std::string &poolName, std::set<std::shared_ptr<Handler>> &handlers) const {
     handlers.clear();
@@ -238,6 +238,16 @@ HttpRequest::requestBody() const {
 	return req_->requestBody();
 }
 
+RequestBodyStream*
+HttpRequest::requestBodyStream() const {
+	return req_->requestBodyStream();
+}
+
+bool
+HttpRequest::readForm(const Request::FilePartHandler &handler) {
+	return req_->readForm(handler);
+}
+
 std::shared_ptr<Session>
 HttpRequest::createSession() {
 	return std::move(req_->createSession());
@@ -69,6 +69,25 @@ MMapFile::MMapFile(const char *name, std::uint64_t window, bool is_read_only)
 	map_segment(0);
 }
 
+MMapFile::MMapFile(int fd, std::uint64_t window)
+: pointer_(nullptr), size_(0), fdes_(new FileDescriptor(dup(fd))), is_read_only_(true),
+  window_(window), segment_start_(0), segment_len_(0), page_size_(getpagesize()) {
+	if (-1 == fdes_->value()) {
+		throw std::runtime_error(StringUtils::error(errno));
+	}
+
+	struct stat fs;
+	if (-1 == fstat(fdes_->value(), &fs)) {
+		throw std::runtime_error(StringUtils::error(errno));
+	}
+
+	size_ = fs.st_size;
+	checkWindow();
+	if (size_ > 0) {
+		map_segment(0);
+	}
+}
+
 void
 MMapFile::checkWindow() {
 	if (0 == window_) {
@@ -204,6 +223,11 @@ MMapFile::window() const {
 	return window_;
 }
 
+int
+MMapFile::fd() const {
+	return fdes_->value();
+}
+
 bool
 MMapFile::mapped(std::uint64_t index) const {
 	return mapped(index, index + 1);
@@ -0,0 +1,168 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "fastcgi3/data_buffer.h"
+#include "fastcgi3/util.h"
+
+#include "details/multipart_reader.h"
+#include "details/parser.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const std::size_t READ_CHUNK_SIZE = 16 * 1024;
+static const std::size_t MAX_HEADERS_SIZE = 16 * 1024;
+
+MultipartReader::MultipartReader(RequestBodyStream *body, const std::string &boundary) :
+	body_(body), delimiter_("\n" + boundary), buffer_("\n"), pos_(0), in_part_(true), finished_(false)
+{
+	// The leading line feed makes the first boundary a delimiter as well,
+	// the preamble before it is skipped as the data of a part
+}
+
+MultipartReader::~MultipartReader() {
+}
+
+bool
+MultipartReader::next(std::string &name, std::string &filename, std::string &type) {
+	char skip[4096];
+	while (read(skip, sizeof(skip)) > 0) {
+	}
+	if (finished_) {
+		return false;
+	}
+
+	// The delimiter is found by read(), the rest of its line is the transport padding
+	pos_ += delimiter_.size();
+	while (buffer_.size() - pos_ < 2) {
+		if (!fill()) {
+			throw std::runtime_error("malformed multipart message");
+		}
+	}
+	if (0 == buffer_.compare(pos_, 2, "--")) {
+		finished_ = true;
+		return false;
+	}
+
+	std::string line;
+	readLine(line);
+
+	name.clear();
+	filename.clear();
+	type.clear();
+	std::size_t headersSize = 0;
+	std::string header;
+	for (readLine(line); !line.empty(); readLine(line)) {
+		headersSize += line.size();
+		if (headersSize > MAX_HEADERS_SIZE) {
+			throw std::runtime_error("multipart headers are too large");
+		}
+		if (' ' == line[0] || '\t' == line[0]) {
+			header.append(line);
+			continue;
+		}
+		parseHeader(header, name, filename, type);
+		header = line;
+	}
+	parseHeader(header, name, filename, type);
+
+	in_part_ = true;
+	return true;
+}
+
+std::size_t
+MultipartReader::read(char *buf, std::size_t size) {
+	while (in_part_) {
+		const std::size_t found = buffer_.find(delimiter_, pos_);
+		std::size_t end = pos_;
+		if (std::string::npos != found) {
+			end = found > pos_ && '\r' == buffer_[found - 1] ? found - 1 : found;
+		} else if (buffer_.size() > pos_ + delimiter_.size()) {
+			// The tail may be the beginning of the delimiter and its carriage return
+			end = buffer_.size() - delimiter_.size();
+		}
+
+		if (end > pos_) {
+			const std::size_t len = std::min(size, end - pos_);
+			memcpy(buf, buffer_.data() + pos_, len);
+			pos_ += len;
+			return len;
+		}
+		if (std::string::npos != found) {
+			pos_ = found;
+			in_part_ = false;
+		} else if (!fill()) {
+			throw std::runtime_error("malformed multipart message");
+		}
+	}
+	return 0;
+}
+
+bool
+MultipartReader::fill() {
+	if (pos_ > 0) {
+		buffer_.erase(0, pos_);
+		pos_ = 0;
+	}
+	const std::size_t size = buffer_.size();
+	buffer_.resize(size + READ_CHUNK_SIZE);
+	const std::size_t num = body_->read(&buffer_[size], READ_CHUNK_SIZE);
+	buffer_.resize(size + num);
+	return num > 0;
+}
+
+void
+MultipartReader::readLine(std::string &line) {
+	std::size_t end;
+	while (std::string::npos == (end = buffer_.find('\n', pos_))) {
+		if (buffer_.size() - pos_ > MAX_HEADERS_SIZE || !fill()) {
+			throw std::runtime_error("malformed multipart message");
+		}
+	}
+	line.assign(buffer_, pos_, end > pos_ && '\r' == buffer_[end - 1] ? end - 1 - pos_ : end - pos_);
+	pos_ = end + 1;
+}
+
+void
+MultipartReader::parseHeader(const std::string &header, std::string &name, std::string &filename, std::string &type) {
+	const std::size_t colon = header.find(':');
+	if (std::string::npos == colon) {
+		return;
+	}
+	const std::string key = StringUtils::trim(header.substr(0, colon));
+	const std::string value = StringUtils::trim(header.substr(colon + 1));
+	if (0 == strcasecmp("Content-Disposition", key.c_str())) {
+		DataBuffer nameBuffer, filenameBuffer, typeBuffer;
+		Parser::parseLine(DataBuffer::create(value.data(), value.size()), nameBuffer, filenameBuffer, typeBuffer);
+		nameBuffer.toString(name);
+		filenameBuffer.toString(filename);
+	} else if (0 == strcasecmp("Content-Type", key.c_str())) {
+		type = value;
+	}
+}
+
+} // namespace fastcgi
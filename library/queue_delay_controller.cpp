@@ -0,0 +1,114 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+#include <cmath>
+#include <stdexcept>
+
+#include "details/queue_delay_controller.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+QueueDelayController::QueueDelayController(std::chrono::milliseconds target, std::chrono::milliseconds interval) :
+	target_(std::chrono::duration_cast<Duration>(target).count()),
+	interval_(std::chrono::duration_cast<Duration>(interval).count()),
+	first_above_(0), drop_next_(0), count_(0), last_count_(0), dropping_(false)
+{
+	if (target <= std::chrono::milliseconds(0) || interval <= std::chrono::milliseconds(0)) {
+		throw std::runtime_error("queue delay target and interval must be positive");
+	}
+	overloaded_.store(false);
+	shed_.store(0);
+}
+
+bool
+QueueDelayController::shed(Duration delay) {
+	const std::int64_t time = now();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// The queue is to be controlled once the wait has stayed above the target for an interval
+	bool above = false;
+	if (delay.count() < target_) {
+		first_above_ = 0;
+	} else if (0 == first_above_) {
+		first_above_ = time + interval_;
+	} else {
+		above = time >= first_above_;
+	}
+
+	bool drop = false;
+	if (dropping_) {
+		if (!above) {
+			dropping_ = false;
+		} else if (time >= drop_next_) {
+			drop = true;
+			++count_;
+			drop_next_ = controlLaw(drop_next_);
+		}
+	} else if (above) {
+		drop = true;
+		dropping_ = true;
+		// The overload recurring soon after the previous one resumes at the rate it has reached
+		const std::uint32_t delta = count_ - last_count_;
+		count_ = (delta > 1 && time - drop_next_ < 16 * interval_) ? delta : 1;
+		last_count_ = count_;
+		drop_next_ = controlLaw(time);
+	}
+	overloaded_.store(dropping_);
+
+	if (drop) {
+		shed_.fetch_add(1);
+	}
+	return drop;
+}
+
+bool
+QueueDelayController::overloaded() const {
+	return overloaded_.load();
+}
+
+std::uint64_t
+QueueDelayController::shedCounter() const {
+	return shed_.load();
+}
+
+std::chrono::milliseconds
+QueueDelayController::target() const {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(Duration(target_));
+}
+
+std::chrono::milliseconds
+QueueDelayController::interval() const {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(Duration(interval_));
+}
+
+std::int64_t
+QueueDelayController::controlLaw(std::int64_t time) const {
+	return time + static_cast<std::int64_t>(interval_ / std::sqrt(static_cast<double>(count_)));
+}
+
+std::int64_t
+QueueDelayController::now() {
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+} // namespace fastcgi
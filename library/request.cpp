@@ -20,21 +20,29 @@
 // #include "settings.h"
 
 #include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include <cctype>
 #include <algorithm>
+#include <iterator>
 #include <stdexcept>
 
 #include "fastcgi3/request.h"
 #include "fastcgi3/config.h"
 #include "fastcgi3/logger.h"
 #include "fastcgi3/request_io_stream.h"
+#include "fastcgi3/stream.h"
 #include "fastcgi3/session.h"
 #include "fastcgi3/security_subject.h"
 #include "fastcgi3/except.h"
 
+#include "details/file_buffer.h"
 #include "details/parser.h"
 #include "details/request_cache.h"
+#include "details/uring_file_writer.h"
+#include "details/mmap_file.h"
+#include "details/multipart_reader.h"
 #include "fastcgi3/range.h"
 #include "fastcgi3/functors.h"
 
@@ -72,6 +80,38 @@ static const std::string QUERY_STRING_KEY {"QUERY_STRING"};
 static const std::string REQUEST_METHOD_KEY {"REQUEST_METHOD"};
 static const std::string REQUEST_ID_KEY {"REQUEST_ID"};
 
+// Mapping window of the file sent without the kernel support
+static const std::uint64_t FILE_WINDOW_SIZE = 1024 * 1024;
+
+/**
+ * Gives access to the characters buffered in std::stringbuf
+ * (the response stream) so they can be written out without copying
+ */
+class StringBufferView : public std::streambuf {
+public:
+	static bool get(std::streambuf *buf, const char *&data, std::size_t &size) {
+		if (nullptr == dynamic_cast<std::stringbuf*>(buf)) {
+			return false;
+		}
+		char* (std::streambuf::*eback)() const = &StringBufferView::eback;
+		char* (std::streambuf::*gptr)() const = &StringBufferView::gptr;
+		char* (std::streambuf::*egptr)() const = &StringBufferView::egptr;
+		char* (std::streambuf::*pbase)() const = &StringBufferView::pbase;
+		char* (std::streambuf::*pptr)() const = &StringBufferView::pptr;
+
+		if ((buf->*pbase)() != (buf->*eback)()) {
+			// Get and put areas do not share the buffer
+			return false;
+		}
+		// Put area runs ahead of the get area until the next underflow
+		const char *begin = (buf->*gptr)();
+		const char *end = std::max((buf->*egptr)(), (buf->*pptr)());
+		data = begin;
+		size = end > begin ? end - begin : 0;
+		return true;
+	}
+};
+
 File::File(DataBuffer filename, DataBuffer type, DataBuffer content)
 : data_(content) {
 	if (!type.empty()) {
@@ -109,15 +149,17 @@ File::data() const {
 }
 
 Request::Request(std::shared_ptr<Logger> logger, std::shared_ptr<RequestCache> cache, std::shared_ptr<SessionManager> sessionManager) :
-	processed_(false), delay_(0), logger_(logger), cache_(cache),
+	processed_(false), delay_(0), flush_threshold_(0), logger_(logger), cache_(cache),
 	session_(), session_manager_(std::move(sessionManager)), subject_()
 {
 	reset();
 }
 
 Request::~Request() {
+	runAfterResponse();
 	session_.reset();
 	subject_.reset();
+	encoder_.reset();
 }
 
 const std::string&
@@ -390,6 +432,74 @@ Request::requestBody() const {
 	return body_;
 }
 
+RequestBodyStream*
+Request::requestBodyStream() const {
+	return body_stream_.get();
+}
+
+bool
+Request::isBodyStreamed() const {
+	return static_cast<bool>(body_stream_);
+}
+
+bool
+Request::readForm(const FilePartHandler &handler) {
+	if (!body_stream_) {
+		return false;
+	}
+
+	char buf[4096];
+	const std::string &type = getContentType();
+	if (0 == strncasecmp("multipart/form-data", type.c_str(), sizeof("multipart/form-data") - 1)) {
+		const std::string boundary = Parser::getBoundary(Range::fromString(type));
+		if (boundary.empty()) {
+			return false;
+		}
+		MultipartReader reader(body_stream_.get(), boundary);
+		std::string name, filename, partType;
+		while (reader.next(name, filename, partType)) {
+			if (name.empty()) {
+				continue;
+			}
+			if (!filename.empty() && handler) {
+				handler(name, filename, partType, reader);
+				continue;
+			}
+			std::string value;
+			for (std::size_t num; (num = reader.read(buf, sizeof(buf))) > 0; ) {
+				value.append(buf, num);
+			}
+			if (filename.empty()) {
+				args_.push_back(std::make_pair(name, value));
+			} else {
+				files_.insert(std::make_pair(name, File(filename, partType, DataBuffer::create(value.data(), value.size()))));
+			}
+		}
+	} else if (0 != strncasecmp("text/plain", type.c_str(), sizeof("text/plain") - 1) &&
+		0 != strncasecmp("application/octet-stream", type.c_str(), sizeof("application/octet-stream") - 1) &&
+		!disablePostParams())
+	{
+		// Only the argument being received is held
+		std::string pending;
+		for (std::size_t num; (num = body_stream_->read(buf, sizeof(buf))) > 0; ) {
+			pending.append(buf, num);
+			const std::size_t end = pending.rfind('&');
+			if (std::string::npos != end) {
+				StringUtils::parse(Range(pending.data(), pending.data() + end), args_);
+				pending.erase(0, end + 1);
+			}
+		}
+		StringUtils::parse(pending, args_);
+	} else {
+		return false;
+	}
+
+	// The epilogue of the multipart message
+	while (body_stream_->read(buf, sizeof(buf)) > 0) {
+	}
+	return true;
+}
+
 bool
 Request::isBot() const {
 	if (nullptr!=session_manager_) {
@@ -436,9 +546,15 @@ Request::setStatus(unsigned short status) {
 
 void
 Request::sendError(unsigned short status) {
+	sendError(status, HeaderMap());
+}
+
+void
+Request::sendError(unsigned short status, const HeaderMap &headers) {
 	if (!headers_sent_) {
 		out_cookies_.clear();
-		out_headers_.clear();
+		out_headers_ = headers;
+		encoder_.reset();
 	} else {
 		throw std::runtime_error("Error in Request::setError headers already sent: status - '" + std::to_string(status) + "'");
 	}
@@ -534,21 +650,229 @@ Request::getResponseStream() {
 
 void
 Request::write(std::streambuf *buf) {
-	sendHeaders();
-	if (stream_ && HEAD != getRequestMethod()) {
+	if (!stream_ || HEAD == getRequestMethod()) {
+		sendHeaders();
+		return;
+	}
+
+	const char *data = nullptr;
+	std::size_t size = 0;
+	if (StringBufferView::get(buf, data, size)) {
+		writeOutput(data, size);
+		buf->pubseekoff(size, std::ios::cur, std::ios::in);
+	} else if (encoder_) {
+		const std::string output((std::istreambuf_iterator<char>(buf)), std::istreambuf_iterator<char>());
+		writeOutput(output.data(), output.size());
+	} else {
+		sendHeaders();
 		stream_->write(buf);
 	}
 }
 
 std::streamsize
 Request::write(const char *buf, std::streamsize size) {
-	sendHeaders();
 	if (stream_ && HEAD != getRequestMethod()) {
-		stream_->write(buf, size);
+		writeOutput(buf, size);
+	} else {
+		sendHeaders();
 	}
 	return size;
 }
 
+void
+Request::sendFile(const std::string &path) {
+	FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (-1 == fd.value()) {
+		throw std::runtime_error("Cannot open file " + path + ": " + StringUtils::error(errno));
+	}
+	struct stat fs;
+	if (-1 == fstat(fd.value(), &fs)) {
+		throw std::runtime_error("Cannot stat file " + path + ": " + StringUtils::error(errno));
+	}
+	sendFile(fd.value(), 0, fs.st_size);
+}
+
+void
+Request::sendFile(const std::string &path, std::uint64_t offset, std::uint64_t length) {
+	FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (-1 == fd.value()) {
+		throw std::runtime_error("Cannot open file " + path + ": " + StringUtils::error(errno));
+	}
+	sendFile(fd.value(), offset, length);
+}
+
+void
+Request::sendFile(int fd, std::uint64_t offset, std::uint64_t length) {
+	if (!headers_sent_ && !encoder_ && 0 == response_stream_.rdbuf()->in_avail() &&
+		out_headers_.end() == out_headers_.find("Content-Length")) {
+		setHeader("Content-Length", std::to_string(length));
+	}
+
+	// Output already produced by the handler goes first
+	if (response_stream_.rdbuf()->in_avail() > 0) {
+		write(response_stream_.rdbuf());
+	}
+	if (!stream_ || HEAD == getRequestMethod()) {
+		sendHeaders();
+		return;
+	}
+	writeOutput(nullptr, 0);
+
+	// The encoded file is not passed by the kernel
+	if (0 == length || (!encoder_ && stream_->sendFile(fd, offset, length))) {
+		return;
+	}
+
+	MMapFile file(fd, FILE_WINDOW_SIZE);
+	if (offset + length > file.size()) {
+		throw std::runtime_error("Requested range is out of file");
+	}
+	const std::uint64_t end = offset + length;
+	while (offset < end) {
+		std::pair<char*, std::uint64_t> segment = file.atSegment(offset);
+		const std::uint64_t len = std::min(segment.second, end - offset);
+		if (encoder_) {
+			writeOutput(segment.first, len);
+		} else {
+			struct iovec iov;
+			iov.iov_base = segment.first;
+			iov.iov_len = len;
+			stream_->writev(&iov, 1);
+		}
+		offset += len;
+	}
+}
+
+void
+Request::flush() {
+	sendHeaders();
+	if (stream_) {
+		if (encoder_ && HEAD != getRequestMethod()) {
+			std::string encoded;
+			encoder_->encode(nullptr, 0, ResponseEncoder::Mode::FLUSH, encoded);
+			if (!encoded.empty()) {
+				stream_->write(encoded.data(), encoded.size());
+			}
+		}
+		stream_->flush();
+	}
+}
+
+std::size_t
+Request::flushThreshold() const {
+	return flush_threshold_;
+}
+
+void
+Request::setFlushThreshold(std::size_t threshold) {
+	flush_threshold_ = threshold;
+}
+
+void
+Request::writeOutput(const char *buf, std::size_t size) {
+	// Headers (if not sent yet) and the body go out with a single gathered write
+	std::string headers;
+	struct iovec iov[2];
+	int count = 0;
+	if (!headers_sent_) {
+		buildHeaders(headers);
+		iov[count].iov_base = const_cast<char*>(headers.data());
+		iov[count].iov_len = headers.size();
+		++count;
+		headers_sent_ = true;
+	}
+	std::string encoded;
+	if (encoder_) {
+		encoder_->encode(buf, size, ResponseEncoder::Mode::WRITE, encoded);
+		buf = encoded.data();
+		size = encoded.size();
+	}
+	if (size > 0) {
+		iov[count].iov_base = const_cast<char*>(buf);
+		iov[count].iov_len = size;
+		++count;
+	}
+	if (count > 0) {
+		stream_->writev(iov, count);
+	}
+}
+
+void
+Request::setEncoder(std::unique_ptr<ResponseEncoder> encoder) {
+	if (headers_sent_) {
+		throw std::runtime_error("Error in Request::setEncoder: headers already sent");
+	}
+	encoder_ = std::move(encoder);
+}
+
+ResponseEncoder*
+Request::encoder() const {
+	return encoder_.get();
+}
+
+const std::string&
+Request::getPriorityClass() const {
+	return priority_class_;
+}
+
+void
+Request::setPriorityClass(const std::string &name) {
+	priority_class_ = name;
+}
+
+void
+Request::afterResponse(std::function<void()> callback) {
+	after_response_.push_back(std::move(callback));
+}
+
+void
+Request::runAfterResponse() {
+	std::vector<std::function<void()>> callbacks;
+	callbacks.swap(after_response_);
+	for (auto &callback : callbacks) {
+		try {
+			callback();
+		} catch (const std::exception &e) {
+			if (logger_) {
+				logger_->error("afterResponse callback failed: %s", e.what());
+			}
+		} catch (...) {
+			if (logger_) {
+				logger_->error("afterResponse callback failed with unknown exception");
+			}
+		}
+	}
+}
+
+void
+Request::startEncoder() {
+	if (!encoder_) {
+		return;
+	}
+	if (encoder_->start(this)) {
+		// The length of the encoded body is not known in advance
+		out_headers_.erase("Content-Length");
+	} else {
+		encoder_.reset();
+	}
+}
+
+void
+Request::finishOutput() {
+	if (!encoder_) {
+		return;
+	}
+	sendHeadersInternal();
+	if (encoder_ && stream_ && HEAD != getRequestMethod()) {
+		std::string encoded;
+		encoder_->encode(nullptr, 0, ResponseEncoder::Mode::FINISH, encoded);
+		if (!encoded.empty()) {
+			stream_->write(encoded.data(), encoded.size());
+		}
+	}
+	encoder_.reset();
+}
+
 std::string
 Request::outputHeader(const std::string &name) const {
 	return Parser::get(out_headers_, name);
@@ -584,10 +908,20 @@ Request::setContentEncoding(const std::string &encoding) {
 
 void
 Request::reset() {
-	
+	runAfterResponse();
+
 	status_ = 200;
 	stream_ = nullptr;
 	headers_sent_ = false;
+	processed_ = false;
+	delay_ = std::chrono::milliseconds(0);
+	flush_threshold_ = 0;
+	priority_class_.clear();
+
+	body_ = DataBuffer();
+	body_stream_.reset();
+	response_stream_.str(std::string());
+	response_stream_.clear();
 
 	args_.clear();
 	vars_.clear();
@@ -600,6 +934,8 @@ Request::reset() {
 
 	session_.reset();
 	subject_.reset();
+	// The encoder of the cancelled or failed response is not finished
+	encoder_.reset();
 }
 
 void
@@ -607,8 +943,73 @@ Request::sendHeaders() {
 	sendHeadersInternal();
 }
 
+// The body spooled to the request cache is read into the registered buffers
+// and written to the cache file by io_uring while the next chunk is read
+static const std::size_t SPOOL_BUFFER_SIZE = 256 * 1024;
+static const unsigned int SPOOL_BUFFERS = 4;
+
+static thread_local std::unique_ptr<UringFileWriter> spool_writer_holder;
+static thread_local bool spool_writer_failed = false;
+
+static UringFileWriter*
+spoolWriter(Logger *logger) {
+	if (!spool_writer_holder && !spool_writer_failed) {
+		spool_writer_failed = true;
+		if (!UringFileWriter::supported()) {
+			return nullptr;
+		}
+		try {
+			spool_writer_holder.reset(new UringFileWriter(SPOOL_BUFFER_SIZE, SPOOL_BUFFERS));
+			spool_writer_failed = false;
+		} catch (const std::exception &e) {
+			logger->info("Request bodies are spooled without io_uring: %s", e.what());
+		}
+	}
+	return spool_writer_holder.get();
+}
+
+static std::uint64_t
+spoolBody(RequestIOStream *stream, UringFileWriter *writer, int fd, std::uint64_t offset, std::uint64_t size) {
+	std::uint64_t rsz = 0;
+	try {
+		while (rsz < size) {
+			std::pair<char*, std::size_t> buf = writer->acquire();
+			const std::size_t len = std::min<std::uint64_t>(buf.second, size - rsz);
+			std::size_t num = 0;
+			while (num < len) {
+				const int n = stream->read(buf.first + num, len - num);
+				if (n <= 0) {
+					break;
+				}
+				num += n;
+			}
+			if (num > 0) {
+				writer->submit(fd, offset + rsz, num);
+				rsz += num;
+			}
+			if (num < len) {
+				break;
+			}
+		}
+	} catch (...) {
+		// Writes in flight refer to the buffers and to the file
+		try {
+			writer->complete();
+		} catch (...) {
+		}
+		throw;
+	}
+	writer->complete();
+	return rsz;
+}
+
 void
 Request::attach(RequestIOStream *stream, char *env[]) {
+	attach(stream, env, nullptr);
+}
+
+void
+Request::attach(RequestIOStream *stream, char *env[], const std::function<BodyMode(const Request*)> &bodyMode) {
 	if (nullptr == stream) {
 		throw std::runtime_error("Stream is nullptr");
 	}
@@ -618,14 +1019,39 @@ Request::attach(RequestIOStream *stream, char *env[]) {
 
 	stream_ = stream;
 	Parser::parse(this, env, logger_);
+
+	// The body mode is selected as soon as the environment and the query
+	// arguments are known, before anything is read from the web server
 	const std::string& query = getQueryString();
-	if ("POST" != getRequestMethod() && "PUT" != getRequestMethod()) {
+	if (!query.empty()) {
 		StringUtils::parse(query, args_);
+	}
+	attachBody(bodyMode ? bodyMode(this) : BodyMode::READ);
+}
+
+void
+Request::attach(RequestIOStream *stream, BodyMode mode) {
+	if (nullptr == stream) {
+		throw std::runtime_error("Stream is nullptr");
+	}
+	stream_ = stream;
+	attachBody(mode);
+}
+
+void
+Request::attachBody(BodyMode mode) {
+	if (BodyMode::SKIP == mode || ("POST" != getRequestMethod() && "PUT" != getRequestMethod())) {
 		return;
 	}
 
-	DataBuffer post_buffer;
 	std::uint64_t size = getContentLength();
+	if (BodyMode::STREAM == mode) {
+		// The handler reads the body itself
+		body_stream_.reset(new RequestBodyStream(stream_, size));
+		return;
+	}
+
+	DataBuffer post_buffer;
 	if (cache_ && size >= cache_->minPostSize()) {
 		post_buffer = cache_->create();
 		std::uint64_t shift = serializeEnv(post_buffer, size + sizeof(std::uint64_t));
@@ -636,17 +1062,19 @@ Request::attach(RequestIOStream *stream, char *env[]) {
 		body_.resize(size);
 	}
 	std::uint64_t rsz = 0;
-	for (const auto& it : body_) {
-		rsz += stream_->read(it.first, it.second);
+	FileBuffer *file = dynamic_cast<FileBuffer*>(body_.impl());
+	UringFileWriter *writer = nullptr != file ? spoolWriter(logger_.get()) : nullptr;
+	if (nullptr != writer) {
+		rsz = spoolBody(stream_, writer, file->fd(), body_.beginIndex(), size);
+	} else {
+		for (const auto& it : body_) {
+			rsz += stream_->read(it.first, it.second);
+		}
 	}
 	if (rsz != size) {
 		throw std::runtime_error("failed to read request entity");
 	}
 
-	if (!query.empty()) {
-		StringUtils::parse(query, args_);
-	}
-
 	const std::string &type = getContentType();
 	if (0 == strncasecmp("multipart/form-data", type.c_str(), sizeof("multipart/form-data") - 1)) {
 		std::string boundary = Parser::getBoundary(Range::fromString(type));
@@ -685,28 +1113,38 @@ Request::disablePostParams() const {
 void
 Request::sendHeadersInternal() {
 	if (!headers_sent_) {
-		std::stringstream stream;
-		stream << status_ << " " << Parser::statusToString(status_);
-		out_headers_["Status"] = stream.str();
+		std::string headers;
+		buildHeaders(headers);
 		if (stream_) {
-			for (auto& i : out_headers_) {
-				stream_->write(i.first.c_str(), i.first.size());
-				stream_->write(": ", 2);
-				stream_->write(i.second.c_str(), i.second.size());
-				stream_->write("\r\n", 2);
-			}
-			for (auto& i : out_cookies_) {
-				stream_->write("Set-Cookie: ", sizeof("Set-Cookie: ") - 1);
-				std::string cookie = i.toString();
-				stream_->write(cookie.c_str(), cookie.size());
-				stream_->write("\r\n", 2);
-			}
-			stream_->write("\r\n", 2);
+			stream_->write(headers.data(), headers.size());
 		}
 		headers_sent_ = true;
 	}
 }
 
+void
+Request::buildHeaders(std::string &out) {
+	startEncoder();
+
+	std::stringstream stream;
+	stream << status_ << " " << Parser::statusToString(status_);
+	out_headers_["Status"] = stream.str();
+
+	std::size_t size = sizeof("\r\n") - 1;
+	for (auto& i : out_headers_) {
+		size += i.first.size() + i.second.size() + sizeof(": \r\n") - 1;
+	}
+	out.reserve(size + 64 * out_cookies_.size());
+
+	for (auto& i : out_headers_) {
+		out.append(i.first).append(": ", 2).append(i.second).append("\r\n", 2);
+	}
+	for (auto& i : out_cookies_) {
+		out.append("Set-Cookie: ", sizeof("Set-Cookie: ") - 1).append(i.toString()).append("\r\n", 2);
+	}
+	out.append("\r\n", 2);
+}
+
 bool Request::isProcessed() const {
 	return processed_;
 }
@@ -25,6 +25,7 @@
 
 #include <sys/time.h>
 
+#include "fastcgi3/async_handler.h"
 #include "fastcgi3/except.h"
 #include "fastcgi3/handler.h"
 #include "fastcgi3/logger.h"
@@ -35,7 +36,10 @@
 #include "../main/fcgi_request.h"
 
 
+#include "details/async_reactor.h"
+#include "details/async_request.h"
 #include "details/handler_context.h"
+#include "details/queue_delay_controller.h"
 
 #ifdef HAVE_DMALLOC_H
 #include <dmalloc.h>
@@ -44,15 +48,82 @@
 namespace fastcgi
 {
 
+/**
+ * Nests the filters of the compiled chain matching the request into each other:
+ * each filter gets the continuation invoking the next one, the last one - the handlers.
+ * The continuation holds only the chain position, so it is not allocated.
+ */
+template<typename Handlers>
+class ChainInvocation {
+public:
+	ChainInvocation(const RequestTask &task, Handlers &handlers, CancellationToken *token) :
+		task_(task), handlers_(handlers), token_(token)
+	{}
+
+	void invoke(std::size_t position, Request *r, HandlerContext *c) {
+		// The transport is probed at the handler boundary, the filters see the tripped token only
+		if (CancellationToken::Reason::NONE != token_->reason()) {
+			return;
+		}
+		const HandlerSet::FilterChain *chain = task_.chain;
+		if (nullptr != chain) {
+			for (; position < chain->size(); ++position) {
+				const HandlerSet::ChainLink &link = (*chain)[position];
+				if (0 != (task_.filters & (HandlerSet::FilterMask(1) << link.entry))) {
+					link.filter->doFilter(r, c, [this, position](Request *r, HandlerContext *c) {
+						invoke(position + 1, r, c);
+					});
+					return;
+				}
+			}
+		}
+		// No more filters - execute handlers
+		handlers_(r, c);
+	}
+
+private:
+	const RequestTask &task_;
+	Handlers &handlers_;
+	CancellationToken *token_;
+};
+
+RequestTask
+RequestTask::clone() const {
+	RequestTask task;
+	task.request = request;
+	task.chain = chain;
+	task.filters = filters;
+	task.handler = handler;
+	task.futureHandler = futureHandler;
+	task.dispatch = dispatch;
+	task.request_stream = request_stream;
+	task.cancellation = cancellation;
+	task.start = start;
+	task.queued = queued;
+	task.resume = resume;
+	task.runInline = runInline;
+	task.priority = priority;
+	task.node = node;
+	task.bulkhead = bulkhead;
+	task.permit = permit;
+	return task;
+}
+
 RequestsThreadPool::RequestsThreadPool(const unsigned threadsNumber, const unsigned queueLength, std::shared_ptr<fastcgi::Logger> logger)
-: ThreadPool<RequestTask>(threadsNumber, queueLength), logger_(logger), delay_(0) {
+: ThreadPool<RequestTask>(threadsNumber, queueLength), logger_(logger), delay_(0), flush_threshold_(0), retry_after_(1), deadline_(0), inline_dispatch_(false) {
 }
 
 RequestsThreadPool::RequestsThreadPool(const unsigned threadsNumber, const unsigned queueLength, std::chrono::milliseconds delay, std::shared_ptr<fastcgi::Logger> logger)
-: ThreadPool<RequestTask>(threadsNumber, queueLength), logger_(logger), delay_(delay) {
+: ThreadPool<RequestTask>(threadsNumber, queueLength), logger_(logger), delay_(delay), flush_threshold_(0), retry_after_(1), deadline_(0), inline_dispatch_(false) {
 }
 
 RequestsThreadPool::~RequestsThreadPool() {
+	// The suspended requests are not resumed after the reactor is stopped
+	if (reactor_) {
+		reactor_->stop();
+	}
+	stop();
+	join();
 }
 
 std::chrono::milliseconds
@@ -60,148 +131,131 @@ RequestsThreadPool::delay() const {
 	return delay_;
 }
 
+std::size_t
+RequestsThreadPool::flushThreshold() const {
+	return flush_threshold_;
+}
+
+void
+RequestsThreadPool::setFlushThreshold(std::size_t threshold) {
+	flush_threshold_ = threshold;
+}
+
+unsigned int
+RequestsThreadPool::retryAfter() const {
+	return retry_after_;
+}
+
+void
+RequestsThreadPool::setRetryAfter(unsigned int seconds) {
+	retry_after_ = seconds;
+}
+
+std::chrono::milliseconds
+RequestsThreadPool::deadline() const {
+	return deadline_;
+}
+
+void
+RequestsThreadPool::setDeadline(std::chrono::milliseconds deadline) {
+	deadline_ = deadline;
+}
+
+bool
+RequestsThreadPool::inlineDispatch() const {
+	return inline_dispatch_;
+}
+
+void
+RequestsThreadPool::setInlineDispatch(bool enabled) {
+	inline_dispatch_ = enabled;
+}
+
+void
+RequestsThreadPool::setTargetDelay(std::chrono::milliseconds target, std::chrono::milliseconds interval) {
+	if (target > std::chrono::milliseconds(0)) {
+		delay_controller_.reset(new QueueDelayController(target, interval));
+	} else {
+		delay_controller_.reset();
+	}
+}
+
+bool
+RequestsThreadPool::overloaded() const {
+	return delay_controller_ && delay_controller_->overloaded();
+}
+
+std::uint64_t
+RequestsThreadPool::shedTasksCounter() const {
+	return delay_controller_ ? delay_controller_->shedCounter() : 0;
+}
+
+void
+RequestsThreadPool::cancelled(RequestTask &task, CancellationToken::Reason reason) {
+	logger_->info("request %s is cancelled: %s", task.request->getUrl().c_str(),
+		CancellationToken::Reason::DEADLINE == reason ? "deadline exceeded" : "aborted by the web server");
+
+	// Nobody is going to read the output of the aborted request
+	task.request->getResponseStream()->str(std::string());
+	if (CancellationToken::Reason::DEADLINE == reason && !task.request->headersSent()) {
+		task.request->sendError(504);
+	}
+}
+
+void
+RequestsThreadPool::threadFailed(const std::exception &e) {
+	logger_->error("cannot start thread pool thread: %s", e.what());
+}
+
 void
 RequestsThreadPool::handleTask(RequestTask task) {
+	if (task.resume) {
+		// Continuation of the request suspended by an asynchronous handler
+		task.resume();
+		return;
+	}
+	const std::chrono::steady_clock::duration wait = std::chrono::steady_clock::now() - task.queued;
+	grow(wait);
+	if ((delay_controller_ && delay_controller_->shed(wait)) ||
+		(task.bulkhead && !task.permit && !task.bulkhead->acquire(task, this))) {
+		HeaderMap headers;
+		if (retry_after_ > 0) {
+			headers.insert({"Retry-After", std::to_string(retry_after_)});
+		}
+		task.request->sendError(503, headers);
+		return;
+	}
+	if (!task.request) {
+		// Waits for a permit of the handler's bulkhead
+		return;
+	}
     try {
    		if (std::chrono::steady_clock::now() - task.start < delay_) {
 			logger_->error("thread pool task is timed out");
 			task.request->sendError(503);
 			return;
     	}
-        try {
-            std::shared_ptr<LoggerRequestId> logger_req_id = std::dynamic_pointer_cast<LoggerRequestId>(logger_);
-            if (logger_req_id) {
-                logger_req_id->setRequestId(task.request->getRequestId());
-            }
-
-            // Function to execute all handlers
-            auto handlers = [&task](Request *r, HandlerContext *c) {
-            	if (task.handlers.empty() && task.futureHandlers) {
-            		task.handlers = task.futureHandlers(task);
-            	}
-				for (auto& i : task.handlers) {
-					if (r->isProcessed()) {
-						break;
-					}
-					i->handleRequest(r, c);
-				}
-            };
-
-            // Recursive execution of the nested filters
-            std::vector<std::function<void(Request *req, HandlerContext *context)>> filters;
-            unsigned int next = 0;
-            for (auto& i : task.filters) {
-				++next;
-            	filters.push_back([&filters, &i, next, &handlers](Request *r, HandlerContext *c) {
-					if (next<filters.size()) {
-						// Execute current filter, passing the reference to the functor for the next filter
-						i->doFilter(r, c, filters[next]);
-					} else {
-						// No more filters - execute handlers
-						// Execute current filter, passing the reference to the functor for the handlers
-						i->doFilter(r, c, handlers);
-					}
-            	});
-            }
-
-            // All filters and handlers are using the same underlaying instance
-            // of the std::stringstream hosted by class RequestImpl.
-            // That is, if any filter or handler instantiates the class RequestStream
-            // using the same request pointer, it will contain the pointer to
-            // the same std::stringstream.
-            fastcgi::RequestStream stream(task.request.get());
-            stream.reset();
-
-            std::unique_ptr<HandlerContext> context = std::make_unique<HandlerContextImpl>();
-            if (filters.size()>0) {
-            	filters[0](task.request.get(), context.get());
-            } else {
-            	// No filter is defined - execute handlers
-            	handlers(task.request.get(), context.get());
-            }
-
-            stream.flush();
-            stream.reset();
-
-            task.request->sendHeaders();
-        }
-        catch (const DispatchException &e) {
-        	// TODO: usage of exception to dispatch the request is not really clean solution
-        	if (task.dispatch) {
-				if (!task.request->headersSent()) {
-					if (DispatchException::DispatchType::FORWARD==e.type()) {
-						// Clear request output stream
-						task.request->getResponseStream()->str(std::string());
-					}
 
-					DataBuffer buffer = e.buffer();
-					if (!buffer.isNil()) {
-						task.request->restore(buffer);
-					}
-
-					const std::string &url = e.url();
-					if (!url.empty()) {
-						auto it = task.request->vars_.find("SCRIPT_NAME");
-						if (it == task.request->vars_.end()) {
-							task.request->vars_.insert({"SCRIPT_NAME", url});
-						} else {
-							it->second = url;
-						}
-					}
-
-					task.dispatch(task);
-				} else {
-					throw std::runtime_error("Error while dispatching request "+task.request->getURI()+": headers already sent");
-				}
-        	} else {
-				throw std::runtime_error("Error while dispatching request "+task.request->getURI()+": dispatcher is not assigned");
-        	}
-        }
-        catch (const HttpException &e) {
-            bool headersAlreadySent = false;
-            try {
-                task.request->setStatus(500);
-            }
-            catch (...) { // this means that headers already send and we cannot change status/headers and so on
-                headersAlreadySent = true;
-            }
-            if (headersAlreadySent) {
-                throw;
-            }
-            else {
-                task.request->sendError(e.status());
-            }
-        }
-        catch (const std::exception &e) {
-            bool headersAlreadySent = false;
-            try {
-                task.request->setStatus(500);
-            }
-            catch (...) { // this means that headers already send and we cannot change status/headers and so on
-                headersAlreadySent = true;
-            }
-            if (headersAlreadySent) {
-                throw;
-            }
-            else {
-                task.request->sendError(500);
-            }
-        }
-        catch (...) {
-            bool headersAlreadySent = false;
-            try {
-                task.request->setStatus(500);
-            }
-            catch (...) { // this means that headers already send and we cannot change status/headers and so on
-                headersAlreadySent = true;
-            }
-            if (headersAlreadySent) {
-                throw;
-            }
-            else {
-                task.request->sendError(500);
-            }
-        }
+		std::shared_ptr<AsyncRequest> async;
+		bool suspended = false;
+		try {
+			suspended = process(task, [this, &task, &async]() {
+				return execute(task, async);
+			});
+		} catch (...) {
+			if (async) {
+				async->finish();
+				async->release();
+			}
+			throw;
+		}
+		if (async) {
+			if (!suspended) {
+				async->finish();
+			}
+			// The continuations scheduled before the filters have returned are posted now
+			async->release();
+		}
     }
     catch (const std::exception &e) {
         logger_->error("%s", e.what());
@@ -213,4 +267,245 @@ RequestsThreadPool::handleTask(RequestTask task) {
     }
 }
 
+void
+RequestsThreadPool::resume(std::shared_ptr<AsyncRequest> async, const std::function<void()> &step) {
+	try {
+		if (!async->finished()) {
+			setRequestId(async->task());
+			std::shared_ptr<AsyncRequest> current = async;
+			const bool suspended = process(async->task(), [this, &async, &current, &step]() {
+				step();
+				return async->completed() &&
+					invokeHandlers(current, async->task(), async->next(), async->context());
+			});
+			if (!suspended) {
+				async->finish();
+			}
+		}
+	}
+	catch (const std::exception &e) {
+		logger_->error("%s", e.what());
+		async->finish();
+		async->release();
+		throw;
+	}
+	catch (...) {
+		logger_->error("RequestsThreadPool::resume: got unknown exception");
+		async->finish();
+		async->release();
+		throw;
+	}
+	async->release();
+}
+
+AsyncReactor*
+RequestsThreadPool::reactor() {
+	std::lock_guard<std::mutex> lock(reactor_mutex_);
+	if (!reactor_) {
+		reactor_.reset(new AsyncReactor(logger_));
+	}
+	return reactor_.get();
+}
+
+void
+RequestsThreadPool::setRequestId(RequestTask &task) {
+	std::shared_ptr<LoggerRequestId> logger_req_id = std::dynamic_pointer_cast<LoggerRequestId>(logger_);
+	if (logger_req_id) {
+		logger_req_id->setRequestId(task.request->getRequestId());
+	}
+}
+
+bool
+RequestsThreadPool::execute(RequestTask &task, std::shared_ptr<AsyncRequest> &async) {
+	setRequestId(task);
+
+	if (!task.cancellation) {
+		task.cancellation = std::make_shared<CancellationToken>();
+	}
+	CancellationToken *token = task.cancellation.get();
+	if (token->cancelled()) {
+		// Cancelled while waiting in the queue
+		return true;
+	}
+
+	std::shared_ptr<HandlerContext> context = std::make_shared<HandlerContextImpl>(task.cancellation);
+
+	// Function to execute all handlers
+	bool completed = true;
+	auto handlers = [this, &task, &async, &completed, &context](Request *r, HandlerContext*) {
+		if (nullptr == task.handler && task.futureHandler) {
+			task.handler = task.futureHandler(task);
+		}
+		const unsigned priority = priorityClass(r->getPriorityClass());
+		if (priority != task.priority) {
+			// Reclassified by a filter: the handlers wait in the queue of the new class
+			task.priority = priority;
+			async = std::make_shared<AsyncRequest>(this, task, context);
+			async->suspend(0);
+			async->complete();
+			completed = false;
+			return;
+		}
+		completed = invokeHandlers(async, task, 0, context);
+	};
+
+	ChainInvocation<decltype(handlers)> chain(task, handlers, token);
+
+	// All filters and handlers are using the same underlaying instance
+	// of the std::stringstream hosted by class RequestImpl.
+	// That is, if any filter or handler instantiates the class RequestStream
+	// using the same request pointer, it will contain the pointer to
+	// the same std::stringstream.
+	fastcgi::RequestStream stream(task.request.get());
+	stream.reset();
+
+	chain.invoke(0, task.request.get(), context.get());
+	return completed;
+}
+
+bool
+RequestsThreadPool::invokeHandlers(std::shared_ptr<AsyncRequest> &async, RequestTask &task, std::size_t first,
+		const std::shared_ptr<HandlerContext> &context) {
+	if (nullptr == task.handler) {
+		return true;
+	}
+	const std::vector<std::shared_ptr<Handler>> &handlers = task.handler->handlers;
+	Request *r = task.request.get();
+	CancellationToken *token = task.cancellation.get();
+	for (std::size_t i = first; i < handlers.size(); ++i) {
+		if (r->isProcessed() || token->cancelled()) {
+			break;
+		}
+		AsyncHandler *handler = dynamic_cast<AsyncHandler*>(handlers[i].get());
+		if (nullptr == handler) {
+			handlers[i]->handleRequest(r, context.get());
+			continue;
+		}
+
+		// The pool thread is released until the handler completes
+		if (!async) {
+			async = std::make_shared<AsyncRequest>(this, task, context);
+		}
+		async->suspend(i + 1);
+		handler->handleRequestAsync(r, context.get(), async);
+		return false;
+	}
+	return true;
+}
+
+void
+RequestsThreadPool::finish(RequestTask &task) {
+	CancellationToken *token = task.cancellation.get();
+	token->release();
+
+	if (token->cancelled()) {
+		cancelled(task, token->reason());
+		return;
+	}
+
+	fastcgi::RequestStream stream(task.request.get());
+	stream.flush();
+	stream.reset();
+
+	task.request->finishOutput();
+	task.request->sendHeaders();
+}
+
+bool
+RequestsThreadPool::process(RequestTask &task, const std::function<bool()> &step) {
+	try {
+		bool completed = false;
+		try {
+			completed = step();
+		} catch (...) {
+			task.cancellation->release();
+			throw;
+		}
+		if (!completed) {
+			return true;
+		}
+		finish(task);
+	}
+	catch (const DispatchException &e) {
+		// TODO: usage of exception to dispatch the request is not really clean solution
+		if (task.dispatch) {
+			if (!task.request->headersSent()) {
+				if (DispatchException::DispatchType::FORWARD==e.type()) {
+					// Clear request output stream
+					task.request->getResponseStream()->str(std::string());
+				}
+
+				DataBuffer buffer = e.buffer();
+				if (!buffer.isNil()) {
+					task.request->restore(buffer);
+				}
+
+				const std::string &url = e.url();
+				if (!url.empty()) {
+					auto it = task.request->vars_.find("SCRIPT_NAME");
+					if (it == task.request->vars_.end()) {
+						task.request->vars_.insert({"SCRIPT_NAME", url});
+					} else {
+						it->second = url;
+					}
+				}
+
+				// The dispatcher moves the task it belongs to
+				const std::function<void(RequestTask&&)> dispatch = task.dispatch;
+				dispatch(std::move(task));
+			} else {
+				throw std::runtime_error("Error while dispatching request "+task.request->getURI()+": headers already sent");
+			}
+		} else {
+			throw std::runtime_error("Error while dispatching request "+task.request->getURI()+": dispatcher is not assigned");
+		}
+	}
+	catch (const HttpException &e) {
+		bool headersAlreadySent = false;
+		try {
+			task.request->setStatus(500);
+		}
+		catch (...) { // this means that headers already send and we cannot change status/headers and so on
+			headersAlreadySent = true;
+		}
+		if (headersAlreadySent) {
+			throw;
+		}
+		else {
+			task.request->sendError(e.status());
+		}
+	}
+	catch (const std::exception &e) {
+		bool headersAlreadySent = false;
+		try {
+			task.request->setStatus(500);
+		}
+		catch (...) { // this means that headers already send and we cannot change status/headers and so on
+			headersAlreadySent = true;
+		}
+		if (headersAlreadySent) {
+			throw;
+		}
+		else {
+			task.request->sendError(500);
+		}
+	}
+	catch (...) {
+		bool headersAlreadySent = false;
+		try {
+			task.request->setStatus(500);
+		}
+		catch (...) { // this means that headers already send and we cannot change status/headers and so on
+			headersAlreadySent = true;
+		}
+		if (headersAlreadySent) {
+			throw;
+		}
+		else {
+			task.request->sendError(500);
+		}
+	}
+	return false;
+}
+
 } // namespace fastcgi
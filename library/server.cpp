@@ -42,82 +42,155 @@ Server::~Server() {
 }
 
 void
-Server::handleRequest(RequestTask task) {
+Server::handleRequest(RequestTask &&task) {
 
-	task.futureHandlers = [this](RequestTask task) {
+	task.futureHandler = [this](const RequestTask &task) {
 		const HandlerSet::HandlerDescription* handler = getHandler(task);
 		if (nullptr == handler || handler->handlers.empty()) {
 			throw NotFound();
 		}
-		return handler->handlers;
+		return handler;
 	};
 
-	task.dispatch = [this](RequestTask task) {
-		std::vector<std::shared_ptr<Filter>> filters;
-		getFilters(task, filters);
+	task.dispatch = [this](RequestTask &&task) {
+		const HandlerSet::FilterMask filters = getFilters(task);
 
 		const HandlerSet::HandlerDescription* handler = getHandler(task);
-		if ((nullptr == handler || handler->handlers.empty()) && !filters.empty()) {
+		if ((nullptr == handler || handler->handlers.empty()) && 0 != filters) {
 			// Handler not found - let the filter(s) to be executed
 			// and then try to find the handler again
 			// Example: "authenticator"-filter may redirect the
 			// request to undefined path (like "j_security_check") and
 			// after the login redirect back to the original path
-			handleRequestInternal(filters, task);
+			handleRequestInternal(filters, std::move(task));
 		} else {
-			handleRequestInternal(filters, handler, task);
+			handleRequestInternal(filters, handler, std::move(task));
 		}
 	};
 
-	task.dispatch(task);
+	// The dispatcher moves the task it belongs to
+	const std::function<void(RequestTask&&)> dispatch = task.dispatch;
+	dispatch(std::move(task));
 }
 
 void
-Server::handleRequestInternal(std::vector<std::shared_ptr<Filter>> &filters, const HandlerSet::HandlerDescription* handler, RequestTask task) {
+Server::handleRequestInternal(HandlerSet::FilterMask filters, const HandlerSet::HandlerDescription* handler, RequestTask &&task) {
 	if (nullptr == handler || handler->handlers.empty()) {
 		task.request->sendError(404);
 		return;
 	}
 
+	RequestsThreadPool* pool = nullptr;
 	try {
+		task.chain = &globals()->handlers()->filterChain();
 		task.filters = filters;
-		task.handlers = handler->handlers;
+		task.handler = handler;
+		if (task.bulkhead != handler->bulkhead.get()) {
+			// The task re-dispatched to another handler waits for a permit of its bulkhead
+			task.permit.reset();
+			task.bulkhead = handler->bulkhead.get();
+		}
 
-		RequestsThreadPool* pool = globals()->pools().find(handler->poolName)->second.get();
-		task.start = std::chrono::steady_clock::now() + pool->delay();
-		pool->addTask(task);
+		pool = getPool(handler, task.node);
+		task.request->setFlushThreshold(handler->flushThreshold > 0 ? handler->flushThreshold : pool->flushThreshold());
+		setDeadline(task, handler->deadline > std::chrono::milliseconds(0) ? handler->deadline : pool->deadline());
+		if (!handler->priorityClass.empty()) {
+			task.request->setPriorityClass(handler->priorityClass);
+		}
+		task.priority = pool->priorityClass(task.request->getPriorityClass());
+		task.queued = std::chrono::steady_clock::now();
+		task.start = task.queued + pool->delay();
+		// The task re-dispatched later is not run on the thread which has taken it then
+		const bool runInline = task.runInline;
+		task.runInline = false;
+		if (!runInline || !pool->inlineDispatch() || !pool->tryRunInline(task)) {
+			const unsigned priority = task.priority;
+			pool->addTask(std::move(task), priority);
+		}
 	}
 	catch (const std::exception &e) {
-		task.request->sendError(503);
+		// The pool which has taken the task answers the request itself
+		if (task.request) {
+			sendUnavailable(task.request.get(), pool);
+		}
 		logger()->error("cannot add request to pool: %s", e.what());
 	}
 }
 
 void
-Server::handleRequestInternal(std::vector<std::shared_ptr<Filter>> &filters, RequestTask task) {
+Server::handleRequestInternal(HandlerSet::FilterMask filters, RequestTask &&task) {
+	RequestsThreadPool* pool = nullptr;
 	try {
+		task.chain = &globals()->handlers()->filterChain();
 		task.filters = filters;
-		task.handlers.clear();
-
-		RequestsThreadPool* pool = globals()->pools().find(globals()->handlers()->getDefaultPool())->second.get();
-		task.start = std::chrono::steady_clock::now() + pool->delay();
-		pool->addTask(task);
+		task.handler = nullptr;
+		task.bulkhead = nullptr;
+		task.permit.reset();
+
+		pool = getPool(nullptr, task.node);
+		task.request->setFlushThreshold(pool->flushThreshold());
+		setDeadline(task, pool->deadline());
+		task.priority = pool->priorityClass(task.request->getPriorityClass());
+		task.queued = std::chrono::steady_clock::now();
+		task.start = task.queued + pool->delay();
+		// The task re-dispatched later is not run on the thread which has taken it then
+		const bool runInline = task.runInline;
+		task.runInline = false;
+		if (!runInline || !pool->inlineDispatch() || !pool->tryRunInline(task)) {
+			const unsigned priority = task.priority;
+			pool->addTask(std::move(task), priority);
+		}
 	}
 	catch (const std::exception &e) {
-		task.request->sendError(503);
+		// The pool which has taken the task answers the request itself
+		if (task.request) {
+			sendUnavailable(task.request.get(), pool);
+		}
 		logger()->error("cannot add request to pool: %s", e.what());
 	}
 }
 
 
-void
-Server::getFilters(RequestTask task, std::vector<std::shared_ptr<Filter>> &v) const {
-	globals()->handlers()->findURIFilters(task.request.get(), v);
+HandlerSet::FilterMask
+Server::getFilters(const RequestTask &task) const {
+	return globals()->handlers()->matchURIFilters(task.request.get());
 }
 
 const HandlerSet::HandlerDescription*
-Server::getHandler(RequestTask task) const {
+Server::getHandler(const RequestTask &task) const {
 	return globals()->handlers()->findURIHandler(task.request.get());
 }
 
+RequestsThreadPool*
+Server::getPool(const HandlerSet::HandlerDescription* handler, int node) const {
+	const std::string &name = nullptr != handler ? handler->poolName : globals()->handlers()->getDefaultPool();
+	RequestsThreadPool *pool = globals()->pool(name, node);
+	if (nullptr == pool) {
+		throw std::runtime_error("cannot find pool " + name);
+	}
+	return pool;
+}
+
+void
+Server::setDeadline(RequestTask &task, std::chrono::milliseconds deadline) const {
+	if (!task.cancellation || deadline <= std::chrono::milliseconds(0)) {
+		return;
+	}
+	// The endpoint may have set the earlier deadline of the whole request
+	const std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now() + deadline;
+	const std::chrono::steady_clock::time_point current = task.cancellation->deadline();
+	if (std::chrono::steady_clock::time_point() == current || time < current) {
+		task.cancellation->setDeadline(time);
+	}
+}
+
+void
+Server::sendUnavailable(Request *request, const RequestsThreadPool *pool) const {
+	HeaderMap headers;
+	if (nullptr != pool && pool->retryAfter() > 0) {
+		headers.insert({"Retry-After", std::to_string(pool->retryAfter())});
+	}
+	request->sendError(503, headers);
+}
+
 } // namespace fastcgi
@@ -18,8 +18,12 @@
 // along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
 
 // #include "settings.h"
+#include <algorithm>
+#include <stdexcept>
+
 #include "fastcgi3/stream.h"
 #include "fastcgi3/request.h"
+#include "fastcgi3/request_io_stream.h"
 
 #ifdef HAVE_DMALLOC_H
 #include <dmalloc.h>
@@ -28,8 +32,48 @@
 namespace fastcgi
 {
 
+/**
+ * Rewinds the get and put areas of a string buffer whose output is consumed,
+ * the following output reuses the memory of the string
+ */
+class StringBufferRewind : public std::streambuf {
+public:
+	static bool rewind(std::streambuf *buf) {
+#ifdef __GLIBCXX__
+		if (nullptr == dynamic_cast<std::stringbuf*>(buf)) {
+			return false;
+		}
+		char* (std::streambuf::*eback)() const = &StringBufferRewind::eback;
+		char* (std::streambuf::*gptr)() const = &StringBufferRewind::gptr;
+		char* (std::streambuf::*egptr)() const = &StringBufferRewind::egptr;
+		char* (std::streambuf::*pbase)() const = &StringBufferRewind::pbase;
+		char* (std::streambuf::*pptr)() const = &StringBufferRewind::pptr;
+		char* (std::streambuf::*epptr)() const = &StringBufferRewind::epptr;
+		void (std::streambuf::*setg)(char*, char*, char*) = &StringBufferRewind::setg;
+		void (std::streambuf::*setp)(char*, char*) = &StringBufferRewind::setp;
+
+		char *base = (buf->*pbase)();
+		if (nullptr == base || base != (buf->*eback)() ||
+			(buf->*gptr)() != std::max((buf->*egptr)(), (buf->*pptr)())) {
+			// Nothing to reuse or the output is not consumed yet
+			return false;
+		}
+		// The string keeps its size up to the end of the put area,
+		// so the get area grows again from the put pointer only
+		char *end = (buf->*epptr)();
+		(buf->*setg)(base, base, base);
+		(buf->*setp)(base, end);
+		return true;
+#else
+		// Other implementations keep a high-water mark out of reach of the derived classes
+		(void)buf;
+		return false;
+#endif
+	}
+};
+
 RequestStream::RequestStream(Request *req)
-: request_(req), stream_(req->getResponseStream()) {
+: request_(req), stream_(req->getResponseStream()), threshold_(req->flushThreshold()) {
 }
 
 RequestStream::~RequestStream() {
@@ -38,6 +82,9 @@ RequestStream::~RequestStream() {
 RequestStream&
 RequestStream::operator << (std::ostream& (*f)(std::ostream &os)) {
 	stream_->operator << (f);
+	if (threshold_ > 0) {
+		checkThreshold();
+	}
 	return *this;
 }
 
@@ -54,4 +101,60 @@ RequestStream::flush() {
     }
 }
 
+void
+RequestStream::flushNow() {
+	request_->write(stream_->rdbuf());
+	request_->flush();
+	if (!StringBufferRewind::rewind(stream_->rdbuf())) {
+		reset();
+	}
+}
+
+void
+RequestStream::checkThreshold() {
+	const std::streamoff size = stream_->tellp();
+	if (size > 0 && static_cast<std::size_t>(size) >= threshold_) {
+		flushNow();
+	}
+}
+
+RequestBodyStream::RequestBodyStream(RequestIOStream *stream, std::uint64_t size)
+: stream_(stream), size_(size), read_(0) {
+}
+
+RequestBodyStream::~RequestBodyStream() {
+}
+
+std::size_t
+RequestBodyStream::read(char *buf, std::size_t size) {
+	const std::uint64_t len = std::min<std::uint64_t>(size, remaining());
+	if (0 == len) {
+		return 0;
+	}
+	int num = stream_->read(buf, static_cast<int>(std::min<std::uint64_t>(len, INT32_MAX)));
+	if (num <= 0) {
+		throw std::runtime_error("failed to read request entity");
+	}
+	read_ += num;
+	return num;
+}
+
+std::uint64_t
+RequestBodyStream::size() const {
+	return size_;
+}
+
+std::uint64_t
+RequestBodyStream::remaining() const {
+	return size_ - read_;
+}
+
+bool
+RequestBodyStream::eof() const {
+	return read_ == size_;
+}
+
+FormPartStream::~FormPartStream() {
+}
+
 } // namespace fastcgi
@@ -0,0 +1,323 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "details/uring_file_writer.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+// liburing is not required: the rings are set up with the raw system calls
+
+static int
+uringSetup(unsigned int entries, struct io_uring_params *params) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int
+uringEnter(int ring, unsigned int submit, unsigned int wait, unsigned int flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, ring, submit, wait, flags, nullptr, 0));
+}
+
+static int
+uringRegister(int ring, unsigned int opcode, const void *arg, unsigned int count) {
+	return static_cast<int>(syscall(__NR_io_uring_register, ring, opcode, arg, count));
+}
+
+UringFileWriter::UringFileWriter(std::size_t bufferSize, unsigned int buffers) :
+	ring_(-1), buffer_size_(bufferSize), writes_(buffers), in_flight_(0), error_(0),
+	sq_ptr_(MAP_FAILED), cq_ptr_(MAP_FAILED), sqes_ptr_(MAP_FAILED), sq_size_(0), cq_size_(0), sqes_size_(0)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_ = uringSetup(buffers, &params);
+	if (-1 == ring_) {
+		throw std::system_error(errno, std::system_category(), "Cannot set up io_uring");
+	}
+
+	try {
+		sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+		}
+		sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+		if (MAP_FAILED == sq_ptr_) {
+			throw std::system_error(errno, std::system_category(), "Cannot map io_uring submission queue");
+		}
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			cq_ptr_ = sq_ptr_;
+		} else {
+			cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+			if (MAP_FAILED == cq_ptr_) {
+				throw std::system_error(errno, std::system_category(), "Cannot map io_uring completion queue");
+			}
+		}
+		sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes_ptr_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+		if (MAP_FAILED == sqes_ptr_) {
+			throw std::system_error(errno, std::system_category(), "Cannot map io_uring submission entries");
+		}
+
+		char *sq = static_cast<char*>(sq_ptr_);
+		sq_head_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+		sq_mask_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+		char *cq = static_cast<char*>(cq_ptr_);
+		cq_head_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+		cq_mask_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+		cqes_ = cq + params.cq_off.cqes;
+		sqes_ = sqes_ptr_;
+
+		// Registered buffers are pinned once instead of being mapped per write
+		std::vector<struct iovec> iov(buffers);
+		for (unsigned int i = 0; i < buffers; ++i) {
+			void *buf = nullptr;
+			if (0 != posix_memalign(&buf, static_cast<std::size_t>(getpagesize()), buffer_size_)) {
+				throw std::system_error(ENOMEM, std::system_category(), "Cannot allocate io_uring buffer");
+			}
+			buffers_.push_back(static_cast<char*>(buf));
+			iov[i].iov_base = buf;
+			iov[i].iov_len = buffer_size_;
+			free_.push_back(i);
+		}
+		if (0 != uringRegister(ring_, IORING_REGISTER_BUFFERS, &iov[0], buffers)) {
+			throw std::system_error(errno, std::system_category(), "Cannot register io_uring buffers");
+		}
+	} catch (...) {
+		release();
+		throw;
+	}
+}
+
+UringFileWriter::~UringFileWriter() {
+	try {
+		while (in_flight_ > 0) {
+			reap(true);
+		}
+	} catch (...) {
+	}
+	release();
+}
+
+void
+UringFileWriter::release() {
+	if (MAP_FAILED != sqes_ptr_) {
+		munmap(sqes_ptr_, sqes_size_);
+	}
+	if (MAP_FAILED != cq_ptr_ && cq_ptr_ != sq_ptr_) {
+		munmap(cq_ptr_, cq_size_);
+	}
+	if (MAP_FAILED != sq_ptr_) {
+		munmap(sq_ptr_, sq_size_);
+	}
+	sq_ptr_ = cq_ptr_ = sqes_ptr_ = MAP_FAILED;
+	if (-1 != ring_) {
+		close(ring_);
+		ring_ = -1;
+	}
+	for (char *buf : buffers_) {
+		free(buf);
+	}
+	buffers_.clear();
+}
+
+bool
+UringFileWriter::supported() {
+	// 0 - not checked yet, 1 - supported, 2 - not supported
+	static std::atomic<int> state(0);
+	int value = state.load();
+	if (0 == value) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		const int ring = uringSetup(1, &params);
+		value = -1 == ring ? 2 : 1;
+		if (-1 != ring) {
+			close(ring);
+		}
+		state.store(value);
+	}
+	return 1 == value;
+}
+
+std::pair<char*, std::size_t>
+UringFileWriter::acquire() {
+	while (free_.empty()) {
+		reap(true);
+	}
+	return std::make_pair(buffers_[free_.back()], buffer_size_);
+}
+
+void
+UringFileWriter::submit(int fd, std::uint64_t offset, std::size_t len) {
+	if (free_.empty()) {
+		throw std::logic_error("io_uring buffer is not acquired");
+	}
+	const unsigned int index = free_.back();
+	free_.pop_back();
+	writes_[index] = Write{fd, offset, len};
+
+	const unsigned int tail = *sq_tail_;
+	const unsigned int slot = tail & *sq_mask_;
+	struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe*>(sqes_) + slot;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = reinterpret_cast<std::uint64_t>(buffers_[index]);
+	sqe->len = len;
+	sqe->buf_index = index;
+	sqe->user_data = index;
+	sq_array_[slot] = slot;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+	++in_flight_;
+	enter(1, 0);
+
+	// Completed writes are collected without waiting
+	reap(false);
+}
+
+void
+UringFileWriter::complete() {
+	while (in_flight_ > 0) {
+		reap(true);
+	}
+	if (0 != error_) {
+		const int error = error_;
+		error_ = 0;
+		throw std::system_error(error, std::system_category(), "Cannot write request cache file");
+	}
+}
+
+void
+UringFileWriter::enter(unsigned int submit, unsigned int wait) {
+	while (-1 == uringEnter(ring_, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0)) {
+		if (EINTR != errno && EAGAIN != errno && EBUSY != errno) {
+			throw std::system_error(errno, std::system_category(), "io_uring_enter failed");
+		}
+		if (EINTR != errno) {
+			// Completion queue is full: free it up first
+			wait = 1;
+		}
+	}
+}
+
+void
+UringFileWriter::reap(bool wait) {
+	unsigned int head = *cq_head_;
+	if (wait && head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+		enter(0, 1);
+	}
+	const unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = static_cast<const struct io_uring_cqe*>(cqes_) + (head & *cq_mask_);
+		const unsigned int index = static_cast<unsigned int>(cqe->user_data);
+		const Write &write = writes_[index];
+		if (cqe->res < 0) {
+			error_ = -cqe->res;
+		} else if (static_cast<std::size_t>(cqe->res) < write.len) {
+			// Short write to a regular file is rare: the rest is written synchronously
+			std::size_t done = cqe->res;
+			while (done < write.len) {
+				ssize_t num = pwrite(write.fd, buffers_[index] + done, write.len - done, write.offset + done);
+				if (num < 0 && EINTR == errno) {
+					continue;
+				}
+				if (num <= 0) {
+					error_ = num < 0 ? errno : EIO;
+					break;
+				}
+				done += num;
+			}
+		}
+		free_.push_back(index);
+		--in_flight_;
+	}
+	__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+UringFileWriter::UringFileWriter(std::size_t bufferSize, unsigned int buffers) :
+	ring_(-1), buffer_size_(bufferSize), writes_(buffers), in_flight_(0), error_(0),
+	sq_ptr_(nullptr), cq_ptr_(nullptr), sqes_ptr_(nullptr), sq_size_(0), cq_size_(0), sqes_size_(0)
+{
+	throw std::system_error(ENOSYS, std::system_category(), "io_uring is not supported by the build");
+}
+
+UringFileWriter::~UringFileWriter() {
+}
+
+bool
+UringFileWriter::supported() {
+	return false;
+}
+
+std::pair<char*, std::size_t>
+UringFileWriter::acquire() {
+	throw std::system_error(ENOSYS, std::system_category(), "io_uring is not supported by the build");
+}
+
+void
+UringFileWriter::submit(int, std::uint64_t, std::size_t) {
+	throw std::system_error(ENOSYS, std::system_category(), "io_uring is not supported by the build");
+}
+
+void
+UringFileWriter::complete() {
+}
+
+void
+UringFileWriter::enter(unsigned int, unsigned int) {
+}
+
+void
+UringFileWriter::reap(bool) {
+}
+
+void
+UringFileWriter::release() {
+}
+
+#endif // HAVE_LINUX_IO_URING_H
+
+} // namespace fastcgi
@@ -18,9 +18,16 @@
 // along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
 
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
 #include <cassert>
 #include <cerrno>
 #include <sstream>
+#include <algorithm>
 #include <iostream>
 #include <system_error>
 
@@ -61,9 +68,15 @@ Endpoint::ScopedBusyCounter::decrement() {
 	}
 }
 
-Endpoint::Endpoint(const std::string &path, const std::string &port, unsigned int keepConnection, unsigned short threads) :
-	socket_(-1), busy_count_(0), threads_(threads), socket_path_(path), socket_port_(port), keepConnection_(keepConnection)
+Endpoint::Endpoint(const std::string &path, const std::string &port, unsigned int keepConnection, unsigned short threads, Engine engine) :
+	listeners_(1), busy_count_(0), threads_(threads), min_threads_(threads), live_threads_(threads),
+	idle_timeout_(0), saturated_(std::chrono::steady_clock::now()), socket_path_(path), socket_port_(port), keepConnection_(keepConnection), engine_(engine),
+	multiplex_(false), max_conns_(1), max_reqs_(1)
 {
+	for (int i = 0; i < 3; ++i) {
+		timeouts_[i] = std::chrono::milliseconds(0);
+		timeout_counters_[i].store(0);
+	}
 	if (socket_path_.empty() && socket_port_.empty()) {
 		throw std::runtime_error("Both /socket and /port param for endpoint is empty");
 	}
@@ -74,8 +87,60 @@ Endpoint::~Endpoint() {
 
 int
 Endpoint::socket() const {
+	return socket(0);
+}
+
+int
+Endpoint::socket(unsigned int index) const {
 	std::lock_guard<std::mutex> sl(mutex_);
-	return socket_;
+	return sockets_.empty() ? -1 : sockets_[index % sockets_.size()];
+}
+
+unsigned short
+Endpoint::listeners() const {
+	return listeners_;
+}
+
+void
+Endpoint::setListeners(unsigned short listeners) {
+	if (listeners > 1 && !socket_path_.empty()) {
+		throw std::runtime_error("Endpoint " + toString() + ": multiple listeners require TCP port");
+	}
+	if (listeners > threads_) {
+		// Every listening socket needs the thread accepting its connections
+		throw std::runtime_error("Endpoint " + toString() + ": number of listeners must not exceed " + std::to_string(threads_) + " threads");
+	}
+	listeners_ = std::max<unsigned short>(1, listeners);
+}
+
+const CpuAffinity&
+Endpoint::affinity() const {
+	return affinity_;
+}
+
+void
+Endpoint::setAffinity(const CpuAffinity &affinity) {
+	affinity_ = affinity;
+}
+
+std::chrono::milliseconds
+Endpoint::timeout(Timeout type) const {
+	return timeouts_[static_cast<int>(type)];
+}
+
+void
+Endpoint::setTimeout(Timeout type, std::chrono::milliseconds timeout) {
+	timeouts_[static_cast<int>(type)] = std::max(std::chrono::milliseconds(0), timeout);
+}
+
+void
+Endpoint::countTimeout(Timeout type) {
+	++timeout_counters_[static_cast<int>(type)];
+}
+
+std::uint64_t
+Endpoint::timeoutCounter(Timeout type) const {
+	return timeout_counters_[static_cast<int>(type)].load();
 }
 
 unsigned short
@@ -83,6 +148,120 @@ Endpoint::threads() const {
 	return threads_;
 }
 
+Endpoint::Engine
+Endpoint::engine() const {
+	return engine_;
+}
+
+void
+Endpoint::setElastic(unsigned short minThreads, std::chrono::milliseconds idleTimeout) {
+	if (Engine::NATIVE == engine_) {
+		throw std::runtime_error("Endpoint " + toString() + ": elastic threads are supported by libfcgi engine only");
+	}
+	if (minThreads < listeners_ || minThreads > threads_) {
+		throw std::runtime_error("Endpoint " + toString() + ": minimum number of threads must be between " +
+			std::to_string(listeners_) + " and " + std::to_string(threads_));
+	}
+	std::lock_guard<std::mutex> sl(mutex_);
+	min_threads_ = minThreads;
+	live_threads_ = minThreads;
+	idle_timeout_ = std::max(std::chrono::milliseconds(0), idleTimeout);
+}
+
+unsigned short
+Endpoint::minThreads() const {
+	return min_threads_;
+}
+
+unsigned short
+Endpoint::liveThreads() const {
+	std::lock_guard<std::mutex> sl(mutex_);
+	return live_threads_;
+}
+
+unsigned int
+Endpoint::claimListener() {
+	std::lock_guard<std::mutex> sl(mutex_);
+	return claimListenerInternal();
+}
+
+unsigned int
+Endpoint::claimListenerInternal() {
+	if (acceptors_.empty()) {
+		return 0;
+	}
+	const unsigned int listener = std::min_element(acceptors_.begin(), acceptors_.end()) - acceptors_.begin();
+	++acceptors_[listener];
+	return listener;
+}
+
+bool
+Endpoint::addThread(unsigned int &listener) {
+	std::lock_guard<std::mutex> sl(mutex_);
+	if (live_threads_ >= threads_ || busy_count_ < live_threads_) {
+		return false;
+	}
+	++live_threads_;
+	listener = claimListenerInternal();
+	return true;
+}
+
+bool
+Endpoint::removeThread(unsigned int listener) {
+	std::lock_guard<std::mutex> sl(mutex_);
+	// The calling thread is not busy, one more has to be left accepting the requests
+	if (live_threads_ <= min_threads_ || busy_count_ + 2 > live_threads_ ||
+		std::chrono::steady_clock::now() - saturated_ < idle_timeout_) {
+		return false;
+	}
+	if (listener < acceptors_.size()) {
+		if (acceptors_[listener] < 2) {
+			// The last thread accepting on the socket
+			return false;
+		}
+		--acceptors_[listener];
+	}
+	--live_threads_;
+	return true;
+}
+
+void
+Endpoint::stopAccepting() {
+	std::lock_guard<std::mutex> sl(mutex_);
+	for (int socket : sockets_) {
+		::shutdown(socket, SHUT_RDWR);
+	}
+}
+
+bool
+Endpoint::multiplex() const {
+	return multiplex_;
+}
+
+void
+Endpoint::setMultiplex(bool multiplex) {
+	if (multiplex && Engine::NATIVE != engine_) {
+		throw std::runtime_error("Endpoint " + toString() + ": multiplexing is supported by native engine only");
+	}
+	multiplex_ = multiplex;
+}
+
+unsigned int
+Endpoint::maxConnections() const {
+	return max_conns_;
+}
+
+unsigned int
+Endpoint::maxRequests() const {
+	return max_reqs_;
+}
+
+void
+Endpoint::setLimits(unsigned int maxConnections, unsigned int maxRequests) {
+	max_conns_ = std::max(1u, maxConnections);
+	max_reqs_ = std::max(1u, maxRequests);
+}
+
 std::string
 Endpoint::toString() const {
 	return socket_path_.empty() ? (std::string(":") + socket_port_) : socket_path_;
@@ -113,11 +292,29 @@ Endpoint::openSocket(const int backlog) {
 		}
 	}
 
-	socket_ = FCGX_OpenSocket(toString().c_str(), backlog);
-	if (-1 == socket_) {
-		std::stringstream stream;
-		stream << "can not open fastcgi socket: " << toString() << "[" << StringUtils::error(errno) << "]";
-		throw std::runtime_error(stream.str());
+	if (listeners_ > 1) {
+		for (unsigned short i = 0; i < listeners_; ++i) {
+			sockets_.push_back(openReusePortSocket(backlog));
+		}
+	} else {
+		int socket = FCGX_OpenSocket(toString().c_str(), backlog);
+		if (-1 == socket) {
+			std::stringstream stream;
+			stream << "can not open fastcgi socket: " << toString() << "[" << StringUtils::error(errno) << "]";
+			throw std::runtime_error(stream.str());
+		}
+		sockets_.push_back(socket);
+	}
+	acceptors_.assign(sockets_.size(), 0);
+
+	if (Engine::NATIVE == engine_) {
+		// Reactors accept the connections from epoll loop
+		for (int socket : sockets_) {
+			int flags = fcntl(socket, F_GETFL, 0);
+			if (-1 == flags || -1 == fcntl(socket, F_SETFL, flags | O_NONBLOCK)) {
+				throw std::system_error(errno, std::system_category());
+			}
+		}
 	}
 
 	if (!socket_path_.empty()) {
@@ -127,6 +324,51 @@ Endpoint::openSocket(const int backlog) {
 	}
 }
 
+int
+Endpoint::openReusePortSocket(const int backlog) const {
+	// Wildcard address of the port like the single socket opened by libfcgi
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	struct addrinfo *addrs = nullptr;
+	const int status = getaddrinfo(nullptr, socket_port_.c_str(), &hints, &addrs);
+	if (0 != status) {
+		throw std::runtime_error("Invalid endpoint port: " + socket_port_ + "[" + gai_strerror(status) + "]");
+	}
+
+	int error = 0;
+	for (struct addrinfo *addr = addrs; nullptr != addr; addr = addr->ai_next) {
+		int socket = ::socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+		if (-1 == socket) {
+			error = errno;
+			continue;
+		}
+
+		int one = 1;
+		if (-1 == setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+			-1 == setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+			error = errno;
+			close(socket);
+			freeaddrinfo(addrs);
+			throw std::runtime_error("can not set SO_REUSEPORT on fastcgi socket: " + toString() + "[" + StringUtils::error(error) + "]");
+		}
+
+		if (-1 == bind(socket, addr->ai_addr, addr->ai_addrlen) ||
+			-1 == listen(socket, backlog)) {
+			error = errno;
+			close(socket);
+			continue;
+		}
+		freeaddrinfo(addrs);
+		return socket;
+	}
+	freeaddrinfo(addrs);
+	throw std::runtime_error("can not open fastcgi socket: " + toString() + "[" + StringUtils::error(error) + "]");
+}
+
 unsigned int Endpoint::getKeepConnection() {
 	return keepConnection_;
 }
@@ -135,6 +377,9 @@ void
 Endpoint::incrementBusyCounter() {
 	std::lock_guard<std::mutex> sl(mutex_);
 	busy_count_ += 1;
+	if (busy_count_ >= live_threads_) {
+		saturated_ = std::chrono::steady_clock::now();
+	}
 }
 
 void
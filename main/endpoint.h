@@ -20,9 +20,15 @@
 #ifndef _FASTCGI_FASTCGI_ENDPOINT_H_
 #define _FASTCGI_FASTCGI_ENDPOINT_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include <vector>
 #include <mutex>
 
+#include "details/cpu_affinity.h"
+
 namespace fastcgi
 {
 
@@ -39,13 +45,92 @@ public:
 		Endpoint &endpoint_;
 	};
 
+	/**
+	 * LIBFCGI: each endpoint thread accepts and handles the requests with libfcgi
+	 * NATIVE: endpoint threads are epoll reactors running the built-in FastCGI protocol engine
+	 */
+	enum class Engine {LIBFCGI, NATIVE};
+
+	/**
+	 * READ: the web server does not send the data of the request being received
+	 * WRITE: the web server does not accept the response data
+	 * REQUEST: the request is not completed in time
+	 */
+	enum class Timeout {READ, WRITE, REQUEST};
+
 public:
-	Endpoint(const std::string &path, const std::string &port, unsigned int keepConnection, unsigned short threads);
+	Endpoint(const std::string &path, const std::string &port, unsigned int keepConnection, unsigned short threads, Engine engine = Engine::LIBFCGI);
 	virtual ~Endpoint();
 
 	int socket() const;
+	int socket(unsigned int index) const;
 
 	unsigned short threads() const;
+	Engine engine() const;
+
+	/**
+	 * Elastic endpoint (libfcgi engine) starts minThreads threads and adds one
+	 * whenever all of them are busy, up to the threads number. A thread exits after
+	 * its request if another one is idle and all threads have not been busy
+	 * at once for idleTimeout. Every listening socket keeps at least one thread
+	 * accepting on it, so there are not fewer minThreads than listeners.
+	 */
+	void setElastic(unsigned short minThreads, std::chrono::milliseconds idleTimeout);
+	unsigned short minThreads() const;
+	unsigned short liveThreads() const;
+
+	/**
+	 * Assigns the thread being started to the listening socket with the fewest threads
+	 */
+	unsigned int claimListener();
+
+	/**
+	 * Returns true if the caller has to start a thread accepting on the listener
+	 */
+	bool addThread(unsigned int &listener);
+
+	/**
+	 * Returns true if the calling idle thread accepting on the listener has to exit
+	 */
+	bool removeThread(unsigned int listener);
+
+	/**
+	 * Wakes the threads blocked accepting on the sockets, so they see the server stopped
+	 */
+	void stopAccepting();
+
+	bool multiplex() const;
+	void setMultiplex(bool multiplex);
+
+	// Limits advertised to the web server via FCGI_GET_VALUES_RESULT
+	unsigned int maxConnections() const;
+	unsigned int maxRequests() const;
+	void setLimits(unsigned int maxConnections, unsigned int maxRequests);
+
+	/**
+	 * Number of listening sockets bound to the same TCP port with SO_REUSEPORT.
+	 * Endpoint threads are distributed among the sockets, so the kernel
+	 * balances the incoming connections instead of threads contending
+	 * on the single accept queue. There are not more listeners than threads.
+	 */
+	unsigned short listeners() const;
+	void setListeners(unsigned short listeners);
+
+	/**
+	 * CPUs the endpoint threads are pinned to. The requests accepted
+	 * by the endpoint bound to a NUMA node go to the pool replica of the node.
+	 */
+	const CpuAffinity& affinity() const;
+	void setAffinity(const CpuAffinity &affinity);
+
+	/**
+	 * I/O deadlines keeping slow clients from holding the endpoint threads,
+	 * 0 - no limit. The request running out of time is aborted and counted
+	 */
+	std::chrono::milliseconds timeout(Timeout type) const;
+	void setTimeout(Timeout type, std::chrono::milliseconds timeout);
+	void countTimeout(Timeout type);
+	std::uint64_t timeoutCounter(Timeout type) const;
 
 	std::string toString() const;
 	unsigned short getBusyCounter() const;
@@ -58,12 +143,28 @@ public:
 	void decrementBusyCounter();
 
 private:
-	int socket_;
+	int openReusePortSocket(const int backlog) const;
+	unsigned int claimListenerInternal();
+
+private:
+	std::vector<int> sockets_;
+	std::vector<unsigned short> acceptors_;
+	unsigned short listeners_;
+	CpuAffinity affinity_;
 	int busy_count_;
 	unsigned short threads_;
+	unsigned short min_threads_;
+	unsigned short live_threads_;
+	std::chrono::milliseconds idle_timeout_;
+	std::chrono::steady_clock::time_point saturated_;
 	mutable std::mutex mutex_;
 	std::string socket_path_, socket_port_;
 	unsigned int keepConnection_;
+	Engine engine_;
+	bool multiplex_;
+	unsigned int max_conns_, max_reqs_;
+	std::chrono::milliseconds timeouts_[3];
+	std::atomic<std::uint64_t> timeout_counters_[3];
 };
 
 } // namespace fastcgi
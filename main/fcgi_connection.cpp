@@ -0,0 +1,786 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include "fastcgi3/util.h"
+
+#include "endpoint.h"
+#include "fcgi_connection.h"
+#include "fcgi_file_sender.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const std::size_t READ_BUFFER_SIZE = 2 * (FcgiProtocol::HEADER_LEN + FcgiProtocol::MAX_CONTENT_LEN + 256);
+static const std::size_t MAX_CHUNK_LEN = FcgiProtocol::MAX_CONTENT_LEN & ~static_cast<std::size_t>(7);
+static const int MAX_READS_PER_EVENT = 16;
+
+// Limit of the vectors passed to a single sendmsg call (UIO_MAXIOV)
+static const std::size_t MAX_IOV_COUNT = 1024;
+
+// Empty FCGI_STDOUT and FCGI_END_REQUEST completing the request
+static const std::size_t END_RECORDS_LEN = 2 * FcgiProtocol::HEADER_LEN + 8;
+
+// Streamed body buffered in memory: reading of the connection is paused
+// above the high mark and resumed once the handler drains it below the low mark
+static const std::size_t STREAM_HIGH_WATERMARK = 1024 * 1024;
+static const std::size_t STREAM_LOW_WATERMARK = STREAM_HIGH_WATERMARK / 4;
+
+// Records queued by the reactor above which the connection is not read
+static const std::size_t OUTPUT_HIGH_WATERMARK = 64 * 1024;
+
+// Write timeout of the endpoint configured without one
+static const std::chrono::milliseconds DEFAULT_WRITE_TIMEOUT(60000);
+
+static const std::string MAX_CONNS_KEY {"FCGI_MAX_CONNS"};
+static const std::string MAX_REQS_KEY {"FCGI_MAX_REQS"};
+static const std::string MPXS_CONNS_KEY {"FCGI_MPXS_CONNS"};
+
+FcgiConnection::RequestState::RequestState(std::uint16_t requestId, bool keepConn) :
+	id(requestId), begin(std::chrono::steady_clock::now()), keepConnection(keepConn), paramsDone(false), stdinDone(false), dispatched(false),
+	streaming(false), throttled(false), buffered(0), chunkPos(0), rejected(false),
+	cancellation(std::make_shared<CancellationToken>())
+{
+	aborted.store(false);
+}
+
+FcgiConnection::FcgiConnection(int fd, std::shared_ptr<Endpoint> endpoint,
+		StreamSelectorType selector, ResumeHandlerType resume) :
+	fd_(fd), endpoint_(std::move(endpoint)), selector_(std::move(selector)), resume_(std::move(resume)),
+	paused_(false), in_(READ_BUFFER_SIZE), in_begin_(0), in_end_(0),
+	last_read_(std::chrono::steady_clock::now()), close_pending_(false), out_writer_(false), close_queued_(false),
+	last_write_(last_read_)
+{
+	closed_.store(false);
+}
+
+FcgiConnection::~FcgiConnection() {
+	::close(fd_);
+}
+
+int
+FcgiConnection::fd() const {
+	return fd_;
+}
+
+std::chrono::milliseconds
+FcgiConnection::writeTimeout(const Endpoint &endpoint) {
+	const std::chrono::milliseconds timeout = endpoint.timeout(Endpoint::Timeout::WRITE);
+	return timeout > std::chrono::milliseconds(0) ? timeout : DEFAULT_WRITE_TIMEOUT;
+}
+
+bool
+FcgiConnection::closed() const {
+	return closed_.load();
+}
+
+void
+FcgiConnection::close() {
+	if (closed_.exchange(true)) {
+		return;
+	}
+	::shutdown(fd_, SHUT_RDWR);
+	{
+		// Threads waiting for the queued output give up
+		std::lock_guard<std::mutex> lock(out_mutex_);
+		out_cond_.notify_all();
+	}
+
+	std::vector<std::shared_ptr<RequestState>> states;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &it : requests_) {
+			states.push_back(it.second);
+		}
+	}
+
+	// Cancel the running requests and wake up the handlers waiting for the streamed body,
+	// the cancellation callbacks are invoked without the connection lock
+	for (auto &state : states) {
+		state->cancellation->cancel(CancellationToken::Reason::DISCONNECTED);
+		if (state->streaming) {
+			std::lock_guard<std::mutex> bodyLock(state->bodyMutex);
+			state->bodyCond.notify_all();
+		}
+	}
+}
+
+bool
+FcgiConnection::paused() const {
+	return paused_;
+}
+
+void
+FcgiConnection::resume() {
+	paused_ = false;
+	last_read_ = std::chrono::steady_clock::now();
+}
+
+bool
+FcgiConnection::expired(std::chrono::steady_clock::time_point now) {
+	const std::chrono::milliseconds readTimeout = endpoint_->timeout(Endpoint::Timeout::READ);
+	const std::chrono::milliseconds requestTimeout = endpoint_->timeout(Endpoint::Timeout::REQUEST);
+
+	bool receiving = false, overdue = false;
+	std::vector<std::shared_ptr<RequestState>> cancelled;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &it : requests_) {
+			const RequestState &state = *it.second;
+			if (!state.dispatched || (state.streaming && !state.stdinDone)) {
+				receiving = true;
+			}
+			if (requestTimeout > std::chrono::milliseconds(0) && now - state.begin >= requestTimeout) {
+				if (state.dispatched) {
+					cancelled.push_back(it.second);
+				} else {
+					overdue = true;
+				}
+			}
+		}
+	}
+
+	// The handlers are notified without the connection lock
+	for (auto &state : cancelled) {
+		if (CancellationToken::Reason::NONE == state->cancellation->reason()) {
+			endpoint_->countTimeout(Endpoint::Timeout::REQUEST);
+			state->cancellation->cancel(CancellationToken::Reason::DEADLINE);
+		}
+	}
+
+	if (overdue) {
+		endpoint_->countTimeout(Endpoint::Timeout::REQUEST);
+		return true;
+	}
+
+	// The web server does not read the records queued by the reactor
+	if (writing() && now - lastWrite() >= writeTimeout(*endpoint_)) {
+		endpoint_->countTimeout(Endpoint::Timeout::WRITE);
+		return true;
+	}
+
+	// Paused connection is waiting for the handler, not for the web server
+	if (receiving && !paused_ && readTimeout > std::chrono::milliseconds(0) && now - last_read_ >= readTimeout) {
+		endpoint_->countTimeout(Endpoint::Timeout::READ);
+		return true;
+	}
+	return false;
+}
+
+bool
+FcgiConnection::onReadable(std::vector<std::shared_ptr<RequestState>> &ready) {
+	// Records received before the connection has been paused go first
+	if (!processInput(ready)) {
+		return false;
+	}
+	for (int i = 0; i < MAX_READS_PER_EVENT && !paused_ && !backlogged(); ++i) {
+		if (in_begin_ == in_end_) {
+			in_begin_ = in_end_ = 0;
+		} else if (in_end_ == in_.size()) {
+			std::memmove(&in_[0], &in_[in_begin_], in_end_ - in_begin_);
+			in_end_ -= in_begin_;
+			in_begin_ = 0;
+		}
+
+		ssize_t num = ::read(fd_, &in_[in_end_], in_.size() - in_end_);
+		if (num == 0) {
+			return false;
+		} else if (num < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return EAGAIN == errno || EWOULDBLOCK == errno;
+		}
+		in_end_ += num;
+		last_read_ = std::chrono::steady_clock::now();
+
+		if (!processInput(ready)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+FcgiConnection::processInput(std::vector<std::shared_ptr<RequestState>> &ready) {
+	while (!paused_ && in_end_ - in_begin_ >= FcgiProtocol::HEADER_LEN) {
+		const char *data = &in_[in_begin_];
+		FcgiProtocol::Header header = FcgiProtocol::decodeHeader(data);
+		if (FcgiProtocol::VERSION_1 != header.version) {
+			return false;
+		}
+		std::size_t len = FcgiProtocol::HEADER_LEN + header.contentLength + header.paddingLength;
+		if (in_end_ - in_begin_ < len) {
+			break;
+		}
+		processRecord(header, data + FcgiProtocol::HEADER_LEN, ready);
+		in_begin_ += len;
+	}
+	return true;
+}
+
+void
+FcgiConnection::processRecord(const FcgiProtocol::Header &header, const char *content, std::vector<std::shared_ptr<RequestState>> &ready) {
+	if (FcgiProtocol::NULL_REQUEST_ID == header.requestId) {
+		if (FcgiProtocol::RecordType::GET_VALUES == header.type) {
+			getValues(content, header.contentLength);
+		} else {
+			char body[8] = {static_cast<char>(header.type), 0, 0, 0, 0, 0, 0, 0};
+			queueRecord(FcgiProtocol::RecordType::UNKNOWN_TYPE, FcgiProtocol::NULL_REQUEST_ID, body, sizeof(body));
+		}
+		return;
+	}
+
+	switch (header.type) {
+	case FcgiProtocol::RecordType::BEGIN_REQUEST:
+		beginRequest(header.requestId, content, header.contentLength);
+		break;
+	case FcgiProtocol::RecordType::ABORT_REQUEST:
+		abortRequest(header.requestId);
+		break;
+	case FcgiProtocol::RecordType::PARAMS: {
+		std::shared_ptr<RequestState> state = findRequest(header.requestId);
+		if (!state || state->paramsDone) {
+			break;
+		}
+		if (header.contentLength > 0) {
+			state->params.append(content, header.contentLength);
+			break;
+		}
+		state->paramsDone = true;
+		if (!FcgiProtocol::parseNameValues(state->params.data(), state->params.size(), state->env)) {
+			throw std::runtime_error("Malformed FastCGI params stream");
+		}
+		std::string().swap(state->params);
+		const Dispatch dispatch = selector_ ? selector_(*state) : Dispatch::ON_BODY;
+		if (Dispatch::ON_BODY != dispatch) {
+			state->streaming = Dispatch::STREAM == dispatch;
+			state->rejected = Dispatch::REJECT == dispatch;
+			state->dispatched = true;
+			ready.push_back(state);
+		}
+		break;
+	}
+	case FcgiProtocol::RecordType::STDIN: {
+		std::shared_ptr<RequestState> state = findRequest(header.requestId);
+		if (!state || state->stdinDone || state->rejected) {
+			break;
+		}
+		if (state->streaming) {
+			processStdin(*state, content, header.contentLength);
+			break;
+		}
+		if (header.contentLength > 0) {
+			state->body.append(content, header.contentLength);
+			break;
+		}
+		state->stdinDone = true;
+		if (state->paramsDone && !state->dispatched) {
+			state->dispatched = true;
+			ready.push_back(state);
+		}
+		break;
+	}
+	default:
+		// FCGI_DATA is used by the role FILTER only which is not supported
+		break;
+	}
+}
+
+void
+FcgiConnection::processStdin(RequestState &state, const char *content, std::size_t size) {
+	std::lock_guard<std::mutex> lock(state.bodyMutex);
+	if (size > 0) {
+		state.chunks.emplace_back(content, size);
+		state.buffered += size;
+		if (state.buffered >= STREAM_HIGH_WATERMARK) {
+			// Stop reading the connection until the handler catches up
+			state.throttled = true;
+			paused_ = true;
+		}
+	} else {
+		state.stdinDone = true;
+	}
+	state.bodyCond.notify_all();
+}
+
+std::size_t
+FcgiConnection::readBody(RequestState &state, char *buf, std::size_t size) {
+	bool resume = false;
+	std::size_t num = 0;
+	{
+		std::unique_lock<std::mutex> lock(state.bodyMutex);
+		auto available = [this, &state] {
+			return !state.chunks.empty() || state.stdinDone || state.aborted.load() || closed();
+		};
+		const std::chrono::milliseconds readTimeout = endpoint_->timeout(Endpoint::Timeout::READ);
+		if (readTimeout > std::chrono::milliseconds(0)) {
+			if (!state.bodyCond.wait_for(lock, readTimeout, available)) {
+				lock.unlock();
+				endpoint_->countTimeout(Endpoint::Timeout::READ);
+				state.cancellation->cancel(CancellationToken::Reason::DISCONNECTED);
+				close();
+				throw std::runtime_error("Cannot read request body: read timeout");
+			}
+		} else {
+			state.bodyCond.wait(lock, available);
+		}
+		if (state.chunks.empty()) {
+			if (state.stdinDone) {
+				return 0;
+			}
+			throw std::runtime_error(closed() ?
+				"Cannot read request body: connection is closed" :
+				"Cannot read request body: request is aborted");
+		}
+		while (num < size && !state.chunks.empty()) {
+			const std::string &chunk = state.chunks.front();
+			const std::size_t len = std::min(size - num, chunk.size() - state.chunkPos);
+			memcpy(buf + num, chunk.data() + state.chunkPos, len);
+			num += len;
+			state.chunkPos += len;
+			if (state.chunkPos == chunk.size()) {
+				state.chunks.pop_front();
+				state.chunkPos = 0;
+			}
+		}
+		state.buffered -= num;
+		if (state.throttled && state.buffered <= STREAM_LOW_WATERMARK) {
+			state.throttled = false;
+			resume = true;
+		}
+	}
+	if (resume && resume_) {
+		resume_(shared_from_this());
+	}
+	return num;
+}
+
+void
+FcgiConnection::beginRequest(std::uint16_t requestId, const char *content, std::size_t size) {
+	if (size < 3) {
+		throw std::runtime_error("Malformed FastCGI begin request record");
+	}
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(content);
+	const FcgiProtocol::Role role = static_cast<FcgiProtocol::Role>((p[0] << 8) | p[1]);
+	const bool keepConn = (p[2] & FcgiProtocol::KEEP_CONN) && endpoint_->getKeepConnection();
+
+	if (FcgiProtocol::Role::RESPONDER != role) {
+		char body[8];
+		FcgiProtocol::encodeEndRequestBody(body, 0, FcgiProtocol::ProtocolStatus::UNKNOWN_ROLE);
+		queueRecord(FcgiProtocol::RecordType::END_REQUEST, requestId, body, sizeof(body));
+		return;
+	}
+
+	FcgiProtocol::ProtocolStatus status = FcgiProtocol::ProtocolStatus::CANT_MPX_CONN;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (requests_.end() != requests_.find(requestId)) {
+			// Request ID is still in use: ignore the record
+			return;
+		}
+		if (requests_.empty() ||
+			(endpoint_->multiplex() && requests_.size() < endpoint_->maxRequests())) {
+			std::shared_ptr<RequestState> state = std::make_shared<RequestState>(requestId, keepConn);
+			const std::chrono::milliseconds requestTimeout = endpoint_->timeout(Endpoint::Timeout::REQUEST);
+			if (requestTimeout > std::chrono::milliseconds(0)) {
+				state->cancellation->setDeadline(state->begin + requestTimeout);
+			}
+			requests_.insert(std::make_pair(requestId, state));
+			return;
+		}
+		if (endpoint_->multiplex()) {
+			status = FcgiProtocol::ProtocolStatus::OVERLOADED;
+		}
+	}
+
+	char body[8];
+	FcgiProtocol::encodeEndRequestBody(body, 0, status);
+	queueRecord(FcgiProtocol::RecordType::END_REQUEST, requestId, body, sizeof(body));
+}
+
+void
+FcgiConnection::abortRequest(std::uint16_t requestId) {
+	std::shared_ptr<RequestState> state = findRequest(requestId);
+	if (!state) {
+		return;
+	}
+	state->aborted.store(true);
+	state->cancellation->cancel(CancellationToken::Reason::ABORTED);
+	if (state->streaming) {
+		std::lock_guard<std::mutex> lock(state->bodyMutex);
+		state->bodyCond.notify_all();
+	}
+	if (!state->dispatched) {
+		char records[END_RECORDS_LEN];
+		const bool closeConn = removeRequest(requestId, 0, FcgiProtocol::ProtocolStatus::REQUEST_COMPLETE, records);
+		std::lock_guard<std::mutex> lock(out_mutex_);
+		if (closeConn) {
+			// The connection is closed by the reactor once the records are written
+			close_queued_ = true;
+		}
+		if (out_.empty()) {
+			last_write_ = std::chrono::steady_clock::now();
+		}
+		out_.append(records, sizeof(records));
+	}
+}
+
+void
+FcgiConnection::getValues(const char *content, std::size_t size) {
+	std::vector<std::string> names;
+	if (!FcgiProtocol::parseNameValues(content, size, names)) {
+		return;
+	}
+	std::string result;
+	for (auto &pair : names) {
+		const std::string name = pair.substr(0, pair.find('='));
+		if (MAX_CONNS_KEY == name) {
+			FcgiProtocol::appendNameValue(result, name, std::to_string(endpoint_->maxConnections()));
+		} else if (MAX_REQS_KEY == name) {
+			FcgiProtocol::appendNameValue(result, name, std::to_string(endpoint_->maxRequests()));
+		} else if (MPXS_CONNS_KEY == name) {
+			FcgiProtocol::appendNameValue(result, name, endpoint_->multiplex() ? "1" : "0");
+		}
+	}
+	queueRecord(FcgiProtocol::RecordType::GET_VALUES_RESULT, FcgiProtocol::NULL_REQUEST_ID, result.data(), result.size());
+}
+
+std::shared_ptr<FcgiConnection::RequestState>
+FcgiConnection::findRequest(std::uint16_t requestId) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = requests_.find(requestId);
+	return (requests_.end() == it) ? std::shared_ptr<RequestState>() : it->second;
+}
+
+void
+FcgiConnection::writeStdout(std::uint16_t requestId, const char *buf, std::size_t size) {
+	struct iovec iov;
+	iov.iov_base = const_cast<char*>(buf);
+	iov.iov_len = size;
+	writeStdout(requestId, &iov, 1);
+}
+
+void
+FcgiConnection::writeStdout(std::uint16_t requestId, const struct iovec *segments, int count) {
+	std::size_t total = 0;
+	for (int i = 0; i < count; ++i) {
+		total += segments[i].iov_len;
+	}
+	if (0 == total) {
+		return;
+	}
+
+	// The segments are sliced into maximum-sized records, record headers
+	// and padding are interleaved with the caller's buffers without copying them
+	const std::size_t records = (total + MAX_CHUNK_LEN - 1) / MAX_CHUNK_LEN;
+	std::vector<char> headers(records * FcgiProtocol::HEADER_LEN);
+	std::vector<struct iovec> iov;
+	iov.reserve(2 * records + count);
+
+	int segment = 0;
+	std::size_t offset = 0;
+	for (std::size_t r = 0; r < records; ++r) {
+		const std::size_t len = std::min(total, MAX_CHUNK_LEN);
+		const unsigned char padding = FcgiProtocol::padding(len);
+		char *header = &headers[r * FcgiProtocol::HEADER_LEN];
+		FcgiProtocol::encodeHeader(header, FcgiProtocol::RecordType::STDOUT, requestId, len, padding);
+		iov.push_back({header, FcgiProtocol::HEADER_LEN});
+
+		std::size_t left = len;
+		while (left > 0) {
+			const struct iovec &s = segments[segment];
+			const std::size_t num = std::min(left, s.iov_len - offset);
+			if (num > 0) {
+				iov.push_back({static_cast<char*>(s.iov_base) + offset, num});
+			}
+			offset += num;
+			left -= num;
+			if (offset == s.iov_len) {
+				++segment;
+				offset = 0;
+			}
+		}
+		if (padding > 0) {
+			iov.push_back({const_cast<char*>(FcgiProtocol::PADDING), padding});
+		}
+		total -= len;
+	}
+
+	writeRecords(&iov[0], iov.size(), false);
+}
+
+bool
+FcgiConnection::sendFile(std::uint16_t requestId, int fd, std::uint64_t offset, std::uint64_t length) {
+	{
+		// The file is sent by the thread itself: the queued records are written first
+		// and the output of the other threads is queued until the file is sent
+		std::unique_lock<std::mutex> lock(out_mutex_);
+		waitOutput(lock, [this]() {
+			return out_.empty() && !out_writer_;
+		});
+		out_writer_ = true;
+	}
+	bool sent = false;
+	try {
+		sent = FcgiFileSender::send(fd_, requestId, fd, offset, length, writeTimeout(*endpoint_));
+	} catch (const std::system_error &e) {
+		if (ETIMEDOUT == e.code().value()) {
+			endpoint_->countTimeout(Endpoint::Timeout::WRITE);
+		}
+		releaseOutput();
+		close();
+		throw;
+	} catch (...) {
+		releaseOutput();
+		close();
+		throw;
+	}
+	releaseOutput();
+	return sent;
+}
+
+void
+FcgiConnection::releaseOutput() {
+	bool queued = false;
+	{
+		std::lock_guard<std::mutex> lock(out_mutex_);
+		out_writer_ = false;
+		last_write_ = std::chrono::steady_clock::now();
+		queued = !out_.empty() || close_queued_;
+		out_cond_.notify_all();
+	}
+	if (queued && resume_) {
+		// The records queued meanwhile are written by the reactor
+		resume_(shared_from_this());
+	}
+}
+
+void
+FcgiConnection::endRequest(std::uint16_t requestId, std::uint32_t appStatus, FcgiProtocol::ProtocolStatus status) {
+	char records[END_RECORDS_LEN];
+	const bool closeConn = removeRequest(requestId, appStatus, status, records);
+	if (closed()) {
+		return;
+	}
+
+	struct iovec iov[1];
+	iov[0].iov_base = records;
+	iov[0].iov_len = sizeof(records);
+	writeRecords(iov, 1, closeConn);
+}
+
+bool
+FcgiConnection::removeRequest(std::uint16_t requestId, std::uint32_t appStatus, FcgiProtocol::ProtocolStatus status, char *records) {
+	bool closeConn = false;
+	std::shared_ptr<RequestState> state;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = requests_.find(requestId);
+		if (requests_.end() != it) {
+			if (!it->second->keepConnection) {
+				close_pending_ = true;
+			}
+			state = it->second;
+			requests_.erase(it);
+		}
+		// Multiplexed requests still running on the connection are completed first
+		closeConn = close_pending_ && requests_.empty();
+	}
+	if (state && state->streaming) {
+		// The rest of the body is discarded: let the connection be read again
+		std::lock_guard<std::mutex> lock(state->bodyMutex);
+		std::deque<std::string>().swap(state->chunks);
+		state->buffered = 0;
+		if (state->throttled && resume_) {
+			state->throttled = false;
+			resume_(shared_from_this());
+		}
+	}
+
+	// Empty FCGI_STDOUT closes the output stream, followed by FCGI_END_REQUEST
+	FcgiProtocol::encodeHeader(records, FcgiProtocol::RecordType::STDOUT, requestId, 0, 0);
+	FcgiProtocol::encodeHeader(records + FcgiProtocol::HEADER_LEN, FcgiProtocol::RecordType::END_REQUEST, requestId, 8, 0);
+	FcgiProtocol::encodeEndRequestBody(records + 2 * FcgiProtocol::HEADER_LEN, appStatus, status);
+	return closeConn;
+}
+
+void
+FcgiConnection::queueRecord(FcgiProtocol::RecordType type, std::uint16_t requestId, const char *buf, std::size_t size) {
+	char header[FcgiProtocol::HEADER_LEN];
+	const unsigned char padding = FcgiProtocol::padding(size);
+	FcgiProtocol::encodeHeader(header, type, requestId, size, padding);
+
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	if (out_.empty()) {
+		last_write_ = std::chrono::steady_clock::now();
+	}
+	out_.append(header, sizeof(header));
+	out_.append(buf, size);
+	out_.append(FcgiProtocol::PADDING, padding);
+}
+
+bool
+FcgiConnection::writing() const {
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	return !out_.empty() && !out_writer_;
+}
+
+bool
+FcgiConnection::onWritable() {
+	if (closed()) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	if (out_writer_) {
+		// The pool thread sending a file hands the queued records back when it is done
+		return true;
+	}
+	while (!out_.empty()) {
+		ssize_t num = ::send(fd_, out_.data(), out_.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (num < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return EAGAIN == errno || EWOULDBLOCK == errno;
+		}
+		out_.erase(0, num);
+		last_write_ = std::chrono::steady_clock::now();
+		out_cond_.notify_all();
+	}
+	return !close_queued_;
+}
+
+bool
+FcgiConnection::backlogged() const {
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	return out_.size() >= OUTPUT_HIGH_WATERMARK && !out_writer_;
+}
+
+std::chrono::steady_clock::time_point
+FcgiConnection::lastWrite() const {
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	return last_write_;
+}
+
+void
+FcgiConnection::writeRecords(struct iovec *iov, std::size_t count, bool closeConn) {
+	std::unique_lock<std::mutex> lock(out_mutex_);
+	if (closed()) {
+		throw std::runtime_error("Cannot write data to fastcgi socket: connection is closed");
+	}
+
+	// Nothing is queued before: the records are written without copying as far as
+	// the socket accepts them, the thread never waits for the socket holding the lock
+	const bool direct = out_.empty() && !out_writer_;
+	while (direct && count > 0) {
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = std::min(count, MAX_IOV_COUNT);
+		ssize_t num = ::sendmsg(fd_, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (num < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				break;
+			}
+			const int error = errno;
+			lock.unlock();
+			close();
+			throw std::runtime_error("Cannot write data to fastcgi socket: " + StringUtils::error(error));
+		}
+		last_write_ = std::chrono::steady_clock::now();
+		while (count > 0 && static_cast<std::size_t>(num) >= iov->iov_len) {
+			num -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + num;
+			iov->iov_len -= num;
+		}
+	}
+
+	if (0 == count) {
+		if (closeConn && out_.empty() && !out_writer_) {
+			lock.unlock();
+			close();
+		} else if (closeConn) {
+			close_queued_ = true;
+		}
+		return;
+	}
+
+	// The rest is written by the reactor when the socket is writable
+	const bool wakeup = out_.empty();
+	if (wakeup) {
+		last_write_ = std::chrono::steady_clock::now();
+	}
+	for (; count > 0; ++iov, --count) {
+		out_.append(static_cast<const char*>(iov->iov_base), iov->iov_len);
+	}
+	if (closeConn) {
+		close_queued_ = true;
+	}
+	if (wakeup && resume_) {
+		lock.unlock();
+		resume_(shared_from_this());
+		lock.lock();
+	}
+
+	// The web server which does not read the output keeps the thread
+	// waiting here, without the connection locks, instead of the queue growing
+	waitOutput(lock, [this]() {
+		return out_.size() < OUTPUT_HIGH_WATERMARK;
+	});
+}
+
+void
+FcgiConnection::waitOutput(std::unique_lock<std::mutex> &lock, const std::function<bool()> &ready) {
+	const std::chrono::milliseconds timeout = writeTimeout(*endpoint_);
+	while (!ready()) {
+		if (closed()) {
+			throw std::runtime_error("Cannot write data to fastcgi socket: connection is closed");
+		}
+		// The thread sending a file is limited by the write timeout itself
+		if (!out_writer_ && std::chrono::steady_clock::now() - last_write_ >= timeout) {
+			lock.unlock();
+			endpoint_->countTimeout(Endpoint::Timeout::WRITE);
+			close();
+			throw std::runtime_error("Cannot write data to fastcgi socket: write timeout");
+		}
+		out_cond_.wait_for(lock, timeout);
+	}
+}
+
+} // namespace fastcgi
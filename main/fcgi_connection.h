@@ -0,0 +1,214 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_FASTCGI_CONNECTION_H_
+#define _FASTCGI_FASTCGI_CONNECTION_H_
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fastcgi3/cancellation_token.h"
+
+#include "fcgi_protocol.h"
+
+namespace fastcgi
+{
+
+class Endpoint;
+class Request;
+
+/**
+ * Server side of a single FastCGI transport connection.
+ *
+ * The records are read and assembled by the reactor thread which owns
+ * the connection. The responses are written by the pool threads as far as
+ * the socket accepts them without waiting, the rest is queued whole records
+ * at a time, so the output of multiplexed requests is interleaved record
+ * by record. The reactor writes the queued records when the socket is writable.
+ * Neither the reactor nor a pool thread waits for the socket holding the lock
+ * of the connection: a pool thread waits without it while too much of the
+ * output is queued.
+ */
+class FcgiConnection : public std::enable_shared_from_this<FcgiConnection> {
+public:
+	struct RequestState {
+		RequestState(std::uint16_t requestId, bool keepConn);
+
+		std::uint16_t id;
+		std::chrono::steady_clock::time_point begin;
+		bool keepConnection;
+		bool paramsDone;
+		bool stdinDone;
+		bool dispatched;
+		std::atomic<bool> aborted;
+		std::string params;
+		std::vector<std::string> env;
+		std::string body;
+
+		// Streamed body: dispatched as soon as the params are received,
+		// the body chunks are passed from the reactor to the handler thread
+		bool streaming;
+		bool throttled;
+		std::size_t buffered;
+		std::size_t chunkPos;
+		std::deque<std::string> chunks;
+		std::mutex bodyMutex;
+		std::condition_variable bodyCond;
+
+		// Rejected by the admission check: answered without reading the body
+		bool rejected;
+
+		// Tripped by FCGI_ABORT_REQUEST and by the loss of the connection
+		std::shared_ptr<CancellationToken> cancellation;
+
+		// Parsed from the params when the body mode is selected, attached to the body later
+		std::shared_ptr<Request> request;
+	};
+
+	/**
+	 * Selected when the params are received: the request is dispatched
+	 * when its body is received, or at once with the body streamed or rejected
+	 */
+	enum class Dispatch {ON_BODY, STREAM, REJECT};
+
+	using StreamSelectorType = std::function<Dispatch(RequestState&)>;
+	using ResumeHandlerType = std::function<void(std::weak_ptr<FcgiConnection>)>;
+
+public:
+	FcgiConnection(int fd, std::shared_ptr<Endpoint> endpoint,
+		StreamSelectorType selector = nullptr, ResumeHandlerType resume = nullptr);
+	virtual ~FcgiConnection();
+
+	FcgiConnection(const FcgiConnection&) = delete;
+	FcgiConnection& operator=(const FcgiConnection&) = delete;
+
+	int fd() const;
+	bool closed() const;
+	void close();
+
+	/**
+	 * Write timeout of the endpoint, the writes are never left waiting
+	 * without a limit: a default one applies if the endpoint has none
+	 */
+	static std::chrono::milliseconds writeTimeout(const Endpoint &endpoint);
+
+	/**
+	 * Reads the available data from the socket and collects the requests
+	 * which are completely received.
+	 * Returns false if the connection has been closed by the peer.
+	 */
+	bool onReadable(std::vector<std::shared_ptr<RequestState>> &ready);
+
+	/**
+	 * Writes the queued records as far as the socket accepts them without waiting.
+	 * Returns false if the connection has to be closed.
+	 */
+	bool onWritable();
+
+	/**
+	 * The queued records wait for the socket to become writable
+	 */
+	bool writing() const;
+
+	/**
+	 * Reading is stopped while too much of the queued records is not written,
+	 * the web server which does not read the answers cannot make the queue grow
+	 */
+	bool backlogged() const;
+
+	/**
+	 * Reading is paused while a streamed request has too much of its body
+	 * buffered, the reactor resumes it when the handler has consumed the data.
+	 */
+	bool paused() const;
+	void resume();
+
+	/**
+	 * Checks the endpoint deadlines, called periodically by the reactor.
+	 * Returns true if a request being received or the queued records
+	 * have run out of time: the connection has to be closed then. The dispatched requests
+	 * running out of time are cancelled.
+	 */
+	bool expired(std::chrono::steady_clock::time_point now);
+
+	/**
+	 * Reads the body of the streamed request, waiting for the data to arrive.
+	 * Returns 0 at the end of the body.
+	 */
+	std::size_t readBody(RequestState &state, char *buf, std::size_t size);
+
+	void writeStdout(std::uint16_t requestId, const char *buf, std::size_t size);
+	void writeStdout(std::uint16_t requestId, const struct iovec *segments, int count);
+	bool sendFile(std::uint16_t requestId, int fd, std::uint64_t offset, std::uint64_t length);
+	void endRequest(std::uint16_t requestId, std::uint32_t appStatus, FcgiProtocol::ProtocolStatus status);
+
+private:
+	bool processInput(std::vector<std::shared_ptr<RequestState>> &ready);
+	void processRecord(const FcgiProtocol::Header &header, const char *content, std::vector<std::shared_ptr<RequestState>> &ready);
+	void processStdin(RequestState &state, const char *content, std::size_t size);
+	void beginRequest(std::uint16_t requestId, const char *content, std::size_t size);
+	void abortRequest(std::uint16_t requestId);
+	void getValues(const char *content, std::size_t size);
+	std::shared_ptr<RequestState> findRequest(std::uint16_t requestId);
+
+	bool removeRequest(std::uint16_t requestId, std::uint32_t appStatus, FcgiProtocol::ProtocolStatus status, char *records);
+	void queueRecord(FcgiProtocol::RecordType type, std::uint16_t requestId, const char *buf, std::size_t size);
+	std::chrono::steady_clock::time_point lastWrite() const;
+	void writeRecords(struct iovec *iov, std::size_t count, bool closeConn);
+	void waitOutput(std::unique_lock<std::mutex> &lock, const std::function<bool()> &ready);
+	void releaseOutput();
+
+private:
+	int fd_;
+	std::shared_ptr<Endpoint> endpoint_;
+	StreamSelectorType selector_;
+	ResumeHandlerType resume_;
+	std::atomic<bool> closed_;
+	bool paused_;
+
+	std::vector<char> in_;
+	std::size_t in_begin_, in_end_;
+	std::chrono::steady_clock::time_point last_read_;
+
+	std::map<std::uint16_t, std::shared_ptr<RequestState>> requests_;
+	bool close_pending_;
+	std::mutex mutex_;
+
+	// Records the socket has not accepted yet, written by the reactor when it is writable.
+	// The pool thread sending a file owns the socket meanwhile
+	std::string out_;
+	bool out_writer_;
+	bool close_queued_;
+	std::chrono::steady_clock::time_point last_write_;
+	mutable std::mutex out_mutex_;
+	std::condition_variable out_cond_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_FASTCGI_CONNECTION_H_
@@ -0,0 +1,124 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include "fastcgi3/util.h"
+
+#include "fcgi_file_sender.h"
+#include "fcgi_protocol.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+// Record payload aligned to 8 bytes, so only the last record needs padding
+static const std::size_t MAX_CHUNK_LEN = FcgiProtocol::MAX_CONTENT_LEN & ~static_cast<std::size_t>(7);
+
+bool
+FcgiFileSender::send(int socket, std::uint16_t requestId, int fd, std::uint64_t offset, std::uint64_t length,
+		std::chrono::milliseconds timeout) {
+	struct stat fs;
+	if (-1 == fstat(fd, &fs)) {
+		throw std::runtime_error("Cannot stat file: " + StringUtils::error(errno));
+	}
+	if (!S_ISREG(fs.st_mode)) {
+		return false;
+	}
+	if (offset + length > static_cast<std::uint64_t>(fs.st_size)) {
+		throw std::runtime_error("Requested range is out of file");
+	}
+
+	off_t pos = offset;
+	while (length > 0) {
+		const std::size_t len = std::min<std::uint64_t>(length, MAX_CHUNK_LEN);
+		const unsigned char padding = FcgiProtocol::padding(len);
+
+		char header[FcgiProtocol::HEADER_LEN];
+		FcgiProtocol::encodeHeader(header, FcgiProtocol::RecordType::STDOUT, requestId, len, padding);
+		writeAll(socket, header, sizeof(header), MSG_MORE, timeout);
+
+		std::size_t left = len;
+		while (left > 0) {
+			ssize_t num = ::sendfile(socket, fd, &pos, left);
+			if (num < 0) {
+				if (EINTR == errno) {
+					continue;
+				}
+				if (EAGAIN == errno || EWOULDBLOCK == errno) {
+					waitWritable(socket, timeout);
+					continue;
+				}
+				throw std::runtime_error("Cannot send file to fastcgi socket: " + StringUtils::error(errno));
+			}
+			if (0 == num) {
+				throw std::runtime_error("Cannot send file to fastcgi socket: file is truncated");
+			}
+			left -= num;
+		}
+
+		if (padding > 0) {
+			writeAll(socket, FcgiProtocol::PADDING, padding, 0, timeout);
+		}
+		length -= len;
+	}
+	return true;
+}
+
+void
+FcgiFileSender::writeAll(int socket, const char *buf, std::size_t size, int flags, std::chrono::milliseconds timeout) {
+	while (size > 0) {
+		ssize_t num = ::send(socket, buf, size, flags | MSG_NOSIGNAL);
+		if (num < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				waitWritable(socket, timeout);
+				continue;
+			}
+			throw std::runtime_error("Cannot write data to fastcgi socket: " + StringUtils::error(errno));
+		}
+		buf += num;
+		size -= num;
+	}
+}
+
+void
+FcgiFileSender::waitWritable(int socket, std::chrono::milliseconds timeout) {
+	struct pollfd pfd;
+	pfd.fd = socket;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (0 == ::poll(&pfd, 1, timeout > std::chrono::milliseconds(0) ? timeout.count() : -1)) {
+		throw std::system_error(ETIMEDOUT, std::system_category(), "Cannot send file to fastcgi socket");
+	}
+}
+
+} // namespace fastcgi
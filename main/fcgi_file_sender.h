@@ -0,0 +1,57 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_FASTCGI_FILE_SENDER_H_
+#define _FASTCGI_FASTCGI_FILE_SENDER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace fastcgi
+{
+
+/**
+ * Frames a file range into FCGI_STDOUT records on the web server connection.
+ *
+ * Only the record headers are written from the userspace, the payload
+ * is moved from the page cache to the socket by sendfile.
+ */
+class FcgiFileSender {
+public:
+	FcgiFileSender() = delete;
+	FcgiFileSender(const FcgiFileSender&) = delete;
+	FcgiFileSender& operator=(const FcgiFileSender&) = delete;
+
+	/**
+	 * Returns false if the file can not be sent this way (not a regular file),
+	 * nothing is written to the socket then.
+	 * Throws std::system_error with ETIMEDOUT if the socket is not writable
+	 * for the timeout (0 - no limit).
+	 */
+	static bool send(int socket, std::uint16_t requestId, int fd, std::uint64_t offset, std::uint64_t length,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+private:
+	static void writeAll(int socket, const char *buf, std::size_t size, int flags, std::chrono::milliseconds timeout);
+	static void waitWritable(int socket, std::chrono::milliseconds timeout);
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_FASTCGI_FILE_SENDER_H_
@@ -0,0 +1,183 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstring>
+#include <streambuf>
+
+#include "endpoint.h"
+#include "fcgi_native_request.h"
+
+#include "fastcgi3/logger.h"
+#include "fastcgi3/request.h"
+
+#include "details/response_time_statistics.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const std::string DAEMON_STRING = "fastcgi3-daemon";
+static const std::size_t OUTPUT_CHUNK_SIZE = 65536;
+
+NativeFastcgiRequest::NativeFastcgiRequest(std::shared_ptr<Request> request,
+		std::shared_ptr<Endpoint> endpoint,
+		std::shared_ptr<FcgiConnection> connection,
+		std::shared_ptr<FcgiConnection::RequestState> state,
+		std::shared_ptr<Logger> logger,
+		std::shared_ptr<ResponseTimeStatistics> statistics,
+		const bool logTimes) :
+	request_(request), logger_(logger), endpoint_(endpoint),
+	connection_(connection), state_(state), read_pos_(0),
+	statistics_(statistics), logTimes_(logTimes), handler_(nullptr)
+{
+	if (logTimes_ || statistics_) {
+		gettimeofday(&accept_time_, nullptr);
+	}
+}
+
+NativeFastcgiRequest::~NativeFastcgiRequest() {
+	std::uint64_t microsec = 0;
+	if (logTimes_ || statistics_) {
+		gettimeofday(&finish_time_, nullptr);
+
+		microsec = (finish_time_.tv_sec - accept_time_.tv_sec) *
+			1000000 + (finish_time_.tv_usec - accept_time_.tv_usec);
+	}
+
+	if (logTimes_) {
+		double res = static_cast<double>(microsec) / 1000000.0;
+		logger_->info("handling %s taken %08f seconds", url_.c_str(), res);
+	}
+
+	if (statistics_) {
+		try {
+			statistics_->add(handler_ ? handler_->id : DAEMON_STRING, request_->status(), microsec);
+		}
+		catch (const std::exception &e) {
+			logger_->error("Exception caught while update statistics: %s", e.what());
+		}
+		catch (...) {
+			logger_->error("Unknown exception caught while update statistics");
+		}
+	}
+
+	try {
+		connection_->endRequest(state_->id, 0, FcgiProtocol::ProtocolStatus::REQUEST_COMPLETE);
+	}
+	catch (const std::exception &e) {
+		logger_->error("Cannot finish fastcgi request %s: %s", url_.c_str(), e.what());
+	}
+	request_->runAfterResponse();
+}
+
+void
+NativeFastcgiRequest::attach() {
+	std::vector<char*> envp;
+	envp.reserve(state_->env.size() + 1);
+	for (auto &e : state_->env) {
+		if (0 == strncasecmp(e.c_str(), "REQUEST_URI=", sizeof("REQUEST_URI=") - 1)) {
+			url_.assign(e, sizeof("REQUEST_URI=") - 1, std::string::npos);
+		}
+		if (0 == strncasecmp(e.c_str(), "REQUEST_ID=", sizeof("REQUEST_ID=") - 1)) {
+			request_id_.assign(e, sizeof("REQUEST_ID=") - 1, std::string::npos);
+		}
+		envp.push_back(&e[0]);
+	}
+	envp.push_back(nullptr);
+
+	std::shared_ptr<LoggerRequestId> logger_req_id = std::dynamic_pointer_cast<LoggerRequestId>(logger_);
+	if (logger_req_id) {
+		logger_req_id->setRequestId(request_id_);
+	}
+
+	if (!state_->keepConnection) {
+		request_->setHeader("Connection", "close");
+	}
+
+	// Body mode is selected by the reactor when the params are received
+	const Request::BodyMode mode = state_->rejected ? Request::BodyMode::SKIP :
+		(state_->streaming ? Request::BodyMode::STREAM : Request::BodyMode::READ);
+	if (state_->request == request_) {
+		// The params have been parsed by the selection of the body mode
+		state_->request.reset();
+		request_->attach(this, mode);
+	} else {
+		request_->attach(this, &envp[0], [mode](const Request*) {
+			return mode;
+		});
+	}
+
+	// The body is copied into the request, release the raw input
+	std::string().swap(state_->body);
+	read_pos_ = 0;
+}
+
+int
+NativeFastcgiRequest::read(char *buf, int size) {
+	if (state_->streaming) {
+		return size > 0 ? connection_->readBody(*state_, buf, size) : 0;
+	}
+	const std::string &body = state_->body;
+	if (read_pos_ >= body.size() || size <= 0) {
+		return 0;
+	}
+	std::size_t len = std::min(static_cast<std::size_t>(size), body.size() - read_pos_);
+	memcpy(buf, body.data() + read_pos_, len);
+	read_pos_ += len;
+	return len;
+}
+
+int
+NativeFastcgiRequest::write(const char *buf, int size) {
+	if (size > 0) {
+		connection_->writeStdout(state_->id, buf, size);
+	}
+	return size;
+}
+
+void
+NativeFastcgiRequest::write(std::streambuf *buf) {
+	std::vector<char> outv(OUTPUT_CHUNK_SIZE);
+	while (true) {
+		std::streamsize num = buf->sgetn(&outv[0], outv.size());
+		if (num <= 0) {
+			break;
+		}
+		connection_->writeStdout(state_->id, &outv[0], num);
+	}
+}
+
+void
+NativeFastcgiRequest::writev(const struct iovec *iov, int count) {
+	connection_->writeStdout(state_->id, iov, count);
+}
+
+bool
+NativeFastcgiRequest::sendFile(int fd, std::uint64_t offset, std::uint64_t length) {
+	return connection_->sendFile(state_->id, fd, offset, length);
+}
+
+void
+NativeFastcgiRequest::setHandlerDesc(const HandlerSet::HandlerDescription *handler) {
+	handler_ = handler;
+}
+
+} // namespace fastcgi
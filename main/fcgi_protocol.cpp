@@ -0,0 +1,131 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include "fcgi_protocol.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+const char FcgiProtocol::PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+FcgiProtocol::Header
+FcgiProtocol::decodeHeader(const char *buf) {
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(buf);
+	Header header;
+	header.version = p[0];
+	header.type = static_cast<RecordType>(p[1]);
+	header.requestId = (p[2] << 8) | p[3];
+	header.contentLength = (p[4] << 8) | p[5];
+	header.paddingLength = p[6];
+	return header;
+}
+
+void
+FcgiProtocol::encodeHeader(char *buf, RecordType type, std::uint16_t requestId, std::uint16_t contentLength, unsigned char paddingLength) {
+	unsigned char *p = reinterpret_cast<unsigned char*>(buf);
+	p[0] = VERSION_1;
+	p[1] = static_cast<unsigned char>(type);
+	p[2] = (requestId >> 8) & 0xff;
+	p[3] = requestId & 0xff;
+	p[4] = (contentLength >> 8) & 0xff;
+	p[5] = contentLength & 0xff;
+	p[6] = paddingLength;
+	p[7] = 0;
+}
+
+unsigned char
+FcgiProtocol::padding(std::size_t contentLength) {
+	return (8 - (contentLength & 7)) & 7;
+}
+
+static bool
+parseLength(const unsigned char *&p, const unsigned char *end, std::uint32_t &len) {
+	if (p >= end) {
+		return false;
+	}
+	if (0 == (*p & 0x80)) {
+		len = *p++;
+		return true;
+	}
+	if (end - p < 4) {
+		return false;
+	}
+	len = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	p += 4;
+	return true;
+}
+
+bool
+FcgiProtocol::parseNameValues(const char *data, std::size_t size, std::vector<std::string> &v) {
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+	const unsigned char *end = p + size;
+	while (p < end) {
+		std::uint32_t nameLen = 0, valueLen = 0;
+		if (!parseLength(p, end, nameLen) || !parseLength(p, end, valueLen)) {
+			return false;
+		}
+		if (static_cast<std::uint64_t>(end - p) < static_cast<std::uint64_t>(nameLen) + valueLen) {
+			return false;
+		}
+		std::string pair;
+		pair.reserve(nameLen + valueLen + 1);
+		pair.append(reinterpret_cast<const char*>(p), nameLen);
+		pair.push_back('=');
+		pair.append(reinterpret_cast<const char*>(p) + nameLen, valueLen);
+		v.push_back(std::move(pair));
+		p += nameLen + valueLen;
+	}
+	return true;
+}
+
+static void
+appendLength(std::string &out, std::size_t len) {
+	if (len < 0x80) {
+		out.push_back(static_cast<char>(len));
+	} else {
+		out.push_back(static_cast<char>(((len >> 24) & 0x7f) | 0x80));
+		out.push_back(static_cast<char>((len >> 16) & 0xff));
+		out.push_back(static_cast<char>((len >> 8) & 0xff));
+		out.push_back(static_cast<char>(len & 0xff));
+	}
+}
+
+void
+FcgiProtocol::appendNameValue(std::string &out, const std::string &name, const std::string &value) {
+	appendLength(out, name.size());
+	appendLength(out, value.size());
+	out.append(name);
+	out.append(value);
+}
+
+void
+FcgiProtocol::encodeEndRequestBody(char *buf, std::uint32_t appStatus, ProtocolStatus status) {
+	unsigned char *p = reinterpret_cast<unsigned char*>(buf);
+	p[0] = (appStatus >> 24) & 0xff;
+	p[1] = (appStatus >> 16) & 0xff;
+	p[2] = (appStatus >> 8) & 0xff;
+	p[3] = appStatus & 0xff;
+	p[4] = static_cast<unsigned char>(status);
+	p[5] = p[6] = p[7] = 0;
+}
+
+} // namespace fastcgi
@@ -0,0 +1,106 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_FASTCGI_PROTOCOL_H_
+#define _FASTCGI_FASTCGI_PROTOCOL_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace fastcgi
+{
+
+/**
+ * Record layout and constants of the FastCGI protocol, version 1,
+ * used by the native (libfcgi-less) endpoint engine.
+ */
+class FcgiProtocol {
+public:
+	FcgiProtocol(const FcgiProtocol&) = delete;
+	FcgiProtocol& operator=(const FcgiProtocol&) = delete;
+
+	static const unsigned char VERSION_1 = 1;
+	static const std::size_t HEADER_LEN = 8;
+	static const std::size_t MAX_CONTENT_LEN = 65535;
+	static const std::uint16_t NULL_REQUEST_ID = 0;
+
+	/// Value of the flags byte of FCGI_BEGIN_REQUEST
+	static const unsigned char KEEP_CONN = 1;
+
+	enum class RecordType : unsigned char {
+		BEGIN_REQUEST = 1,
+		ABORT_REQUEST = 2,
+		END_REQUEST = 3,
+		PARAMS = 4,
+		STDIN = 5,
+		STDOUT = 6,
+		STDERR = 7,
+		DATA = 8,
+		GET_VALUES = 9,
+		GET_VALUES_RESULT = 10,
+		UNKNOWN_TYPE = 11
+	};
+
+	enum class Role : std::uint16_t {
+		RESPONDER = 1,
+		AUTHORIZER = 2,
+		FILTER = 3
+	};
+
+	enum class ProtocolStatus : unsigned char {
+		REQUEST_COMPLETE = 0,
+		CANT_MPX_CONN = 1,
+		OVERLOADED = 2,
+		UNKNOWN_ROLE = 3
+	};
+
+	struct Header {
+		unsigned char version;
+		RecordType type;
+		std::uint16_t requestId;
+		std::uint16_t contentLength;
+		unsigned char paddingLength;
+	};
+
+	static Header decodeHeader(const char *buf);
+	static void encodeHeader(char *buf, RecordType type, std::uint16_t requestId, std::uint16_t contentLength, unsigned char paddingLength);
+
+	/// Padding which aligns the record content to 8 bytes
+	static unsigned char padding(std::size_t contentLength);
+
+	/**
+	 * Decodes the name-value pairs of FCGI_PARAMS/FCGI_GET_VALUES stream
+	 * into the strings "NAME=VALUE".
+	 * Returns false if the stream is malformed.
+	 */
+	static bool parseNameValues(const char *data, std::size_t size, std::vector<std::string> &v);
+
+	static void appendNameValue(std::string &out, const std::string &name, const std::string &value);
+
+	static void encodeEndRequestBody(char *buf, std::uint32_t appStatus, ProtocolStatus status);
+
+	static const char PADDING[8];
+
+private:
+	FcgiProtocol();
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_FASTCGI_PROTOCOL_H_
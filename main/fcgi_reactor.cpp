@@ -0,0 +1,355 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
+
+#include "fastcgi3/logger.h"
+#include "fastcgi3/util.h"
+
+#include "endpoint.h"
+#include "fcgi_reactor.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+static const int MAX_EVENTS = 64;
+static const std::chrono::milliseconds MIN_TICK(10);
+static const std::chrono::milliseconds MAX_TICK(1000);
+
+FcgiReactor::FcgiReactor(std::shared_ptr<Endpoint> endpoint, int listenSocket, RequestHandlerType handler, std::shared_ptr<Logger> logger,
+		FcgiConnection::StreamSelectorType selector) :
+	endpoint_(std::move(endpoint)), listen_(listenSocket), epoll_(-1),
+	handler_(std::move(handler)), logger_(std::move(logger)), selector_(std::move(selector))
+{
+	stopped_.store(false);
+
+	epoll_ = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epoll_) {
+		throw std::runtime_error("Cannot create epoll instance: " + StringUtils::error(errno));
+	}
+
+	try {
+		wakeup_ = std::make_shared<Wakeup>();
+	} catch (...) {
+		close(epoll_);
+		throw;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = wakeup_->fd;
+	epoll_ctl(epoll_, EPOLL_CTL_ADD, wakeup_->fd, &ev);
+
+	// All reactors of the endpoint are waiting on the same listening socket:
+	// let the kernel wake up only one of them per incoming connection
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	ev.events |= EPOLLEXCLUSIVE;
+#endif
+	ev.data.fd = listen_;
+	if (-1 == epoll_ctl(epoll_, EPOLL_CTL_ADD, listen_, &ev)) {
+		const int error = errno;
+		close(epoll_);
+		throw std::runtime_error("Cannot watch endpoint socket " + endpoint_->toString() + ": " + StringUtils::error(error));
+	}
+}
+
+FcgiReactor::~FcgiReactor() {
+	stop();
+	join();
+	connections_.clear();
+	close(epoll_);
+}
+
+FcgiReactor::Wakeup::Wakeup() {
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == fd) {
+		throw std::runtime_error("Cannot create reactor wakeup descriptor: " + StringUtils::error(errno));
+	}
+}
+
+FcgiReactor::Wakeup::~Wakeup() {
+	close(fd);
+}
+
+void
+FcgiReactor::Wakeup::signal() {
+	std::uint64_t one = 1;
+	if (sizeof(one) != write(fd, &one, sizeof(one))) {
+		// The counter is already signalled
+	}
+}
+
+void
+FcgiReactor::Wakeup::resume(std::weak_ptr<FcgiConnection> connection) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		resumed.push_back(std::move(connection));
+	}
+	signal();
+}
+
+std::shared_ptr<Endpoint>
+FcgiReactor::endpoint() const {
+	return endpoint_;
+}
+
+void
+FcgiReactor::start() {
+	thread_.reset(new std::thread(&FcgiReactor::run, this));
+}
+
+void
+FcgiReactor::stop() {
+	stopped_.store(true);
+	wakeup_->signal();
+}
+
+void
+FcgiReactor::resumeConnection(std::weak_ptr<FcgiConnection> connection) {
+	wakeup_->resume(std::move(connection));
+}
+
+void
+FcgiReactor::join() {
+	if (thread_ && thread_->joinable()) {
+		thread_->join();
+	}
+}
+
+void
+FcgiReactor::run() {
+	if (!endpoint_->affinity().apply()) {
+		logger_->error("FcgiReactor: cannot pin the thread of %s to CPUs %s",
+			endpoint_->toString().c_str(), endpoint_->affinity().toString().c_str());
+	}
+
+	// Connections are checked for the deadlines several times per the shortest timeout,
+	// the write timeout is always in effect
+	std::chrono::milliseconds tick = FcgiConnection::writeTimeout(*endpoint_) / 4;
+	for (auto type : {Endpoint::Timeout::READ, Endpoint::Timeout::REQUEST}) {
+		const std::chrono::milliseconds timeout = endpoint_->timeout(type);
+		if (timeout > std::chrono::milliseconds(0) && timeout / 4 < tick) {
+			tick = timeout / 4;
+		}
+	}
+	tick = std::min(std::max(tick, MIN_TICK), MAX_TICK);
+	std::chrono::steady_clock::time_point nextCheck = std::chrono::steady_clock::now() + tick;
+
+	struct epoll_event events[MAX_EVENTS];
+	while (!stopped_.load()) {
+		int num = epoll_wait(epoll_, events, MAX_EVENTS, tick.count());
+		if (num < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			logger_->error("FcgiReactor: epoll_wait failed: %s", StringUtils::error(errno).c_str());
+			return;
+		}
+		for (int i = 0; i < num && !stopped_.load(); ++i) {
+			const int fd = events[i].data.fd;
+			if (fd == wakeup_->fd) {
+				std::uint64_t value;
+				while (read(wakeup_->fd, &value, sizeof(value)) > 0) {
+				}
+				resumeConnections();
+			} else if (fd == listen_) {
+				acceptConnections();
+			} else {
+				onEvent(fd, events[i].events);
+			}
+		}
+
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now >= nextCheck) {
+			checkDeadlines(now);
+			nextCheck = now + tick;
+		}
+	}
+}
+
+void
+FcgiReactor::checkDeadlines(std::chrono::steady_clock::time_point now) {
+	std::vector<int> expired;
+	for (auto &it : connections_) {
+		if (it.second->expired(now)) {
+			expired.push_back(it.first);
+		}
+	}
+	for (int fd : expired) {
+		logger_->info("FcgiReactor: connection on %s is closed: request timed out", endpoint_->toString().c_str());
+		closeConnection(fd);
+	}
+}
+
+void
+FcgiReactor::acceptConnections() {
+	while (true) {
+		int fd = accept4(listen_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (-1 == fd) {
+			if (EINTR == errno || ECONNABORTED == errno) {
+				continue;
+			}
+			if (EAGAIN != errno && EWOULDBLOCK != errno) {
+				logger_->error("FcgiReactor: cannot accept connection on %s: %s",
+					endpoint_->toString().c_str(), StringUtils::error(errno).c_str());
+			}
+			return;
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = fd;
+		if (-1 == epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev)) {
+			logger_->error("FcgiReactor: cannot watch connection: %s", StringUtils::error(errno).c_str());
+			close(fd);
+			continue;
+		}
+		// The connection keeps the wakeup of the reactor, not the reactor itself
+		std::weak_ptr<Wakeup> wakeup = wakeup_;
+		connections_[fd] = std::make_shared<FcgiConnection>(fd, endpoint_, selector_,
+			[wakeup](std::weak_ptr<FcgiConnection> connection) {
+				if (std::shared_ptr<Wakeup> w = wakeup.lock()) {
+					w->resume(std::move(connection));
+				}
+			});
+	}
+}
+
+void
+FcgiReactor::onEvent(int fd, std::uint32_t events) {
+	auto it = connections_.find(fd);
+	if (connections_.end() == it) {
+		return;
+	}
+	std::shared_ptr<FcgiConnection> connection = it->second;
+
+	if (events & EPOLLERR) {
+		closeConnection(fd);
+		return;
+	}
+	if (connection->paused() && (events & EPOLLHUP)) {
+		closeConnection(fd);
+		return;
+	}
+
+	std::vector<std::shared_ptr<FcgiConnection::RequestState>> ready;
+	bool alive = true;
+	if (!connection->paused()) {
+		try {
+			alive = connection->onReadable(ready);
+		} catch (const std::exception &e) {
+			logger_->error("FcgiReactor: %s", e.what());
+			alive = false;
+		}
+	}
+
+	for (auto &state : ready) {
+		try {
+			handler_(connection, state);
+		} catch (const std::exception &e) {
+			logger_->error("FcgiReactor: failed to handle fastcgi request: %s", e.what());
+		} catch (...) {
+			logger_->error("FcgiReactor: caught unknown exception while handling fastcgi request");
+		}
+	}
+
+	// The records answered by the reactor itself are written without waiting for the socket
+	if (alive) {
+		alive = connection->onWritable();
+	}
+
+	if (!alive) {
+		closeConnection(fd);
+	} else if (connection->paused() || connection->writing() || (events & EPOLLOUT)) {
+		watch(fd, *connection);
+	}
+}
+
+void
+FcgiReactor::watch(int fd, const FcgiConnection &connection) {
+	// Streamed body which is not consumed fast enough and the answers which are not read
+	// stop the watching of the input, the output is watched while the queued records wait for the socket
+	struct epoll_event ev;
+	ev.events = connection.paused() || connection.backlogged() ? 0 : EPOLLIN | EPOLLRDHUP;
+	if (connection.writing()) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.fd = fd;
+	epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void
+FcgiReactor::resumeConnections() {
+	std::vector<std::weak_ptr<FcgiConnection>> resumed;
+	{
+		std::lock_guard<std::mutex> lock(wakeup_->mutex);
+		resumed.swap(wakeup_->resumed);
+	}
+	for (auto &handle : resumed) {
+		std::shared_ptr<FcgiConnection> connection = handle.lock();
+		if (!connection) {
+			continue;
+		}
+		// The descriptor of the closed connection may have been reused by a new one
+		const int fd = connection->fd();
+		auto it = connections_.find(fd);
+		if (connections_.end() == it || it->second != connection) {
+			continue;
+		}
+		if (connection->paused()) {
+			connection->resume();
+			watch(fd, *connection);
+
+			// Records buffered before the pause are processed without waiting for new input
+			onEvent(fd, 0);
+		} else if (!connection->onWritable()) {
+			closeConnection(fd);
+		} else {
+			// The output queued by the pool threads waits for the socket to become writable
+			watch(fd, *connection);
+		}
+	}
+}
+
+void
+FcgiReactor::closeConnection(int fd) {
+	auto it = connections_.find(fd);
+	if (connections_.end() == it) {
+		return;
+	}
+	epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+	// The descriptor itself is closed when the last request
+	// running on this connection releases it
+	it->second->close();
+	connections_.erase(it);
+}
+
+} // namespace fastcgi
@@ -0,0 +1,109 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_FASTCGI_REACTOR_H_
+#define _FASTCGI_FASTCGI_REACTOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fcgi_connection.h"
+
+namespace fastcgi
+{
+
+class Endpoint;
+class Logger;
+
+/**
+ * Event loop of the native endpoint engine.
+ *
+ * Each reactor runs a single thread which accepts the connections on
+ * the endpoint socket, reads and assembles the FastCGI records with epoll
+ * and passes every completely received request to the request handler.
+ */
+class FcgiReactor {
+public:
+	using RequestHandlerType = std::function<void(std::shared_ptr<FcgiConnection>, std::shared_ptr<FcgiConnection::RequestState>)>;
+
+public:
+	FcgiReactor(std::shared_ptr<Endpoint> endpoint, int listenSocket, RequestHandlerType handler, std::shared_ptr<Logger> logger,
+		FcgiConnection::StreamSelectorType selector = nullptr);
+	virtual ~FcgiReactor();
+
+	FcgiReactor(const FcgiReactor&) = delete;
+	FcgiReactor& operator=(const FcgiReactor&) = delete;
+
+	void start();
+	void stop();
+	void join();
+
+	std::shared_ptr<Endpoint> endpoint() const;
+
+	/**
+	 * Schedules reading of the paused connection or writing of its queued output,
+	 * called by the handler threads
+	 */
+	void resumeConnection(std::weak_ptr<FcgiConnection> connection);
+
+private:
+	void run();
+	void acceptConnections();
+	void onEvent(int fd, std::uint32_t events);
+	void closeConnection(int fd);
+	void watch(int fd, const FcgiConnection &connection);
+	void resumeConnections();
+	void checkDeadlines(std::chrono::steady_clock::time_point now);
+
+	/**
+	 * Descriptor waking the reactor up and the connections to be read again.
+	 * Shared with the connections, which may outlive the reactor
+	 */
+	struct Wakeup {
+		Wakeup();
+		~Wakeup();
+		void signal();
+		void resume(std::weak_ptr<FcgiConnection> connection);
+
+		int fd;
+		std::mutex mutex;
+		std::vector<std::weak_ptr<FcgiConnection>> resumed;
+	};
+
+private:
+	std::shared_ptr<Endpoint> endpoint_;
+	int listen_;
+	int epoll_;
+	std::shared_ptr<Wakeup> wakeup_;
+	RequestHandlerType handler_;
+	std::shared_ptr<Logger> logger_;
+	FcgiConnection::StreamSelectorType selector_;
+	std::map<int, std::shared_ptr<FcgiConnection>> connections_;
+	std::unique_ptr<std::thread> thread_;
+	std::atomic<bool> stopped_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_FASTCGI_REACTOR_H_
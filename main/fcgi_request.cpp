@@ -17,14 +17,21 @@
 // You should have received a copy of the GNU Lesser General Public License (LGPL)
 // along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
 
+#include <sys/socket.h>
+
+#include <cerrno>
 #include <cstring>
 #include <functional>
+#include <system_error>
 
 #include "endpoint.h"
+#include "fcgi_file_sender.h"
+#include "fcgi_protocol.h"
 #include "fcgi_request.h"
 
 #include "fastcgi3/logger.h"
 #include "fastcgi3/request.h"
+#include "fastcgi3/stream.h"
 
 #include "fastcgi3/session_manager.h"
 
@@ -52,50 +59,32 @@ namespace fastcgi
 
 static const std::string DAEMON_STRING = "fastcgi3-daemon";
 
+// The connection is peeked for FCGI_ABORT_REQUEST at most once per interval
+static const std::chrono::milliseconds PROBE_INTERVAL(50);
+
 FastcgiRequest::FastcgiRequest(std::shared_ptr<Request> request,
 		std::shared_ptr<Endpoint> endpoint,
+		int listenSocket,
 		std::shared_ptr<Logger> logger,
 		std::shared_ptr<ResponseTimeStatistics> statistics,
 		const bool logTimes) :
     request_(request), logger_(logger), endpoint_(endpoint),
-    statistics_(statistics), logTimes_(logTimes), handler_(nullptr)
+    statistics_(statistics), logTimes_(logTimes), handler_(nullptr), accepted_(false), body_skipped_(false),
+    rcv_timeout_(0), snd_timeout_(0)
 {
-    if (0 != FCGX_InitRequest(&fcgiRequest_, endpoint_->socket(), 0)) {
+    last_probe_.store(0);
+    if (0 != FCGX_InitRequest(&fcgiRequest_, listenSocket, 0)) {
         throw std::runtime_error("can not init fastcgi request");
     }
 }
 
 FastcgiRequest::~FastcgiRequest() {
-    std::uint64_t microsec = 0;
-    if (logTimes_ || statistics_) {
-        gettimeofday(&finish_time_, nullptr);
-
-        microsec = (finish_time_.tv_sec - accept_time_.tv_sec) *
-            1000000 + (finish_time_.tv_usec - accept_time_.tv_usec);
-    }
-
-    if (logTimes_) {
-        double res = static_cast<double>(microsec) / 1000000.0;
-        logger_->info("handling %s taken %08f seconds", url_.c_str(), res);
-    }
-
-    if (statistics_) {
-        try {
-            statistics_->add(handler_ ? handler_->id : DAEMON_STRING, request_->status(), microsec);
-        }
-        catch (const std::exception &e) {
-            logger_->error("Exception caught while update statistics: %s", e.what());
-        }
-        catch (...) {
-            logger_->error("Unknown exception caught while update statistics");
-        }
-    }
-
-    FCGX_Finish_r(&fcgiRequest_);
+    finish();
+    FCGX_Free(&fcgiRequest_, 1);
 }
 
 void
-FastcgiRequest::attach() {
+FastcgiRequest::attach(const std::function<Request::BodyMode(const Request*)> &bodyMode) {
 
     char **envp = fcgiRequest_.envp;
     for (std::size_t i = 0; envp[i]; ++i) {
@@ -116,7 +105,11 @@ FastcgiRequest::attach() {
     	request_->setHeader("Connection", "close");
     }
 
-    request_->attach(this, fcgiRequest_.envp);
+    request_->attach(this, fcgiRequest_.envp, [this, &bodyMode](const Request *r) {
+        const Request::BodyMode mode = bodyMode ? bodyMode(r) : Request::BodyMode::READ;
+        body_skipped_ = Request::BodyMode::SKIP == mode && r->getContentLength() > 0;
+        return mode;
+    });
 }
 
 int
@@ -124,9 +117,28 @@ FastcgiRequest::accept() {
     int status = FCGX_Accept_r(&fcgiRequest_);
 
     if (status >= 0) {
+        accepted_ = true;
+
     	// TODO: Apache mod_proxy_fcgi does not keep connection
         fcgiRequest_.keepConnection = endpoint_->getKeepConnection();
 
+        if (cancellation_ && cancellation_.unique()) {
+            cancellation_->reset();
+        } else {
+            // The token of the previous request is still held by its handler
+            cancellation_ = std::make_shared<CancellationToken>();
+        }
+        last_probe_.store(0);
+        cancellation_->setProbe([this]() {
+            return probe();
+        });
+
+        const std::chrono::milliseconds total = endpoint_->timeout(Endpoint::Timeout::REQUEST);
+        if (total > std::chrono::milliseconds(0)) {
+            deadline_ = std::chrono::steady_clock::now() + total;
+            cancellation_->setDeadline(deadline_);
+        }
+
         if (logTimes_ || statistics_) {
             gettimeofday(&accept_time_, nullptr);
         }
@@ -137,12 +149,142 @@ FastcgiRequest::accept() {
 
 void
 FastcgiRequest::finish() {
+    if (!accepted_) {
+        return;
+    }
+    accepted_ = false;
+
+    std::uint64_t microsec = 0;
+    if (logTimes_ || statistics_) {
+        gettimeofday(&finish_time_, nullptr);
+
+        microsec = (finish_time_.tv_sec - accept_time_.tv_sec) *
+            1000000 + (finish_time_.tv_usec - accept_time_.tv_usec);
+    }
+
+    if (logTimes_) {
+        double res = static_cast<double>(microsec) / 1000000.0;
+        logger_->info("handling %s taken %08f seconds", url_.c_str(), res);
+    }
+
+    if (statistics_) {
+        try {
+            statistics_->add(handler_ ? handler_->id : DAEMON_STRING, request_->status(), microsec);
+        }
+        catch (const std::exception &e) {
+            logger_->error("Exception caught while update statistics: %s", e.what());
+        }
+        catch (...) {
+            logger_->error("Unknown exception caught while update statistics");
+        }
+    }
+
+    if (fcgiRequest_.keepConnection && body_skipped_) {
+        // Reading the body of the rejected request is what the admission check avoids
+        fcgiRequest_.keepConnection = 0;
+    } else if (fcgiRequest_.keepConnection && request_->isBodyStreamed()) {
+        // Body left unread by the handler must not be taken for the next request
+        char buf[4096];
+        while (FCGX_GetStr(buf, sizeof(buf), fcgiRequest_.in) > 0) {
+        }
+    }
+
+    // The last records are written by FCGX_Finish_r
+    setSocketTimeout(SO_SNDTIMEO, endpoint_->timeout(Endpoint::Timeout::WRITE));
+
     FCGX_Finish_r(&fcgiRequest_);
+    request_->runAfterResponse();
+
+    // Kept connection waits for the next request without the deadlines
+    if (fcgiRequest_.ipcFd >= 0) {
+        setSocketTimeout(SO_RCVTIMEO, std::chrono::milliseconds(0));
+        setSocketTimeout(SO_SNDTIMEO, std::chrono::milliseconds(0));
+    }
+    deadline_ = std::chrono::steady_clock::time_point();
+}
+
+void
+FastcgiRequest::reset() {
+    url_.clear();
+    request_id_.clear();
+    handler_ = nullptr;
+    body_skipped_ = false;
+    if (cancellation_) {
+        cancellation_->release();
+    }
+    request_->reset();
+}
+
+std::shared_ptr<Request>
+FastcgiRequest::request() const {
+    return request_;
+}
+
+std::shared_ptr<CancellationToken>
+FastcgiRequest::cancellation() const {
+    return cancellation_;
+}
+
+bool
+FastcgiRequest::keptConnection() const {
+    return fcgiRequest_.ipcFd >= 0;
+}
+
+void
+FastcgiRequest::closeConnection() {
+    const int listenSocket = fcgiRequest_.listen_sock;
+    FCGX_Free(&fcgiRequest_, 1);
+    if (0 != FCGX_InitRequest(&fcgiRequest_, listenSocket, 0)) {
+        throw std::runtime_error("can not init fastcgi request");
+    }
+}
+
+CancellationToken::Reason
+FastcgiRequest::probe() {
+    // Records following the body can be seen only when the body is consumed
+    RequestBodyStream *body = request_->requestBodyStream();
+    if (nullptr != body && !body->eof()) {
+        return CancellationToken::Reason::NONE;
+    }
+
+    // The token is polled by the handlers as often as they like, the socket is not
+    const std::chrono::steady_clock::rep now = std::chrono::steady_clock::now().time_since_epoch().count();
+    std::chrono::steady_clock::rep last = last_probe_.load();
+    if (0 != last && now - last < std::chrono::duration_cast<std::chrono::steady_clock::duration>(PROBE_INTERVAL).count()) {
+        return CancellationToken::Reason::NONE;
+    }
+    if (!last_probe_.compare_exchange_strong(last, now)) {
+        // Another thread is probing the connection right now
+        return CancellationToken::Reason::NONE;
+    }
+
+    char header[FcgiProtocol::HEADER_LEN];
+    ssize_t n = recv(fcgiRequest_.ipcFd, header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+    if (0 == n) {
+        return CancellationToken::Reason::DISCONNECTED;
+    }
+    if (n < 0) {
+        return (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) ?
+            CancellationToken::Reason::NONE : CancellationToken::Reason::DISCONNECTED;
+    }
+    if (static_cast<ssize_t>(sizeof(header)) == n) {
+        // The bytes following the body are taken for a record header only if they look like one
+        const FcgiProtocol::Header record = FcgiProtocol::decodeHeader(header);
+        if (FcgiProtocol::VERSION_1 == record.version && FcgiProtocol::RecordType::ABORT_REQUEST == record.type) {
+            return CancellationToken::Reason::ABORTED;
+        }
+    }
+    return CancellationToken::Reason::NONE;
 }
 
 int
 FastcgiRequest::read(char *buf, int size) {
-    return FCGX_GetStr(buf, size, fcgiRequest_.in);
+    const Endpoint::Timeout type = applyTimeout(Endpoint::Timeout::READ);
+    int num = FCGX_GetStr(buf, size, fcgiRequest_.in);
+    if (num < size && isTimeoutError(FCGX_GetError(fcgiRequest_.in))) {
+        timedOut(type);
+    }
+    return num;
 }
 
 static void
@@ -176,12 +318,73 @@ generateRequestInfo(const Request *request, std::stringstream &str) {
     str << ". Args: " << result;
 }
 
+Endpoint::Timeout
+FastcgiRequest::applyTimeout(Endpoint::Timeout idle) {
+    // libfcgi does blocking I/O: the deadlines are enforced by the socket timeouts
+    Endpoint::Timeout type = idle;
+    std::chrono::milliseconds timeout = endpoint_->timeout(idle);
+    if (deadline_ != std::chrono::steady_clock::time_point()) {
+        const std::chrono::milliseconds left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline_ - std::chrono::steady_clock::now());
+        if (left <= std::chrono::milliseconds(0)) {
+            timedOut(Endpoint::Timeout::REQUEST);
+        }
+        if (timeout <= std::chrono::milliseconds(0) || left < timeout) {
+            timeout = left;
+            type = Endpoint::Timeout::REQUEST;
+        }
+    }
+    setSocketTimeout(Endpoint::Timeout::READ == idle ? SO_RCVTIMEO : SO_SNDTIMEO, timeout);
+    return type;
+}
+
+void
+FastcgiRequest::setSocketTimeout(int option, std::chrono::milliseconds timeout) {
+    std::chrono::milliseconds &applied = SO_RCVTIMEO == option ? rcv_timeout_ : snd_timeout_;
+    if (applied == timeout) {
+        return;
+    }
+    struct timeval tv;
+    tv.tv_sec = timeout.count() / 1000;
+    tv.tv_usec = (timeout.count() % 1000) * 1000;
+    if (0 == setsockopt(fcgiRequest_.ipcFd, SOL_SOCKET, option, &tv, sizeof(tv))) {
+        applied = timeout;
+    }
+}
+
+bool
+FastcgiRequest::isTimeoutError(int error) {
+    return EAGAIN == error || EWOULDBLOCK == error;
+}
+
+void
+FastcgiRequest::timedOut(Endpoint::Timeout type) {
+    endpoint_->countTimeout(type);
+
+    // The records of the request are cut in the middle: the connection can not be reused
+    fcgiRequest_.keepConnection = 0;
+    if (cancellation_) {
+        cancellation_->cancel(Endpoint::Timeout::REQUEST == type ?
+            CancellationToken::Reason::DEADLINE : CancellationToken::Reason::DISCONNECTED);
+    }
+
+    std::stringstream str;
+    str << (Endpoint::Timeout::READ == type ? "Read" : Endpoint::Timeout::WRITE == type ? "Write" : "Request")
+        << " timeout on fastcgi socket. ";
+    generateRequestInfo(request_.get(), str);
+    throw std::runtime_error(str.str());
+}
+
 int
 FastcgiRequest::write(const char *buf, int size) {
+    const Endpoint::Timeout type = applyTimeout(Endpoint::Timeout::WRITE);
     int num = FCGX_PutStr(buf, size, fcgiRequest_.out);
     if (-1 == num) {
         std::stringstream str;
         int error = FCGX_GetError(fcgiRequest_.out);
+        if (isTimeoutError(error)) {
+            timedOut(type);
+        }
         if (error > 0) {
             str << "Cannot write data to fastcgi socket: " << StringUtils::error(error) << ". ";
         } else {
@@ -195,10 +398,44 @@ FastcgiRequest::write(const char *buf, int size) {
 
 void
 FastcgiRequest::write(std::streambuf *buf) {
+    const Endpoint::Timeout type = applyTimeout(Endpoint::Timeout::WRITE);
     std::vector<char> outv(4096);
     fcgi_streambuf outbuf(fcgiRequest_.out, &outv[0], outv.size());
     std::ostream os(&outbuf);
     os << buf;
+    if (isTimeoutError(FCGX_GetError(fcgiRequest_.out))) {
+        timedOut(type);
+    }
+}
+
+void
+FastcgiRequest::flush() {
+    const Endpoint::Timeout type = applyTimeout(Endpoint::Timeout::WRITE);
+    if (-1 == FCGX_FFlush(fcgiRequest_.out)) {
+        if (isTimeoutError(FCGX_GetError(fcgiRequest_.out))) {
+            timedOut(type);
+        }
+        std::stringstream str;
+        str << "Cannot write data to fastcgi socket: " << StringUtils::error(FCGX_GetError(fcgiRequest_.out)) << ". ";
+        generateRequestInfo(request_.get(), str);
+        throw std::runtime_error(str.str());
+    }
+}
+
+bool
+FastcgiRequest::sendFile(int fd, std::uint64_t offset, std::uint64_t length) {
+    // Records buffered by libfcgi have to precede the file records
+    flush();
+    const Endpoint::Timeout type = applyTimeout(Endpoint::Timeout::WRITE);
+    try {
+        return FcgiFileSender::send(fcgiRequest_.ipcFd, fcgiRequest_.requestId, fd, offset, length,
+            Endpoint::Timeout::REQUEST == type ? snd_timeout_ : endpoint_->timeout(type));
+    } catch (const std::system_error &e) {
+        if (ETIMEDOUT == e.code().value()) {
+            timedOut(type);
+        }
+        throw;
+    }
 }
 
 void
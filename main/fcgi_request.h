@@ -25,9 +25,15 @@
 #include <fcgiapp.h>
 #include <fcgio.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <vector>
 
+#include "endpoint.h"
+#include "fastcgi3/cancellation_token.h"
+#include "fastcgi3/request.h"
 #include "fastcgi3/request_io_stream.h"
 #include "details/handlerset.h"
 #include "fastcgi3/session_manager.h"
@@ -35,29 +41,62 @@
 namespace fastcgi
 {
 
-class Endpoint;
 class Logger;
-class Request;
 class ResponseTimeStatistics;
 
 class FastcgiRequest : public RequestIOStream {
 public:
     FastcgiRequest(std::shared_ptr<Request> request,
     		std::shared_ptr<Endpoint> endpoint,
+			int listenSocket,
 			std::shared_ptr<Logger> logger,
 			std::shared_ptr<ResponseTimeStatistics> statistics,
 			const bool logTimes);
     virtual ~FastcgiRequest();
-    void attach();
+    void attach(const std::function<Request::BodyMode(const Request*)> &bodyMode = nullptr);
 	int accept();
 	void finish();
+	void reset();
+
+	std::shared_ptr<Request> request() const;
+
+	/**
+	 * Token of the accepted request, the connection is checked for
+	 * FCGI_ABORT_REQUEST and hang up when the token is polled
+	 */
+	std::shared_ptr<CancellationToken> cancellation() const;
+
+	/**
+	 * The finished request keeps the connection of the web server open
+	 * for the next request
+	 */
+	bool keptConnection() const;
+
+	/**
+	 * Closes the kept connection, the request accepts the next one from the listening socket
+	 */
+	void closeConnection();
 
 	int read(char *buf, int size);
 	int write(const char *buf, int size);
 	void write(std::streambuf *buf);
+	bool sendFile(int fd, std::uint64_t offset, std::uint64_t length);
+	void flush();
 
 	void setHandlerDesc(const HandlerSet::HandlerDescription *handler);
 
+private:
+	CancellationToken::Reason probe();
+
+	/**
+	 * Applies the idle timeout limited by the request deadline to the socket,
+	 * returns the type of the timeout in effect
+	 */
+	Endpoint::Timeout applyTimeout(Endpoint::Timeout idle);
+	void setSocketTimeout(int option, std::chrono::milliseconds timeout);
+	static bool isTimeoutError(int error);
+	[[noreturn]] void timedOut(Endpoint::Timeout type);
+
 private:
 	std::shared_ptr<Request> request_;
 	std::shared_ptr<Logger> logger_;
@@ -69,6 +108,12 @@ private:
 	const bool logTimes_;
     timeval accept_time_, finish_time_;
     const HandlerSet::HandlerDescription* handler_;
+    bool accepted_;
+    bool body_skipped_;
+    std::shared_ptr<CancellationToken> cancellation_;
+    std::atomic<std::chrono::steady_clock::rep> last_probe_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::milliseconds rcv_timeout_, snd_timeout_;
 };
 
 } // namespace fastcgi
@@ -0,0 +1,86 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#include "fcgi_request.h"
+#include "fcgi_request_pool.h"
+
+#ifdef HAVE_DMALLOC_H
+#include <dmalloc.h>
+#endif
+
+namespace fastcgi
+{
+
+FastcgiRequestPool::FastcgiRequestPool(FactoryType factory, std::size_t capacity) :
+	factory_(std::move(factory)), capacity_(capacity)
+{
+	free_.reserve(capacity_);
+}
+
+FastcgiRequestPool::~FastcgiRequestPool() {
+}
+
+std::shared_ptr<FastcgiRequest>
+FastcgiRequestPool::acquire() {
+	std::unique_ptr<FastcgiRequest> request;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!free_.empty()) {
+			request = std::move(free_.back());
+			free_.pop_back();
+		}
+	}
+	if (!request) {
+		request = factory_();
+	}
+
+	std::shared_ptr<FastcgiRequestPool> self = shared_from_this();
+	return std::shared_ptr<FastcgiRequest>(request.release(), [self](FastcgiRequest *r) {
+		self->release(r);
+	});
+}
+
+std::size_t
+FastcgiRequestPool::size() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return free_.size();
+}
+
+void
+FastcgiRequestPool::release(FastcgiRequest *request) {
+	std::unique_ptr<FastcgiRequest> r(request);
+	try {
+		r->finish();
+		r->reset();
+		if (r->keptConnection()) {
+			// The next accept would wait for the next request of this very connection
+			// while the other connections are left unserved, so it is closed instead
+			r->closeConnection();
+		}
+	} catch (...) {
+		// Object in unknown state can not be reused
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (free_.size() < capacity_) {
+		free_.push_back(std::move(r));
+	}
+}
+
+} // namespace fastcgi
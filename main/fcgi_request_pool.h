@@ -0,0 +1,69 @@
+// Fastcgi Container - framework for development of high performance FastCGI applications in C++
+// Copyright (C) 2015 Alexander Ponomarenko <contact@propulsion-analysis.com>
+
+// This file is part of Fastcgi Container.
+//
+// Fastcgi Container is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License (LGPL) as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fastcgi Container is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License (LGPL) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License (LGPL)
+// along with Fastcgi Container. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FASTCGI_FASTCGI_REQUEST_POOL_H_
+#define _FASTCGI_FASTCGI_REQUEST_POOL_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fastcgi
+{
+
+class FastcgiRequest;
+
+/**
+ * Recycling pool of the libfcgi request objects of a single endpoint thread.
+ *
+ * Acquired request is returned back to the pool (finished and reset)
+ * when the last reference to it is dropped, so FCGX_Request, Request
+ * and their buffers are reused by the subsequent requests.
+ * The request still holding a kept connection is not pooled,
+ * its connection is closed when it is destroyed.
+ */
+class FastcgiRequestPool : public std::enable_shared_from_this<FastcgiRequestPool> {
+public:
+	using FactoryType = std::function<std::unique_ptr<FastcgiRequest>()>;
+
+	static const std::size_t DEFAULT_CAPACITY = 16;
+
+public:
+	FastcgiRequestPool(FactoryType factory, std::size_t capacity = DEFAULT_CAPACITY);
+	virtual ~FastcgiRequestPool();
+
+	FastcgiRequestPool(const FastcgiRequestPool&) = delete;
+	FastcgiRequestPool& operator=(const FastcgiRequestPool&) = delete;
+
+	std::shared_ptr<FastcgiRequest> acquire();
+	std::size_t size() const;
+
+private:
+	void release(FastcgiRequest *request);
+
+private:
+	FactoryType factory_;
+	const std::size_t capacity_;
+	mutable std::mutex mutex_;
+	std::vector<std::unique_ptr<FastcgiRequest>> free_;
+};
+
+} // namespace fastcgi
+
+#endif // _FASTCGI_FASTCGI_REQUEST_POOL_H_
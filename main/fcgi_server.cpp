@@ -34,7 +34,10 @@
 #include <sys/time.h>
 
 #include "endpoint.h"
+#include "fcgi_native_request.h"
+#include "fcgi_reactor.h"
 #include "fcgi_request.h"
+#include "fcgi_request_pool.h"
 #include "fcgi_server.h"
 
 #include "fastcgi3/util.h"
@@ -47,7 +50,9 @@
 #include "fastcgi3/component.h"
 #include "fastcgi3/request_io_stream.h"
 
+#include "details/background_executor.h"
 #include "details/componentset.h"
+#include "details/cpu_affinity.h"
 #include "details/globals.h"
 #include "details/handler_context.h"
 #include "details/handlerset.h"
@@ -149,9 +154,33 @@ FCGIServer::join() {
 	}
 	globals_->joinThreadPools();
 
+	for (auto &reactor : reactors_) {
+		reactor->join();
+	}
+
 	while (!active_thread_holder_.unique()) {
 		usleep(10000);
 	}
+
+	// Endpoint threads are woken from accept by the stop, the elastic ones may be added meanwhile
+	while (true) {
+		std::vector<std::unique_ptr<std::thread>> threads;
+		{
+			std::lock_guard<std::mutex> lock(threadsMutex_);
+			threads.swap(globalPool_);
+			retiredThreads_.clear();
+		}
+		if (threads.empty()) {
+			break;
+		}
+		for (auto &thread : threads) {
+			thread->join();
+		}
+	}
+
+	// No request is left to add the work, the queued one is still done
+	globals_->stopExecutors();
+	globals_->joinExecutors();
 }
 
 void
@@ -170,6 +199,14 @@ FCGIServer::stopInternal() {
 	stopper_->stopped(true);
 
 	FCGX_ShutdownPending();
+	for (auto &endpoint : endpoints_) {
+		if (Endpoint::Engine::LIBFCGI == endpoint->engine()) {
+			endpoint->stopAccepting();
+		}
+	}
+	for (auto &reactor : reactors_) {
+		reactor->stop();
+	}
 	globals_->stopThreadPools();
 
 }
@@ -257,9 +294,28 @@ FCGIServer::initTimeStatistics() {
 void
 FCGIServer::createWorkThreads() {
 	for (auto &endpoint : endpoints_) {
-		std::function<void()> f = std::bind(&FCGIServer::handle, this, endpoint);
-		for (unsigned short t=0, threads=endpoint->threads(); t<threads; ++t) {
-            globalPool_.push_back(std::make_unique<std::thread>(f));
+		if (Endpoint::Engine::NATIVE == endpoint->engine()) {
+			FcgiReactor::RequestHandlerType h = std::bind(&FCGIServer::handleNative, this, endpoint,
+				std::placeholders::_1, std::placeholders::_2);
+			FcgiConnection::StreamSelectorType selector = [this](FcgiConnection::RequestState &state) {
+				switch (bodyMode(state)) {
+				case Request::BodyMode::STREAM:
+					return FcgiConnection::Dispatch::STREAM;
+				case Request::BodyMode::SKIP:
+					return FcgiConnection::Dispatch::REJECT;
+				default:
+					return FcgiConnection::Dispatch::ON_BODY;
+				}
+			};
+			for (unsigned short t=0, threads=endpoint->threads(); t<threads; ++t) {
+				reactors_.push_back(std::make_unique<FcgiReactor>(endpoint, endpoint->socket(t), h, globals_->logger(), selector));
+				reactors_.back()->start();
+			}
+			continue;
+		}
+
+		for (unsigned short t=0, threads=endpoint->minThreads(); t<threads; ++t) {
+			addEndpointThread(endpoint, endpoint->claimListener());
 		}
 	}
 }
@@ -272,16 +328,41 @@ FCGIServer::initFastCGISubsystem() {
 
 	const Config *config = globals_->config();
 
+	// Requests which can be in process simultaneously: all pool threads and queues
+	unsigned int maxRequests = 0;
+	for (auto &pool : globals_->pools()) {
+		ThreadPoolInfo info = pool.second->getInfo();
+		maxRequests += info.maxThreadsNumber + info.queueLength;
+	}
+
 	std::vector<std::string> v;
 	config->subKeys("/fastcgi/daemon/endpoint", v);
 
 	for (auto &c : v) {
+		const std::string engine = config->asString(c + "/@engine", "libfcgi");
+		if ("libfcgi" != engine && "native" != engine) {
+			throw std::runtime_error("Unknown endpoint engine: " + engine);
+		}
+
 		std::shared_ptr<Endpoint> endpoint = std::make_shared<Endpoint>(
 			config->asString(c + "/socket", StringUtils::EMPTY_STRING),
 			config->asString(c + "/port", StringUtils::EMPTY_STRING),
 			config->asString(c + "/@keepalive", config->asString(c + "/@keepConnection", "true"))=="true"?1:0,
-			config->asInt(c + "/threads", 1)
+			config->asInt(c + "/max-threads", config->asInt(c + "/threads", 1)),
+			"native" == engine ? Endpoint::Engine::NATIVE : Endpoint::Engine::LIBFCGI
 		);
+		endpoint->setMultiplex(config->asString(c + "/@multiplex", "false") == "true");
+		endpoint->setLimits(maxRequests, maxRequests);
+		endpoint->setListeners(config->asInt(c + "/listeners", 1));
+		endpoint->setAffinity(CpuAffinity::create(config->asString(c + "/@cpus", StringUtils::EMPTY_STRING),
+			config->asInt(c + "/@numa-node", -1)));
+		const int minThreads = config->asInt(c + "/min-threads", endpoint->threads());
+		if (minThreads != endpoint->threads()) {
+			endpoint->setElastic(minThreads, std::chrono::milliseconds(config->asInt(c + "/@thread-idle-timeout", 60000)));
+		}
+		endpoint->setTimeout(Endpoint::Timeout::READ, std::chrono::milliseconds(config->asInt(c + "/@read-timeout", 0)));
+		endpoint->setTimeout(Endpoint::Timeout::WRITE, std::chrono::milliseconds(config->asInt(c + "/@write-timeout", 0)));
+		endpoint->setTimeout(Endpoint::Timeout::REQUEST, std::chrono::milliseconds(config->asInt(c + "/@request-timeout", 0)));
 
 		const int backlog = config->asInt(c + "/backlog", SOMAXCONN);
 		endpoint->openSocket(backlog);
@@ -294,23 +375,61 @@ FCGIServer::initFastCGISubsystem() {
 }
 
 void
-FCGIServer::handle(std::shared_ptr<Endpoint> endpoint) {
+FCGIServer::addEndpointThread(std::shared_ptr<Endpoint> endpoint, unsigned int listener) {
+	std::lock_guard<std::mutex> lock(threadsMutex_);
+	for (const std::thread::id &id : retiredThreads_) {
+		auto it = std::find_if(globalPool_.begin(), globalPool_.end(),
+			[&id](const std::unique_ptr<std::thread> &thread) { return thread->get_id() == id; });
+		if (globalPool_.end() != it) {
+			(*it)->join();
+			globalPool_.erase(it);
+		}
+	}
+	retiredThreads_.clear();
+
+	std::function<void()> f = std::bind(&FCGIServer::handle, this, endpoint, listener);
+	globalPool_.push_back(std::make_unique<std::thread>(f));
+}
+
+void
+FCGIServer::handle(std::shared_ptr<Endpoint> endpoint, unsigned int listener) {
 	std::shared_ptr<ServerStopper> stopper = stopper_;
 	std::shared_ptr<Logger> logger = globals_->logger();
+	const int listenSocket = endpoint->socket(listener);
+
+	if (!endpoint->affinity().apply()) {
+		logger->error("Cannot pin the thread of the endpoint %s to CPUs %s",
+			endpoint->toString().c_str(), endpoint->affinity().toString().c_str());
+	}
+
+	std::shared_ptr<FastcgiRequestPool> pool = std::make_shared<FastcgiRequestPool>([this, endpoint, listenSocket, logger]() {
+		return std::make_unique<FastcgiRequest>(std::make_shared<Request>(logger, request_cache_, sessionManager_),
+			endpoint, listenSocket, logger, time_statistics_, logTimes_);
+	});
 
 	while (true) {
 		try {
 			if (stopper->stopped()) {
 				return;
 			}
+			if (endpoint->removeThread(listener)) {
+				// The elastic endpoint has not needed this thread for a while
+				std::lock_guard<std::mutex> lock(threadsMutex_);
+				retiredThreads_.push_back(std::this_thread::get_id());
+				return;
+			}
 			std::shared_ptr<ThreadHolder> holder = active_thread_holder_;
 
 			Endpoint::ScopedBusyCounter busyCounter(*endpoint.get());
-			RequestTask task;
-			task.request = std::make_shared<Request>(logger, request_cache_, sessionManager_);
-			task.request_stream = std::make_shared<FastcgiRequest>(task.request, endpoint, logger, time_statistics_, logTimes_);
+			std::shared_ptr<FastcgiRequest> stream = pool->acquire();
+			FastcgiRequest *request = stream.get();
 
-			FastcgiRequest *request = dynamic_cast<FastcgiRequest*>(task.request_stream.get());
+			// Request shares the lifetime of its pooled stream
+			RequestTask task;
+			task.request = std::shared_ptr<Request>(stream, stream->request().get());
+			task.request_stream = std::move(stream);
+			task.runInline = true;
+			task.node = endpoint->affinity().numaNode();
 
 			busyCounter.decrement();
 			holder.reset();
@@ -323,19 +442,38 @@ FCGIServer::handle(std::shared_ptr<Endpoint> endpoint) {
 				throw std::runtime_error("Failed to accept fastcgi request: " + std::to_string(status));
 			}
 			busyCounter.increment();
+			unsigned int next = 0;
+			if (endpoint->addThread(next)) {
+				// All threads of the elastic endpoint are busy
+				addEndpointThread(endpoint, next);
+			}
+			task.cancellation = request->cancellation();
 
+			bool rejected = false;
 			try {
-				request->attach();
+				request->attach([this, &rejected](const Request *r) {
+					const Request::BodyMode mode = bodyMode(r);
+					rejected = Request::BodyMode::SKIP == mode;
+					return mode;
+				});
 			} catch (const std::exception &e) {
 				logger->error("Failed to attach fastcgi request: %s", e.what());
 				task.request->sendError(400);
 				continue;
 			}
 
+			if (rejected) {
+				reject(task.request.get());
+				continue;
+			}
+
 			try {
-				handleRequest(task);
+				handleRequest(std::move(task));
 			} catch (const std::exception &e) {
-				task.request->sendError(500);
+				// The task handed over to the pool is answered there
+				if (task.request) {
+					task.request->sendError(500);
+				}
 			}
 
 		} catch (const std::exception &e) {
@@ -347,45 +485,191 @@ FCGIServer::handle(std::shared_ptr<Endpoint> endpoint) {
 }
 
 void
-FCGIServer::handleRequest(RequestTask task) {
+FCGIServer::handleNative(std::shared_ptr<Endpoint> endpoint, std::shared_ptr<FcgiConnection> connection,
+		std::shared_ptr<FcgiConnection::RequestState> state) {
+	if (stopper_->stopped()) {
+		return;
+	}
+	// The reactor does not attach the request itself: the body may be spooled to a file.
+	// The request is posted to the default pool as a continuation, which the queue limit
+	// does not apply to, the pool of the handler has been checked by the admission already
+	RequestTask task;
+	task.node = endpoint->affinity().numaNode();
+	task.resume = [this, endpoint, connection, state]() {
+		dispatchNative(endpoint, connection, state);
+	};
+	try {
+		getPool(nullptr, task.node)->addContinuation(std::move(task));
+	} catch (const std::exception &e) {
+		// The pool is stopped, the connection is closed with the server
+		logger()->error("cannot handle fastcgi request: %s", e.what());
+	}
+}
+
+void
+FCGIServer::dispatchNative(std::shared_ptr<Endpoint> endpoint, std::shared_ptr<FcgiConnection> connection,
+		std::shared_ptr<FcgiConnection::RequestState> state) {
+	std::shared_ptr<Logger> logger = globals_->logger();
+	std::shared_ptr<ThreadHolder> holder = active_thread_holder_;
+
+	Endpoint::ScopedBusyCounter busyCounter(*endpoint.get());
+	RequestTask task;
+	task.request = state->request ? state->request : std::make_shared<Request>(logger, request_cache_, sessionManager_);
+	std::shared_ptr<NativeFastcgiRequest> request = std::make_shared<NativeFastcgiRequest>(
+		task.request, endpoint, connection, state, logger, time_statistics_, logTimes_);
+	task.request_stream = request;
+	task.cancellation = state->cancellation;
+	task.node = endpoint->affinity().numaNode();
+
+	try {
+		request->attach();
+	} catch (const std::exception &e) {
+		logger->error("Failed to attach fastcgi request: %s", e.what());
+		task.request->sendError(400);
+		return;
+	}
+
+	if (state->rejected) {
+		reject(task.request.get());
+		return;
+	}
+
+	try {
+		handleRequest(std::move(task));
+	} catch (const std::exception &e) {
+		// The task handed over to the pool is answered there
+		if (task.request) {
+			task.request->sendError(500);
+		}
+	}
+}
+
+namespace {
+
+/**
+ * Stream of the request parsed from its params only, nothing is read or written
+ */
+class ParamsStream : public RequestIOStream {
+public:
+	int read(char*, int) {
+		return 0;
+	}
+	int write(const char*, int size) {
+		return size;
+	}
+	void write(std::streambuf*) {
+	}
+};
+
+} // namespace
+
+Request::BodyMode
+FCGIServer::bodyMode(FcgiConnection::RequestState &state) const {
+	// The body mode is selected by the reactor as soon as the params are received:
+	// the handlers selected by their urls only are found by the script name
+	if (globals_->handlers()->urlSelectorsOnly()) {
+		std::string scriptName;
+		for (auto &e : state.env) {
+			if (0 == e.compare(0, sizeof("SCRIPT_NAME=") - 1, "SCRIPT_NAME=")) {
+				scriptName = e.substr(sizeof("SCRIPT_NAME=") - 1);
+				break;
+			}
+		}
+		return bodyMode(globals_->handlers()->findURIHandler(scriptName));
+	}
+
+	// The other selectors are checked against the request parsed from the params,
+	// the arguments of the body are not known yet. The request is kept for its attach
+	std::vector<char*> envp;
+	envp.reserve(state.env.size() + 1);
+	for (auto &e : state.env) {
+		envp.push_back(const_cast<char*>(e.c_str()));
+	}
+	envp.push_back(nullptr);
+
+	ParamsStream stream;
+	std::shared_ptr<Request> request = std::make_shared<Request>(logger(), request_cache_, sessionManager_);
+	Request::BodyMode mode = Request::BodyMode::READ;
+	request->attach(&stream, &envp[0], [this, &mode](const Request *r) {
+		mode = bodyMode(r);
+		return Request::BodyMode::SKIP;
+	});
+	state.request = std::move(request);
+	return mode;
+}
+
+Request::BodyMode
+FCGIServer::bodyMode(const Request *request) const {
+	// The body mode is selected before the body is read, the handler is selected
+	// by the params and the arguments of the query string
+	return bodyMode(globals_->handlers()->findURIHandler(request));
+}
+
+Request::BodyMode
+FCGIServer::bodyMode(const HandlerSet::HandlerDescription *handler) const {
+	// Admission check: the request which cannot be queued by its pool
+	// is rejected before its body is read
+	if (getPool(handler)->saturated()) {
+		return Request::BodyMode::SKIP;
+	}
+	return nullptr != handler && handler->streamBody ? Request::BodyMode::STREAM : Request::BodyMode::READ;
+}
+
+void
+FCGIServer::reject(Request *request) const {
+	const HandlerSet::HandlerDescription* handler = globals_->handlers()->findURIHandler(request);
+	logger()->error("cannot add request to pool: pool is saturated, %s is rejected", request->getUrl().c_str());
+	sendUnavailable(request, getPool(handler));
+}
+
+static void
+setHandlerDesc(RequestIOStream *stream, const HandlerSet::HandlerDescription *handler) {
+	if (FastcgiRequest *request = dynamic_cast<FastcgiRequest*>(stream)) {
+		request->setHandlerDesc(handler);
+	} else if (NativeFastcgiRequest *request = dynamic_cast<NativeFastcgiRequest*>(stream)) {
+		request->setHandlerDesc(handler);
+	}
+}
+
+void
+FCGIServer::handleRequest(RequestTask &&task) {
 	logger()->debug("Handling request %s", task.request->getScriptName().c_str());
 
-	task.futureHandlers = [this](RequestTask task) {
+	task.futureHandler = [this](const RequestTask &task) {
 		const HandlerSet::HandlerDescription* handler = getHandler(task);
 		if (nullptr == handler || handler->handlers.empty()) {
 			throw NotFound();
 		}
 
-		FastcgiRequest *request = dynamic_cast<FastcgiRequest*>(task.request_stream.get());
-		request->setHandlerDesc(handler);
+		setHandlerDesc(task.request_stream.get(), handler);
 
-		return handler->handlers;
+		return handler;
 	};
 
-	task.dispatch = [this](RequestTask task) {
+	task.dispatch = [this](RequestTask &&task) {
 		logger()->debug("Dispatching request %s", task.request->getScriptName().c_str());
 
-		std::vector<std::shared_ptr<Filter>> filters;
-		getFilters(task, filters);
+		const HandlerSet::FilterMask filters = getFilters(task);
 
 		const HandlerSet::HandlerDescription* handler = getHandler(task);
-		if ((nullptr == handler || handler->handlers.empty()) && !filters.empty()) {
+		if ((nullptr == handler || handler->handlers.empty()) && 0 != filters) {
 			// Handler not found - let the filter(s) to be executed
 			// and then try to find the handler again
 			// Example: "athenticator"-filter may redirect the
 			// request to undefined path (like "j_security_check") and
 			// after the login redirect back to the original path
-			handleRequestInternal(filters, task);
+			handleRequestInternal(filters, std::move(task));
 		} else {
-			FastcgiRequest *request = dynamic_cast<FastcgiRequest*>(task.request_stream.get());
-			request->setHandlerDesc(handler);
+			setHandlerDesc(task.request_stream.get(), handler);
 
-			handleRequestInternal(filters, handler, task);
+			handleRequestInternal(filters, handler, std::move(task));
 		}
 
 	};
 
-	task.dispatch(task);
+	// The dispatcher moves the task it belongs to
+	const std::function<void(RequestTask&&)> dispatch = task.dispatch;
+	dispatch(std::move(task));
 }
 
 void
@@ -489,8 +773,15 @@ FCGIServer::getServerInfo() const {
 		for (auto &endpoint : endpoints_) {
 			info << t3 << "<endpoint"
 				 << " socket=\"" << endpoint->toString() << "\""
-				 << " threads=\"" << endpoint->threads() << "\""
+				 << " engine=\"" << (Endpoint::Engine::NATIVE == endpoint->engine() ? "native" : "libfcgi") << "\""
+				 << " threads=\"" << endpoint->liveThreads() << "\""
+				 << " min_threads=\"" << endpoint->minThreads() << "\""
+				 << " max_threads=\"" << endpoint->threads() << "\""
 				 << " busy=\"" << endpoint->getBusyCounter() << "\""
+				 << " cpus=\"" << endpoint->affinity().toString() << "\""
+				 << " read_timeouts=\"" << endpoint->timeoutCounter(Endpoint::Timeout::READ) << "\""
+				 << " write_timeouts=\"" << endpoint->timeoutCounter(Endpoint::Timeout::WRITE) << "\""
+				 << " request_timeouts=\"" << endpoint->timeoutCounter(Endpoint::Timeout::REQUEST) << "\""
 				 << "/>\n";
 		}
 		info << t2 << "</endpoint_pools>\n";
@@ -503,15 +794,57 @@ FCGIServer::getServerInfo() const {
 			uint64_t badTasks = tpinfo.badTasksCounter;
 			info << t2 << "<pool name=\"" << map.first << "\""
 				 << " threads=\"" << tpinfo.threadsNumber << "\""
+				 << " live_threads=\"" << tpinfo.liveThreads << "\""
+				 << " min_threads=\"" << tpinfo.minThreadsNumber << "\""
+				 << " max_threads=\"" << tpinfo.maxThreadsNumber << "\""
 				 << " busy=\"" << tpinfo.busyThreadsCounter << "\""
 				 << " queue=\"" << tpinfo.queueLength << "\""
 				 << " current_queue=\"" << tpinfo.currentQueue << "\""
+				 << " cpus=\"" << pool->affinity().toString() << "\""
+				 << " scheduler=\"" << (Scheduler::WORK_STEALING == pool->scheduler() ? "work-stealing" : "shared-queue") << "\""
+				 << " batch=\"" << pool->batchSize() << "\""
+				 << " stolen_tasks=\"" << tpinfo.stolenTasksCounter << "\""
+				 << " inline_tasks=\"" << tpinfo.inlineTasksCounter << "\""
+				 << " overloaded=\"" << (pool->overloaded() ? "true" : "false") << "\""
+				 << " shed_tasks=\"" << pool->shedTasksCounter() << "\""
 				 << " all_tasks=\"" << (goodTasks + badTasks)  << "\""
-				 << " exception_tasks=\"" << badTasks << "\""
-				 << "/>\n";
+				 << " exception_tasks=\"" << badTasks << "\"";
+
+			const std::vector<PriorityClassInfo> classes = pool->getPriorityClassInfo();
+			if (classes.empty()) {
+				info << "/>\n";
+				continue;
+			}
+			info << ">\n";
+			for (auto &c : classes) {
+				info << t3 << "<class name=\"" << c.name << "\""
+					 << " weight=\"" << c.weight << "\""
+					 << " queue=\"" << c.queueLength << "\""
+					 << " current_queue=\"" << c.currentQueue << "\""
+					 << " all_tasks=\"" << c.tasksCounter << "\""
+					 << "/>\n";
+			}
+			info << t2 << "</pool>\n";
 		}
 
 		info << t1 << "</pools>\n";
+
+		info << t1 << "<executors>\n";
+		for (auto &map : globals_->executors()) {
+			const BackgroundExecutor *executor = map.second.get();
+			ExecutorInfo einfo = executor->getInfo();
+			info << t2 << "<executor name=\"" << map.first << "\""
+				 << " threads=\"" << einfo.threadsNumber << "\""
+				 << " busy=\"" << einfo.busyThreadsCounter << "\""
+				 << " queue=\"" << einfo.queueLength << "\""
+				 << " current_queue=\"" << einfo.currentQueue << "\""
+				 << " drop_policy=\"" << (BackgroundExecutor::DropPolicy::DROP_OLDEST == executor->dropPolicy() ? "drop-oldest" : "reject") << "\""
+				 << " all_tasks=\"" << (einfo.completedTasksCounter + einfo.failedTasksCounter) << "\""
+				 << " exception_tasks=\"" << einfo.failedTasksCounter << "\""
+				 << " dropped_tasks=\"" << einfo.droppedTasksCounter << "\""
+				 << "/>\n";
+		}
+		info << t1 << "</executors>\n";
 	}
 	
 	info << "</fastcgi-container>\n";
@@ -31,6 +31,8 @@
 #include "details/server.h"
 #include "fastcgi3/session_manager.h"
 
+#include "fcgi_connection.h"
+
 namespace fastcgi
 {
 
@@ -39,6 +41,7 @@ class Request;
 class Logger;
 class Loader;
 class Endpoint;
+class FcgiReactor;
 class ComponentSet;
 class HandlerSet;
 class RequestsThreadPool;
@@ -94,8 +97,17 @@ public:
 private:
 	virtual const Globals* globals() const;
 	virtual std::shared_ptr<Logger> logger() const override;
-	virtual void handleRequest(RequestTask task) override;
-	void handle(std::shared_ptr<Endpoint> endpoint);
+	virtual void handleRequest(RequestTask &&task) override;
+	void handle(std::shared_ptr<Endpoint> endpoint, unsigned int listener);
+	void addEndpointThread(std::shared_ptr<Endpoint> endpoint, unsigned int listener);
+	Request::BodyMode bodyMode(FcgiConnection::RequestState &state) const;
+	Request::BodyMode bodyMode(const Request *request) const;
+	Request::BodyMode bodyMode(const HandlerSet::HandlerDescription *handler) const;
+	void reject(Request *request) const;
+	void handleNative(std::shared_ptr<Endpoint> endpoint, std::shared_ptr<FcgiConnection> connection,
+			std::shared_ptr<FcgiConnection::RequestState> state);
+	void dispatchNative(std::shared_ptr<Endpoint> endpoint, std::shared_ptr<FcgiConnection> connection,
+			std::shared_ptr<FcgiConnection::RequestState> state);
 	void monitor();
 
 	std::string getServerInfo() const;
@@ -136,6 +148,10 @@ private:
 
 	bool logTimes_;
 	std::vector<std::unique_ptr<std::thread>> globalPool_;
+	// Elastic endpoint threads which have exited and are joined when the next one is added
+	std::vector<std::thread::id> retiredThreads_;
+	std::mutex threadsMutex_;
+	std::vector<std::unique_ptr<FcgiReactor>> reactors_;
 
 };
 
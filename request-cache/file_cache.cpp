@@ -341,7 +341,7 @@ FileRequestCache::handle() {
 				active_.insert(std::make_pair(delay_task.key, delay_task.retries));
 			}
 			task.request->parse(buffer);
-			handleRequest(task);
+			handleRequest(std::move(task));
 		} catch (const std::exception &e) {
 			logger_->error("caught exception while handling request: %s", e.what());
 		} catch (...) {